@@ -28,6 +28,8 @@
 // If functions are in separate .c files, include here the corresponding .h files
 //
 #include "display.h"
+#include "fused.h"
+#include "hadamard.h"
 
 /* ================================================================== */
 /* ================================================================== */
@@ -49,6 +51,8 @@ INIT_MODULE_LIB(KalAO_BMC)
  */
 static errno_t init_module_CLI() {
     CLIADDCMD_KalAO_BMC__display();
+    CLIADDCMD_KalAO_BMC__fused();
+    CLIADDCMD_KalAO_BMC__hadamard();
 
     return RETURN_SUCCESS;
 }
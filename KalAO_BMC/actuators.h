@@ -0,0 +1,18 @@
+#ifndef _MILK_KALAO_BMC_ACTUATORS_H
+#define _MILK_KALAO_BMC_ACTUATORS_H
+
+// Geometry of the BMC DM: 140 actuators on a 12x12 grid without the corners,
+// tip-tilt mirror driven by the same controller
+#define DM_SIZE 12
+#define NB_ACTUATORS 140
+#define NB_TTM_CHANNELS 2
+
+// Index of the tip-tilt channels in the driver array
+#define TTM_INDEX 155
+
+// Index of actuator ii in the 12x12 map (the four corners are not populated)
+static inline int actuator_pixel(int ii) {
+    return ii + 1 + (ii >= 10) + (ii >= 130);
+}
+
+#endif
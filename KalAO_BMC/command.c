@@ -0,0 +1,75 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "COREMOD_iofits/file_exists.h"
+#include "COREMOD_iofits/is_fits_file.h"
+#include "COREMOD_iofits/loadfits.h"
+
+#include "command.h"
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+int bmc_load_linearization(BMC_LINEARIZATION_LUT *lut, const char *fname, const char *tmpname) {
+    imageID luttmpID = -1;
+
+    if (!file_exists(fname)) {
+        printf("Linearization file %s not found\n", fname);
+    } else if (!is_fits_file(fname)) {
+        printf("Linearization file %s is not a valid FITS file\n", fname);
+    } else {
+        load_fits(fname, tmpname, 1, &luttmpID);
+
+        if (data.image[luttmpID].md->datatype != _DATATYPE_FLOAT) {
+            printf("Wrong data type for linearization file %s\n", fname);
+            luttmpID = -1;
+        } else if (data.image[luttmpID].md->naxis != 2 || data.image[luttmpID].md->size[0] < 2 || data.image[luttmpID].md->size[1] != NB_LUT_CHANNELS) {
+            printf("Wrong size for linearization file %s\n", fname);
+            luttmpID = -1;
+        }
+    }
+
+    free(lut->y0);
+    free(lut->slope);
+
+    lut->NBpts = 0;
+    lut->y0 = NULL;
+    lut->slope = NULL;
+
+    if (luttmpID == -1) {
+        return RETURN_FAILURE;
+    }
+
+    // Each row maps a uniform grid of requested positions in [0, 1] to the
+    // command giving that position. Segments are precomputed so that the
+    // evaluation is a single multiply-add per channel.
+    int NBpts = data.image[luttmpID].md->size[0];
+    int NBseg = NBpts - 1;
+
+    lut->y0 = (float *)malloc(sizeof(float) * NB_LUT_CHANNELS * NBseg);
+    lut->slope = (float *)malloc(sizeof(float) * NB_LUT_CHANNELS * NBseg);
+
+    for (int ch = 0; ch < NB_LUT_CHANNELS; ch++) {
+        float *row = &data.image[luttmpID].array.F[ch * NBpts];
+
+        for (int k = 0; k < NBseg; k++) {
+            lut->y0[ch * NBseg + k] = row[k];
+            lut->slope[ch * NBseg + k] = row[k + 1] - row[k];
+        }
+    }
+
+    lut->NBpts = NBpts;
+
+    printf("Loaded linearization with %d points per channel\n", NBpts);
+
+    return RETURN_SUCCESS;
+}
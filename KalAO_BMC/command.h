@@ -0,0 +1,129 @@
+#ifndef _MILK_KALAO_BMC_COMMAND_H
+#define _MILK_KALAO_BMC_COMMAND_H
+
+#include "actuators.h"
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Conversion of DM and tip-tilt inputs to the driver array, shared by display
+ * and the fused pipeline (fused.c).
+ */
+
+#define NB_LUT_CHANNELS (NB_ACTUATORS + NB_TTM_CHANNELS)
+
+// Size of the driver array written by bmc_build_command
+#define BMC_ARRAY_SIZE 160
+
+typedef struct
+{
+    int NBpts;
+
+    // precomputed segments, NBchannels x (NBpts - 1)
+    float *y0;
+    float *slope;
+
+} BMC_LINEARIZATION_LUT;
+
+// tmpname is the stream the file is loaded into
+int bmc_load_linearization(BMC_LINEARIZATION_LUT *lut, const char *fname, const char *tmpname);
+
+static inline void bmc_apply_linearization(
+    BMC_LINEARIZATION_LUT *lut,
+    int channel,
+    double *restrict in,
+    double *restrict out,
+    int n) {
+    int NBseg = lut->NBpts - 1;
+    float scale = NBseg;
+
+    const float *restrict y0 = &lut->y0[channel * NBseg];
+    const float *restrict slope = &lut->slope[channel * NBseg];
+
+    // Branch-free so that the loop vectorizes
+    for (int ii = 0; ii < n; ii++) {
+        float t = fminf(fmaxf((float)in[ii] * scale, 0), scale);
+        int k = (int)t;
+        k -= (k == NBseg);
+
+        out[ii] = y0[ii * NBseg + k] + slope[ii * NBseg + k] * (t - k);
+    }
+}
+
+/*
+ * Fill dm_array (BMC_ARRAY_SIZE) from the actuators (NB_ACTUATORS) and
+ * tip-tilt (NB_TTM_CHANNELS) inputs: scaling to the driver range, clipping
+ * and stroke mode (0 = Mid-stroke, 1 = Minimize stroke).
+ */
+static inline void bmc_build_command(
+    const float *restrict dm_input,
+    const float *restrict ttm_input,
+    float max_stroke,
+    int stroke_mode,
+    float target_stroke,
+    double *restrict dm_array) {
+    int ii;
+    float full_stroke = max_stroke;
+    float half_stroke = max_stroke / 2;
+
+    for (ii = 0; ii < NB_ACTUATORS; ii++)
+        dm_array[ii] = dm_input[ii] / 3.5 + half_stroke;
+
+    dm_array[155] = ttm_input[0] / 5.0 + 0.5;
+    dm_array[156] = ttm_input[1] / 5.0 + 0.5;
+
+    // Prevent values to be out of range
+    for (ii = 0; ii < 140; ii++) {
+        if (dm_array[ii] > full_stroke)
+            dm_array[ii] = full_stroke;
+
+        if (dm_array[ii] < 0)
+            dm_array[ii] = 0;
+    }
+
+    for (; ii < BMC_ARRAY_SIZE; ii++) {
+        if (dm_array[ii] > 1)
+            dm_array[ii] = 1;
+
+        if (dm_array[ii] < 0)
+            dm_array[ii] = 0;
+    }
+
+    // Apply stroke mode
+
+    if (stroke_mode == 1) {
+        float min_stroke = 1;
+
+        for (ii = 0; ii < 140; ii++) {
+            if (dm_array[ii] < min_stroke)
+                min_stroke = dm_array[ii];
+        }
+
+        float offset = min_stroke - target_stroke;
+
+        if (offset > 0) {
+            for (ii = 0; ii < 140; ii++)
+                dm_array[ii] -= offset;
+        }
+    }
+}
+
+// Commands sent to the driver as a 12x12 map (corners set to 0) and tip-tilt
+static inline void bmc_write_commands(
+    const double *restrict dm_array,
+    float *restrict dm_out,
+    float *restrict ttm_out) {
+    dm_out[0] = 0;
+    dm_out[11] = 0;
+    dm_out[132] = 0;
+    dm_out[143] = 0;
+
+    for (int ii = 0; ii < NB_ACTUATORS; ii++)
+        dm_out[actuator_pixel(ii)] = dm_array[ii];
+
+    ttm_out[0] = dm_array[155];
+    ttm_out[1] = dm_array[156];
+}
+
+#endif
@@ -8,9 +8,22 @@
 #include "CommandLineInterface/CLIcore.h"
 #include "CommandLineInterface/fps/fps_GetParamIndex.h"
 
+#include "COREMOD_iofits/file_exists.h"
+#include "COREMOD_iofits/is_fits_file.h"
+#include "COREMOD_iofits/loadfits.h"
+
+#include "KalAO_Telemetry/histogram.h"
+#include "KalAO_Telemetry/instance.h"
+#include "KalAO_Telemetry/section_timers.h"
+#include "KalAO_Telemetry/trace.h"
+
+#include "actuators.h"
+#include "command.h"
+
 #include "BMCApi.h"
 
 #include <math.h>
+#include <time.h>
 
 /* ================================================================== */
 /* ================================================================== */
@@ -33,6 +46,63 @@ static long fpi_stroke_mode;
 static float *target_stroke;
 static long fpi_target_stroke;
 
+static uint64_t *linearization;
+static long fpi_linearization;
+
+static char *linearization_fname;
+static long fpi_linearization_fname;
+
+static uint64_t *latency_reset;
+static long fpi_latency_reset;
+
+static float *latency_p50;
+static long fpi_latency_p50;
+
+static float *latency_p99;
+static long fpi_latency_p99;
+
+static float *latency_max;
+static long fpi_latency_max;
+
+static float *driver_p50;
+static long fpi_driver_p50;
+
+static float *driver_p99;
+static long fpi_driver_p99;
+
+static float *driver_max;
+static long fpi_driver_max;
+
+static uint64_t *modes;
+static long fpi_modes;
+
+static char *modesin_streamname;
+static long fpi_modesin_streamname;
+
+static char *modes_matrix_fname;
+static long fpi_modes_matrix_fname;
+
+static char *DMchannels;
+static long fpi_DMchannels;
+
+static char *DMgains;
+static long fpi_DMgains;
+
+static char *TTMchannels;
+static long fpi_TTMchannels;
+
+static char *TTMgains;
+static long fpi_TTMgains;
+
+static char *trace_streamname;
+static long fpi_trace_streamname;
+
+static uint64_t *simulated;
+static long fpi_simulated;
+
+static char *instance;
+static long fpi_instance;
+
 static CLICMDARGDEF farg[] =
     {
         {
@@ -80,6 +150,177 @@ static CLICMDARGDEF farg[] =
             (void **)&target_stroke,
             &fpi_target_stroke,
         },
+        {
+            CLIARG_ONOFF,
+            ".linearization_on",
+            "Response linearization ON/OFF",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&linearization,
+            &fpi_linearization,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".linearization",
+            "Linearization LUT (NBpts x 142, 140 actuators + 2 tip-tilt)",
+            "bmc_linearization.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&linearization_fname,
+            &fpi_linearization_fname,
+        },
+        {
+            CLIARG_ONOFF,
+            ".latency.reset",
+            "Reset latency statistics",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&latency_reset,
+            &fpi_latency_reset,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".latency.p50",
+            "Input to send latency, median [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&latency_p50,
+            &fpi_latency_p50,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".latency.p99",
+            "Input to send latency, 99th percentile [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&latency_p99,
+            &fpi_latency_p99,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".latency.max",
+            "Input to send latency, maximum [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&latency_max,
+            &fpi_latency_max,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".driver.p50",
+            "Driver call duration, median [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&driver_p50,
+            &fpi_driver_p50,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".driver.p99",
+            "Driver call duration, 99th percentile [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&driver_p99,
+            &fpi_driver_p99,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".driver.max",
+            "Driver call duration, maximum [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&driver_max,
+            &fpi_driver_max,
+        },
+        {
+            CLIARG_ONOFF,
+            ".modes_on",
+            "Modal input ON/OFF",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&modes,
+            &fpi_modes,
+        },
+        {
+            CLIARG_IMG,
+            ".modesin",
+            "Mode coefficients stream",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&modesin_streamname,
+            &fpi_modesin_streamname,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".modes_matrix",
+            "Mode to actuator matrix (140 x NBmodes)",
+            "bmc_modes.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&modes_matrix_fname,
+            &fpi_modes_matrix_fname,
+        },
+        {
+            CLIARG_STR,
+            ".channels.DM",
+            "Additional DM channels (comma separated stream names)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&DMchannels,
+            &fpi_DMchannels,
+        },
+        {
+            CLIARG_STR,
+            ".channels.DMgains",
+            "Gains of .DMin and additional DM channels (comma separated)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&DMgains,
+            &fpi_DMgains,
+        },
+        {
+            CLIARG_STR,
+            ".channels.TTM",
+            "Additional Tip-Tilt channels (comma separated stream names)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&TTMchannels,
+            &fpi_TTMchannels,
+        },
+        {
+            CLIARG_STR,
+            ".channels.TTMgains",
+            "Gains of .TTMin and additional Tip-Tilt channels (comma separated)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&TTMgains,
+            &fpi_TTMgains,
+        },
+        {
+            CLIARG_IMG,
+            ".trace",
+            "Stream with the frame trace of the inputs (KalAO_Telemetry/trace.h)",
+            "shwfs_slopes",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&trace_streamname,
+            &fpi_trace_streamname,
+        },
+        {
+            CLIARG_ONOFF,
+            ".simulated",
+            "Stand-in driver without hardware (KalAO_Nuvu simulator)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&simulated,
+            &fpi_simulated,
+        },
+        {
+            CLIARG_STR,
+            ".instance",
+            "Instance name, suffix of the output streams (empty for the main pipeline)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&instance,
+            &fpi_instance,
+        },
 };
 
 static CLICMDDATA CLIcmddata =
@@ -89,6 +330,78 @@ static CLICMDDATA CLIcmddata =
         CLICMD_FIELDS_DEFAULTS,
 };
 
+#define MAXNB_CHANNELS 8
+
+typedef struct
+{
+    int NBmodes;
+
+    // mode-major, each mode padded to stride floats for aligned vector loads
+    int stride;
+    float *matrix;
+
+} BMC_MODES_MATRIX;
+
+#define MODES_STRIDE 144
+
+typedef struct
+{
+    int NBchannels;
+    imageID ID[MAXNB_CHANNELS];
+    float gain[MAXNB_CHANNELS];
+
+} BMC_CHANNELS;
+
+#define LATENCY_SAMPLES 1000
+#define LATENCY_UPDATE_PERIOD 100
+
+// Sections of the loop, see KalAO_Telemetry/section_timers.h
+enum {
+    SECTION_MAPPING,
+    SECTION_DRIVER,
+    SECTION_ECHO
+};
+
+/*
+ * State of one instance: parameters point into the FPS of the instance and
+ * output streams get its .instance suffix (see KalAO_Telemetry/instance.h).
+ * Instances run side by side as separate processes, the milk process loop
+ * is bound to data.fpsptr.
+ */
+typedef struct
+{
+    FUNCTION_PARAMETER_STRUCT *fps;
+    char *instance;
+
+    char *DMin_streamname;
+    char *TTMin_streamname;
+    float *max_stroke;
+    int64_t *stroke_mode;
+    float *target_stroke;
+    char *linearization_fname;
+    float *latency_p50;
+    float *latency_p99;
+    float *latency_max;
+    float *driver_p50;
+    float *driver_p99;
+    float *driver_max;
+    char *modesin_streamname;
+    char *modes_matrix_fname;
+    char *DMchannels;
+    char *DMgains;
+    char *TTMchannels;
+    char *TTMgains;
+    char *trace_streamname;
+
+    char commands_dm_streamname[KALAO_STREAMNAME_LEN];
+    char commands_ttm_streamname[KALAO_STREAMNAME_LEN];
+    char latency_streamname[KALAO_STREAMNAME_LEN];
+    char modes_tmp_streamname[KALAO_STREAMNAME_LEN];
+    char linearization_tmp_streamname[KALAO_STREAMNAME_LEN];
+    char timers_streamname[KALAO_STREAMNAME_LEN];
+
+} BMC_DISPLAY_CONTEXT;
+
 /* ================================================================== */
 /* ================================================================== */
 /*  FUNCTIONS                                                         */
@@ -118,14 +431,266 @@ static errno_t customCONFsetup() {
         data.fpsptr->parray[fpi_target_stroke].fpflag |= FPFLAG_MAXLIMIT;
         data.fpsptr->parray[fpi_target_stroke].val.f32[1] = 0; // min
         data.fpsptr->parray[fpi_target_stroke].val.f32[2] = 1; // max
+
+        data.fpsptr->parray[fpi_linearization].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_linearization_fname].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_latency_reset].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_modes].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_modes_matrix_fname].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_DMgains].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_TTMgains].fpflag |= FPFLAG_WRITERUN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static int load_modes_matrix(BMC_DISPLAY_CONTEXT *ctx, BMC_MODES_MATRIX *modes_matrix) {
+    imageID modestmpID = -1;
+
+    if (!file_exists(ctx->modes_matrix_fname)) {
+        printf("Modes matrix file %s not found\n", ctx->modes_matrix_fname);
+    } else if (!is_fits_file(ctx->modes_matrix_fname)) {
+        printf("Modes matrix file %s is not a valid FITS file\n", ctx->modes_matrix_fname);
+    } else {
+        load_fits(ctx->modes_matrix_fname, ctx->modes_tmp_streamname, 1, &modestmpID);
+
+        if (data.image[modestmpID].md->datatype != _DATATYPE_FLOAT) {
+            printf("Wrong data type for modes matrix file %s\n", ctx->modes_matrix_fname);
+            modestmpID = -1;
+        } else if (data.image[modestmpID].md->size[0] != NB_ACTUATORS) {
+            printf("Wrong size for modes matrix file %s\n", ctx->modes_matrix_fname);
+            modestmpID = -1;
+        }
+    }
+
+    free(modes_matrix->matrix);
+
+    modes_matrix->NBmodes = 0;
+    modes_matrix->matrix = NULL;
+
+    if (modestmpID == -1) {
+        return RETURN_FAILURE;
     }
 
+    int NBmodes = data.image[modestmpID].md->nelement / NB_ACTUATORS;
+
+    modes_matrix->stride = MODES_STRIDE;
+    modes_matrix->matrix = (float *)aligned_alloc(64, sizeof(float) * MODES_STRIDE * NBmodes);
+
+    for (int m = 0; m < NBmodes; m++) {
+        int ii = 0;
+
+        for (; ii < NB_ACTUATORS; ii++)
+            modes_matrix->matrix[m * MODES_STRIDE + ii] = data.image[modestmpID].array.F[m * NB_ACTUATORS + ii];
+
+        for (; ii < MODES_STRIDE; ii++)
+            modes_matrix->matrix[m * MODES_STRIDE + ii] = 0;
+    }
+
+    modes_matrix->NBmodes = NBmodes;
+
+    printf("Loaded modes matrix with %d modes\n", NBmodes);
+
     return RETURN_SUCCESS;
 }
 
+static void project_modes(
+    BMC_MODES_MATRIX *modes_matrix,
+    const float *restrict coeffs,
+    int NBcoeffs,
+    float *restrict out) {
+    int NBmodes = NBcoeffs < modes_matrix->NBmodes ? NBcoeffs : modes_matrix->NBmodes;
+    int stride = modes_matrix->stride;
+
+    const float *restrict M = __builtin_assume_aligned(modes_matrix->matrix, 64);
+
+    int m = 0;
+
+    // Blocks of 4 modes, so that each pass over the output does 4 FMAs per load/store
+    for (; m + 4 <= NBmodes; m += 4) {
+        const float *restrict M0 = &M[m * stride];
+        const float *restrict M1 = &M[(m + 1) * stride];
+        const float *restrict M2 = &M[(m + 2) * stride];
+        const float *restrict M3 = &M[(m + 3) * stride];
+
+        float c0 = coeffs[m];
+        float c1 = coeffs[m + 1];
+        float c2 = coeffs[m + 2];
+        float c3 = coeffs[m + 3];
+
+        for (int ii = 0; ii < MODES_STRIDE; ii++)
+            out[ii] += c0 * M0[ii] + c1 * M1[ii] + c2 * M2[ii] + c3 * M3[ii];
+    }
+
+    for (; m < NBmodes; m++) {
+        const float *restrict M0 = &M[m * stride];
+        float c0 = coeffs[m];
+
+        for (int ii = 0; ii < MODES_STRIDE; ii++)
+            out[ii] += c0 * M0[ii];
+    }
+}
+
+static void open_channels(
+    BMC_CHANNELS *channels,
+    imageID firstID,
+    char *names,
+    uint32_t sizeX,
+    uint32_t sizeY) {
+    char names_tmp[512];
+    char *saveptr;
+
+    channels->NBchannels = 1;
+    channels->ID[0] = firstID;
+    channels->gain[0] = 1;
+
+    strncpy(names_tmp, names, sizeof(names_tmp) - 1);
+    names_tmp[sizeof(names_tmp) - 1] = '\0';
+
+    for (char *name = strtok_r(names_tmp, ", ", &saveptr); name != NULL; name = strtok_r(NULL, ", ", &saveptr)) {
+        if (channels->NBchannels == MAXNB_CHANNELS) {
+            printf("Too many channels, ignoring %s\n", name);
+            continue;
+        }
+
+        imageID ID = image_ID(name);
+
+        // Create missing channels so that offsets can be added at any time
+        if (ID == -1) {
+            uint32_t *imsize = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+
+            imsize[0] = sizeX;
+            imsize[1] = sizeY;
+            create_image_ID(name, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &ID);
+
+            free(imsize);
+
+            for (uint64_t i = 0; i < data.image[ID].md->nelement; i++)
+                data.image[ID].array.F[i] = 0;
+        }
+
+        if (data.image[ID].md->nelement != sizeX * sizeY) {
+            printf("Wrong size for channel %s, ignoring\n", name);
+            continue;
+        }
+
+        printf("Adding channel %s\n", name);
+
+        channels->ID[channels->NBchannels] = ID;
+        channels->gain[channels->NBchannels] = 1;
+        channels->NBchannels++;
+    }
+}
+
+static void parse_gains(BMC_CHANNELS *channels, char *gains) {
+    char gains_tmp[512];
+    char *saveptr;
+    int ch = 0;
+
+    strncpy(gains_tmp, gains, sizeof(gains_tmp) - 1);
+    gains_tmp[sizeof(gains_tmp) - 1] = '\0';
+
+    for (char *gain = strtok_r(gains_tmp, ", ", &saveptr); gain != NULL && ch < channels->NBchannels; gain = strtok_r(NULL, ", ", &saveptr))
+        channels->gain[ch++] = strtof(gain, NULL);
+
+    // Channels without explicit gain default to 1
+    for (; ch < channels->NBchannels; ch++)
+        channels->gain[ch] = 1;
+}
+
+static long channels_cnt0(BMC_CHANNELS *channels) {
+    long cnt0sum = 0;
+
+    for (int ch = 0; ch < channels->NBchannels; ch++)
+        cnt0sum += data.image[channels->ID[ch]].md->cnt0;
+
+    return cnt0sum;
+}
+
+static void channels_writetime(BMC_CHANNELS *channels, struct timespec *t) {
+    for (int ch = 0; ch < channels->NBchannels; ch++) {
+        if (kalao_timespec_diff_ns(t, &data.image[channels->ID[ch]].md->writetime) > 0)
+            *t = data.image[channels->ID[ch]].md->writetime;
+    }
+}
+
+static void sum_channels(BMC_CHANNELS *channels, float *restrict out, int n) {
+    const float *restrict in = data.image[channels->ID[0]].array.F;
+    float gain = channels->gain[0];
+
+    for (int ii = 0; ii < n; ii++)
+        out[ii] = gain * in[ii];
+
+    for (int ch = 1; ch < channels->NBchannels; ch++) {
+        in = data.image[channels->ID[ch]].array.F;
+        gain = channels->gain[ch];
+
+        for (int ii = 0; ii < n; ii++)
+            out[ii] += gain * in[ii];
+    }
+}
+
+static void update_latency_stats(BMC_DISPLAY_CONTEXT *ctx, KALAO_HISTOGRAM *latency_hist, KALAO_HISTOGRAM *driver_hist) {
+    *ctx->latency_p50 = kalao_histogram_percentile(latency_hist, 0.50) / 1e3;
+    *ctx->latency_p99 = kalao_histogram_percentile(latency_hist, 0.99) / 1e3;
+    *ctx->latency_max = latency_hist->max / 1e3;
+
+    *ctx->driver_p50 = kalao_histogram_percentile(driver_hist, 0.50) / 1e3;
+    *ctx->driver_p99 = kalao_histogram_percentile(driver_hist, 0.99) / 1e3;
+    *ctx->driver_max = driver_hist->max / 1e3;
+
+    ctx->fps->parray[fpi_latency_p50].cnt0++;
+    ctx->fps->parray[fpi_latency_p99].cnt0++;
+    ctx->fps->parray[fpi_latency_max].cnt0++;
+    ctx->fps->parray[fpi_driver_p50].cnt0++;
+    ctx->fps->parray[fpi_driver_p99].cnt0++;
+    ctx->fps->parray[fpi_driver_max].cnt0++;
+}
+
+static void context_init(BMC_DISPLAY_CONTEXT *ctx, FUNCTION_PARAMETER_STRUCT *fps) {
+    ctx->fps = fps;
+    ctx->instance = fps->parray[fpi_instance].val.string[0];
+
+    ctx->DMin_streamname = fps->parray[fpi_DMin_streamname].val.string[0];
+    ctx->TTMin_streamname = fps->parray[fpi_TTMin_streamname].val.string[0];
+    ctx->max_stroke = &fps->parray[fpi_max_stroke].val.f32[0];
+    ctx->stroke_mode = &fps->parray[fpi_stroke_mode].val.i64[0];
+    ctx->target_stroke = &fps->parray[fpi_target_stroke].val.f32[0];
+    ctx->linearization_fname = fps->parray[fpi_linearization_fname].val.string[0];
+    ctx->latency_p50 = &fps->parray[fpi_latency_p50].val.f32[0];
+    ctx->latency_p99 = &fps->parray[fpi_latency_p99].val.f32[0];
+    ctx->latency_max = &fps->parray[fpi_latency_max].val.f32[0];
+    ctx->driver_p50 = &fps->parray[fpi_driver_p50].val.f32[0];
+    ctx->driver_p99 = &fps->parray[fpi_driver_p99].val.f32[0];
+    ctx->driver_max = &fps->parray[fpi_driver_max].val.f32[0];
+    ctx->modesin_streamname = fps->parray[fpi_modesin_streamname].val.string[0];
+    ctx->modes_matrix_fname = fps->parray[fpi_modes_matrix_fname].val.string[0];
+    ctx->DMchannels = fps->parray[fpi_DMchannels].val.string[0];
+    ctx->DMgains = fps->parray[fpi_DMgains].val.string[0];
+    ctx->TTMchannels = fps->parray[fpi_TTMchannels].val.string[0];
+    ctx->TTMgains = fps->parray[fpi_TTMgains].val.string[0];
+    ctx->trace_streamname = fps->parray[fpi_trace_streamname].val.string[0];
+
+    kalao_instance_name(ctx->commands_dm_streamname, ctx->instance, "bmc_commands_dm");
+    kalao_instance_name(ctx->commands_ttm_streamname, ctx->instance, "bmc_commands_ttm");
+    kalao_instance_name(ctx->latency_streamname, ctx->instance, "bmc_latency");
+    kalao_instance_name(ctx->modes_tmp_streamname, ctx->instance, "bmc_modes_tmp");
+    kalao_instance_name(ctx->linearization_tmp_streamname, ctx->instance, "bmc_linearization_tmp");
+    kalao_instance_name(ctx->timers_streamname, ctx->instance, "bmc_display_timers");
+}
+
 static errno_t compute_function() {
     DEBUG_TRACE_FSTART();
 
+    BMC_DISPLAY_CONTEXT ctx;
+    context_init(&ctx, data.fpsptr);
+
     INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
 
     /********** Variables **********/
@@ -134,44 +699,82 @@ static errno_t compute_function() {
     DM dm = {};
     uint32_t *map_lut;
     double *dm_array;
+    double *dm_send;
     int k;
 
     /********** Open streams **********/
 
     processinfo_WriteMessage(processinfo, "Connecting to streams");
 
-    imageID DMinID = image_ID(DMin_streamname);
-    imageID TTMinID = image_ID(TTMin_streamname);
+    imageID DMinID = image_ID(ctx.DMin_streamname);
+    imageID TTMinID = image_ID(ctx.TTMin_streamname);
+    imageID modesinID = image_ID(ctx.modesin_streamname);
+
+    BMC_CHANNELS DMin_channels;
+    BMC_CHANNELS TTMin_channels;
+
+    open_channels(&DMin_channels, DMinID, ctx.DMchannels, DM_SIZE, DM_SIZE);
+    open_channels(&TTMin_channels, TTMinID, ctx.TTMchannels, NB_TTM_CHANNELS, 1);
+
+    parse_gains(&DMin_channels, ctx.DMgains);
+    parse_gains(&TTMin_channels, ctx.TTMgains);
+
+    long DMgains_cnt0 = ctx.fps->parray[fpi_DMgains].cnt0;
+    long TTMgains_cnt0 = ctx.fps->parray[fpi_TTMgains].cnt0;
 
     /********** Allocate streams **********/
 
     processinfo_WriteMessage(processinfo, "Allocating streams");
 
-    imageID DMoutID = image_ID("bmc_commands_dm");
-    imageID TTMoutID = image_ID("bmc_commands_ttm");
+    imageID DMoutID = image_ID(ctx.commands_dm_streamname);
+    imageID TTMoutID = image_ID(ctx.commands_ttm_streamname);
+    imageID latencyID = image_ID(ctx.latency_streamname);
 
     {
         uint32_t *imsize = (uint32_t *)malloc(sizeof(uint32_t) * 2);
 
         imsize[0] = 12;
         imsize[1] = 12;
-        create_image_ID("bmc_commands_dm", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &DMoutID);
+        create_image_ID(ctx.commands_dm_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &DMoutID);
 
         imsize[0] = 2;
         imsize[1] = 1;
-        create_image_ID("bmc_commands_ttm", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &TTMoutID);
+        create_image_ID(ctx.commands_ttm_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &TTMoutID);
+
+        // Raw latency samples, circular buffer, cnt1 is the last written index
+        // Row 0: input to send latency [us], row 1: driver call duration [us]
+        imsize[0] = LATENCY_SAMPLES;
+        imsize[1] = 2;
+        create_image_ID(ctx.latency_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &latencyID);
 
         free(imsize);
     }
 
+    // Frame trace, see KalAO_Telemetry/trace.h
+    // The controller does not propagate it, the DM input is assumed to come
+    // from the last slopes frame when it arrives
+    imageID traceID = image_ID(ctx.trace_streamname);
+    int trace_in_kw = traceID == -1 ? -1 : kalao_trace_find(&data.image[traceID]);
+    int trace_kw = kalao_trace_init(&data.image[DMoutID]);
+    KALAO_TRACE trace;
+
     /********** Open BMC **********/
 
-    processinfo_WriteMessage(processinfo, "Opening DM");
+    // Stand-in driver: commands are only echoed in the output streams
+    int simulated_on = ctx.fps->parray[fpi_simulated].fpflag & FPFLAG_ONOFF;
 
-    error = BMCOpen(&dm, "17DW019#50D");
-    if (error) {
-        printf("\nThe error %d happened while opening deformable mirror\n", error);
-        return error;
+    if (simulated_on) {
+        processinfo_WriteMessage(processinfo, "Using stand-in DM");
+
+        dm.ActCount = BMC_ARRAY_SIZE;
+    } else {
+        processinfo_WriteMessage(processinfo, "Opening DM");
+
+        error = BMCOpen(&dm, "17DW019#50D");
+        if (error) {
+            printf("\nThe error %d happened while opening deformable mirror\n", error);
+            return error;
+        }
     }
 
     processinfo_WriteMessage(processinfo, "Creating DM LUT Map");
@@ -181,7 +784,8 @@ static errno_t compute_function() {
     for (k = 0; k < (int)dm.ActCount; k++)
         map_lut[k] = 0;
 
-    error = BMCLoadMap(&dm, NULL, map_lut);
+    if (!simulated_on)
+        error = BMCLoadMap(&dm, NULL, map_lut);
     if (error) {
         printf("\nThe error %d happened while loading map for deformable mirror\n", error);
         return error;
@@ -194,119 +798,239 @@ static errno_t compute_function() {
     for (k = 0; k < (int)dm.ActCount; k++)
         dm_array[k] = 0;
 
-    error = BMCSetArray(&dm, dm_array, map_lut);
+    if (!simulated_on)
+        error = BMCSetArray(&dm, dm_array, map_lut);
     if (error) {
         printf("\nThe error %d happened while setting array for deformable mirror\n", error);
         return error;
     }
 
+    dm_send = malloc(sizeof(double) * (int)dm.ActCount);
+
+    for (k = 0; k < (int)dm.ActCount; k++)
+        dm_send[k] = 0;
+
+    /********** Load linearization **********/
+
+    processinfo_WriteMessage(processinfo, "Loading linearization");
+
+    BMC_LINEARIZATION_LUT lut = {0, NULL, NULL};
+
+    bmc_load_linearization(&lut, ctx.linearization_fname, ctx.linearization_tmp_streamname);
+    long linearization_cnt0 = ctx.fps->parray[fpi_linearization_fname].cnt0;
+
+    /********** Load modes matrix **********/
+
+    BMC_MODES_MATRIX modes_matrix = {0, MODES_STRIDE, NULL};
+    long modes_matrix_cnt0 = ctx.fps->parray[fpi_modes_matrix_fname].cnt0;
+
+    if (modesinID != -1) {
+        processinfo_WriteMessage(processinfo, "Loading modes matrix");
+
+        load_modes_matrix(&ctx, &modes_matrix);
+    }
+
+    // Zonal command, padded to the matrix stride
+    float *dm_input = (float *)aligned_alloc(64, sizeof(float) * MODES_STRIDE);
+
+    for (k = 0; k < MODES_STRIDE; k++)
+        dm_input[k] = 0;
+
+    // Sum of the channels, full maps
+    float dm_sum[DM_SIZE * DM_SIZE];
+    float ttm_sum[NB_TTM_CHANNELS];
+
+    /********** Latency statistics **********/
+
+    KALAO_HISTOGRAM *latency_hist = (KALAO_HISTOGRAM *)malloc(sizeof(KALAO_HISTOGRAM));
+    KALAO_HISTOGRAM *driver_hist = (KALAO_HISTOGRAM *)malloc(sizeof(KALAO_HISTOGRAM));
+
+    kalao_histogram_reset(latency_hist);
+    kalao_histogram_reset(driver_hist);
+
+    for (k = 0; k < 2 * LATENCY_SAMPLES; k++)
+        data.image[latencyID].array.F[k] = 0;
+
+    struct timespec t_input, t_send, t_done;
+    uint64_t latency_ns, driver_ns;
+    int latency_index = 0;
+
     /********** Loop **********/
 
     int ii;
-    float full_stroke, half_stroke, min_stroke, offset;
     long cnt0sum;
     long cnt0sumref = 0;
 
+    KALAO_SECTIONS(timers, ctx.timers_streamname, "mapping", "driver", "echo");
+
     processinfo_WriteMessage(processinfo, "Looping");
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
 
-    cnt0sum = data.image[DMinID].md->cnt0 + data.image[TTMinID].md->cnt0;
+    if (ctx.fps->parray[fpi_linearization_fname].cnt0 != linearization_cnt0) {
+        linearization_cnt0 = ctx.fps->parray[fpi_linearization_fname].cnt0;
 
-    if (cnt0sum != cnt0sumref) {
-        cnt0sumref = cnt0sum;
+        processinfo_WriteMessage(processinfo, "Loading linearization");
 
-        full_stroke = *max_stroke;
-        half_stroke = *max_stroke / 2;
+        bmc_load_linearization(&lut, ctx.linearization_fname, ctx.linearization_tmp_streamname);
 
-        for (ii = 0; ii < 10; ii++)
-            dm_array[ii] = data.image[DMinID].array.F[ii + 1] / 3.5 + half_stroke;
+        processinfo_WriteMessage(processinfo, "Looping");
+    }
 
-        for (; ii < 130; ii++)
-            dm_array[ii] = data.image[DMinID].array.F[ii + 2] / 3.5 + half_stroke;
+    if (modesinID != -1 && ctx.fps->parray[fpi_modes_matrix_fname].cnt0 != modes_matrix_cnt0) {
+        modes_matrix_cnt0 = ctx.fps->parray[fpi_modes_matrix_fname].cnt0;
 
-        for (; ii < 140; ii++)
-            dm_array[ii] = data.image[DMinID].array.F[ii + 3] / 3.5 + half_stroke;
+        processinfo_WriteMessage(processinfo, "Loading modes matrix");
 
-        dm_array[155] = data.image[TTMinID].array.F[0] / 5.0 + 0.5;
-        dm_array[156] = data.image[TTMinID].array.F[1] / 5.0 + 0.5;
+        load_modes_matrix(&ctx, &modes_matrix);
 
-        // Prevent values to be out of range
-        for (ii = 0; ii < 140; ii++) {
-            if (dm_array[ii] > full_stroke)
-                dm_array[ii] = full_stroke;
+        processinfo_WriteMessage(processinfo, "Looping");
+    }
 
-            if (dm_array[ii] < 0)
-                dm_array[ii] = 0;
-        }
+    int modes_active = modesinID != -1 && modes_matrix.NBmodes > 0 && (ctx.fps->parray[fpi_modes].fpflag & FPFLAG_ONOFF);
 
-        for (; ii < 160; ii++) {
-            if (dm_array[ii] > 1)
-                dm_array[ii] = 1;
+    if (ctx.fps->parray[fpi_DMgains].cnt0 != DMgains_cnt0) {
+        DMgains_cnt0 = ctx.fps->parray[fpi_DMgains].cnt0;
+        parse_gains(&DMin_channels, ctx.DMgains);
 
-            if (dm_array[ii] < 0)
-                dm_array[ii] = 0;
-        }
+        // Force update with new gains
+        cnt0sumref--;
+    }
+
+    if (ctx.fps->parray[fpi_TTMgains].cnt0 != TTMgains_cnt0) {
+        TTMgains_cnt0 = ctx.fps->parray[fpi_TTMgains].cnt0;
+        parse_gains(&TTMin_channels, ctx.TTMgains);
 
-        // Apply stroke mode
+        // Force update with new gains
+        cnt0sumref--;
+    }
 
-        if (*stroke_mode == 1) {
-            min_stroke = 1;
+    cnt0sum = channels_cnt0(&DMin_channels) + channels_cnt0(&TTMin_channels);
 
-            for (ii = 0; ii < 140; ii++) {
-                if (dm_array[ii] < min_stroke)
-                    min_stroke = dm_array[ii];
-            }
+    if (modes_active)
+        cnt0sum += data.image[modesinID].md->cnt0;
 
-            offset = min_stroke - *target_stroke;
+    if (ctx.fps->parray[fpi_latency_reset].fpflag & FPFLAG_ONOFF) {
+        kalao_histogram_reset(latency_hist);
+        kalao_histogram_reset(driver_hist);
 
-            if (offset > 0) {
-                for (ii = 0; ii < 140; ii++)
-                    dm_array[ii] -= offset;
-            }
+        ctx.fps->parray[fpi_latency_reset].fpflag &= ~FPFLAG_ONOFF;
+        ctx.fps->parray[fpi_latency_reset].cnt0++;
+    }
+
+    if (cnt0sum != cnt0sumref) {
+        cnt0sumref = cnt0sum;
+
+        KALAO_SECTION_START(timers);
+
+        // Input time is the most recent write among the input streams
+        t_input = data.image[DMinID].md->writetime;
+        channels_writetime(&DMin_channels, &t_input);
+        channels_writetime(&TTMin_channels, &t_input);
+        if (modes_active && kalao_timespec_diff_ns(&t_input, &data.image[modesinID].md->writetime) > 0)
+            t_input = data.image[modesinID].md->writetime;
+
+        if (traceID != -1 && trace_in_kw == -1)
+            trace_in_kw = kalao_trace_find(&data.image[traceID]);
+
+        if (trace_in_kw != -1)
+            kalao_trace_read(&data.image[traceID], trace_in_kw, &trace);
+
+        sum_channels(&DMin_channels, dm_sum, DM_SIZE * DM_SIZE);
+        sum_channels(&TTMin_channels, ttm_sum, NB_TTM_CHANNELS);
+
+        for (ii = 0; ii < NB_ACTUATORS; ii++)
+            dm_input[ii] = dm_sum[actuator_pixel(ii)];
+
+        if (modes_active)
+            project_modes(&modes_matrix, data.image[modesinID].array.F, data.image[modesinID].md->nelement, dm_input);
+
+        bmc_build_command(dm_input, ttm_sum, *ctx.max_stroke, *ctx.stroke_mode, *ctx.target_stroke, dm_array);
+
+        // Apply linearization
+
+        double *dm_cmd = dm_array;
+
+        if ((ctx.fps->parray[fpi_linearization].fpflag & FPFLAG_ONOFF) && lut.NBpts > 0) {
+            bmc_apply_linearization(&lut, 0, dm_array, dm_send, NB_ACTUATORS);
+            bmc_apply_linearization(&lut, NB_ACTUATORS, &dm_array[TTM_INDEX], &dm_send[TTM_INDEX], NB_TTM_CHANNELS);
+
+            dm_cmd = dm_send;
         }
 
+        KALAO_SECTION_LAP(timers, SECTION_MAPPING);
+
         // Send command to DM
 
-        error = BMCSetArray(&dm, dm_array, map_lut);
+        clock_gettime(CLOCK_REALTIME, &t_send);
+
+        if (!simulated_on)
+            error = BMCSetArray(&dm, dm_cmd, map_lut);
         if (error) {
             printf("\nThe error %d happened while setting array for deformable mirror\n", error);
             return error;
         }
 
-        // Write command sent to DM
+        clock_gettime(CLOCK_REALTIME, &t_done);
 
-        data.image[DMoutID].md->write = 1;
+        KALAO_SECTION_LAP(timers, SECTION_DRIVER);
 
-        data.image[DMoutID].array.F[0] = 0;
-        data.image[DMoutID].array.F[11] = 0;
-        data.image[DMoutID].array.F[132] = 0;
-        data.image[DMoutID].array.F[143] = 0;
+        // Latency statistics
 
-        for (ii = 0; ii < 10; ii++)
-            data.image[DMoutID].array.F[ii + 1] = dm_array[ii];
+        latency_ns = kalao_timespec_diff_ns(&t_input, &t_send);
+        driver_ns = kalao_timespec_diff_ns(&t_send, &t_done);
 
-        for (; ii < 130; ii++)
-            data.image[DMoutID].array.F[ii + 2] = dm_array[ii];
+        kalao_histogram_record(latency_hist, latency_ns);
+        kalao_histogram_record(driver_hist, driver_ns);
 
-        for (; ii < 140; ii++)
-            data.image[DMoutID].array.F[ii + 3] = dm_array[ii];
+        data.image[latencyID].md->write = 1;
 
-        processinfo_update_output_stream(processinfo, DMoutID);
+        data.image[latencyID].array.F[latency_index] = latency_ns / 1e3;
+        data.image[latencyID].array.F[LATENCY_SAMPLES + latency_index] = driver_ns / 1e3;
+        data.image[latencyID].md->cnt1 = latency_index;
+
+        processinfo_update_output_stream(processinfo, latencyID);
+
+        latency_index += 1;
+        latency_index %= LATENCY_SAMPLES;
 
-        // Write command sent to TTM
+        if (latency_hist->count % LATENCY_UPDATE_PERIOD == 0)
+            update_latency_stats(&ctx, latency_hist, driver_hist);
 
+        // Write commands sent to DM and TTM
+
+        data.image[DMoutID].md->write = 1;
         data.image[TTMoutID].md->write = 1;
 
-        data.image[TTMoutID].array.F[0] = dm_array[155];
-        data.image[TTMoutID].array.F[1] = dm_array[156];
+        bmc_write_commands(dm_array, data.image[DMoutID].array.F, data.image[TTMoutID].array.F);
+
+        if (trace_in_kw != -1 && trace_kw != -1) {
+            trace.fields[KALAO_TRACE_T_DM] = kalao_trace_ns(&t_send);
+            kalao_trace_write(&data.image[DMoutID], trace_kw, &trace);
+        }
 
+        processinfo_update_output_stream(processinfo, DMoutID);
         processinfo_update_output_stream(processinfo, TTMoutID);
+
+        KALAO_SECTION_LAP(timers, SECTION_ECHO);
     }
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_END
 
     free(dm_array);
+    free(dm_send);
+    free(dm_input);
+    free(modes_matrix.matrix);
+    free(latency_hist);
+    free(driver_hist);
+    free(lut.y0);
+    free(lut.slope);
+
+    if (simulated_on) {
+        DEBUG_TRACE_FEXIT();
+
+        return RETURN_SUCCESS;
+    }
 
     processinfo_WriteMessage(processinfo, "Clearing array");
     error = BMCClearArray(&dm);
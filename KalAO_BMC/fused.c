@@ -0,0 +1,1010 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "COREMOD_iofits/file_exists.h"
+#include "COREMOD_iofits/is_fits_file.h"
+#include "COREMOD_iofits/loadfits.h"
+
+#include "KalAO_Nuvu/calibration.h"
+#include "KalAO_SHWFS/centroid.h"
+#include "KalAO_SHWFS/stats.h"
+#include "KalAO_Telemetry/histogram.h"
+#include "KalAO_Telemetry/trace.h"
+
+#include "actuators.h"
+#include "command.h"
+
+#include "BMCApi.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+/*
+ * Fused camera to DM pipeline: calibration, centroiding, reconstruction and
+ * DM command run back-to-back on one thread for each raw frame, without
+ * going through the intermediate streams.
+ *
+ * Triggered by the raw camera stream. Replaces KalAO_SHWFS process and
+ * KalAO_BMC display (which must not run at the same time), and the
+ * calibration of KalAO_Nuvu acquire (set .calibration_on OFF there). The
+ * streams of these processes are still published as side outputs.
+ */
+
+static char *spotcoords_fname;
+static long fpi_spotcoords_fname;
+
+static int64_t *algorithm;
+static long fpi_algorithm;
+
+static int64_t *flux_threshold;
+static long fpi_flux_threshold;
+
+static int64_t *bias_mode;
+static long fpi_bias_mode;
+
+static char *wfsref_streamname;
+static long fpi_wfsref_streamname;
+
+static char *CM_fname;
+static long fpi_CM_fname;
+
+static uint64_t *loop;
+static long fpi_loop;
+
+static uint64_t *loop_reset;
+static long fpi_loop_reset;
+
+static float *gain;
+static long fpi_gain;
+
+static float *leak;
+static long fpi_leak;
+
+static char *DMoffset_streamname;
+static long fpi_DMoffset_streamname;
+
+static char *TTMoffset_streamname;
+static long fpi_TTMoffset_streamname;
+
+static float *max_stroke;
+static long fpi_max_stroke;
+
+static uint64_t *stroke_mode;
+static long fpi_stroke_mode;
+
+static float *target_stroke;
+static long fpi_target_stroke;
+
+static uint64_t *linearization;
+static long fpi_linearization;
+
+static char *linearization_fname;
+static long fpi_linearization_fname;
+
+static int64_t *cpu;
+static long fpi_cpu;
+
+static float *flux_max;
+static long fpi_flux_max;
+
+static float *flux_avg;
+static long fpi_flux_avg;
+
+static float *residual_rms;
+static long fpi_residual_rms;
+
+static float *slope_x_avg;
+static long fpi_slope_x_avg;
+
+static float *slope_y_avg;
+static long fpi_slope_y_avg;
+
+static uint64_t *latency_reset;
+static long fpi_latency_reset;
+
+static float *latency_p50;
+static long fpi_latency_p50;
+
+static float *latency_p99;
+static long fpi_latency_p99;
+
+static float *latency_max;
+static long fpi_latency_max;
+
+static CLICMDARGDEF farg[] =
+    {
+        {
+            CLIARG_FILENAME,
+            ".spotcoords",
+            "SH spot coordinates",
+            "spots.txt",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&spotcoords_fname,
+            &fpi_spotcoords_fname,
+        },
+        {
+            CLIARG_INT64,
+            ".algorithm",
+            "Algorithm (0 = Quad-cell, 1 = Center of mass)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&algorithm,
+            &fpi_algorithm,
+        },
+        {
+            CLIARG_INT64,
+            ".flux_threshold",
+            "Minium flux in subaperture for slopes computation [ADU]",
+            "300",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&flux_threshold,
+            &fpi_flux_threshold,
+        },
+        {
+            CLIARG_INT64,
+            ".bias_mode",
+            "Bias (0 = nuvu_bias, 1 = Dynamic mean, 2 = Dynamic bilinear)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&bias_mode,
+            &fpi_bias_mode,
+        },
+        {
+            CLIARG_IMG,
+            ".wfsref",
+            "WFS reference",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&wfsref_streamname,
+            &fpi_wfsref_streamname,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".CM",
+            "Command matrix (NBslopes x 142, 140 actuators + 2 tip-tilt)",
+            "fused_cm.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&CM_fname,
+            &fpi_CM_fname,
+        },
+        {
+            CLIARG_ONOFF,
+            ".loop_on",
+            "Loop ON/OFF (OFF holds the last command)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&loop,
+            &fpi_loop,
+        },
+        {
+            CLIARG_ONOFF,
+            ".loop_reset",
+            "Reset integrator",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&loop_reset,
+            &fpi_loop_reset,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".gain",
+            "Integrator gain",
+            "0.3",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&gain,
+            &fpi_gain,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".leak",
+            "Integrator leak (1 = no leak)",
+            "0.99",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&leak,
+            &fpi_leak,
+        },
+        {
+            CLIARG_IMG,
+            ".DMoffset",
+            "DM offset stream (12x12), optional",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&DMoffset_streamname,
+            &fpi_DMoffset_streamname,
+        },
+        {
+            CLIARG_IMG,
+            ".TTMoffset",
+            "Tip-Tilt offset stream (2x1), optional",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&TTMoffset_streamname,
+            &fpi_TTMoffset_streamname,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".max_stroke",
+            "Maximum stroke of DM [-]",
+            "0.9",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&max_stroke,
+            &fpi_max_stroke,
+        },
+        {
+            CLIARG_INT64,
+            ".stroke_mode",
+            "Stroke mode (0 = Mid-stroke, 1 = Minimize stroke)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&stroke_mode,
+            &fpi_stroke_mode,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".target_stroke",
+            "Target stroke for minimize mode [-]",
+            "0.2",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&target_stroke,
+            &fpi_target_stroke,
+        },
+        {
+            CLIARG_ONOFF,
+            ".linearization_on",
+            "Response linearization ON/OFF",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&linearization,
+            &fpi_linearization,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".linearization",
+            "Linearization LUT (NBpts x 142, 140 actuators + 2 tip-tilt)",
+            "bmc_linearization.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&linearization_fname,
+            &fpi_linearization_fname,
+        },
+        {
+            CLIARG_INT64,
+            ".cpu",
+            "CPU to pin the pipeline to (-1 = no pinning)",
+            "-1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&cpu,
+            &fpi_cpu,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".flux_avg",
+            "Avg. flux in active subapertures [ADU]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&flux_avg,
+            &fpi_flux_avg,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".flux_max",
+            "Max. flux in active subapertures [ADU]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&flux_max,
+            &fpi_flux_max,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".residual_rms",
+            "RMS residual slopes",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&residual_rms,
+            &fpi_residual_rms,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".slope_x_avg",
+            "Average slope in X direction",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&slope_x_avg,
+            &fpi_slope_x_avg,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".slope_y_avg",
+            "Average slope in Y direction",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&slope_y_avg,
+            &fpi_slope_y_avg,
+        },
+        {
+            CLIARG_ONOFF,
+            ".latency.reset",
+            "Reset latency statistics",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&latency_reset,
+            &fpi_latency_reset,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".latency.p50",
+            "Raw frame to send latency, median [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&latency_p50,
+            &fpi_latency_p50,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".latency.p99",
+            "Raw frame to send latency, 99th percentile [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&latency_p99,
+            &fpi_latency_p99,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".latency.max",
+            "Raw frame to send latency, maximum [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&latency_max,
+            &fpi_latency_max,
+        },
+};
+
+static CLICMDDATA CLIcmddata =
+    {
+        "fused",
+        "Camera to DM pipeline in a single thread",
+        CLICMD_FIELDS_DEFAULTS,
+};
+
+// Commands computed by the reconstruction: 140 actuators + 2 tip-tilt
+#define NB_COMMANDS (NB_ACTUATORS + NB_TTM_CHANNELS)
+
+typedef struct
+{
+    int NBslopes;
+
+    // command-major, each row padded to stride floats for aligned vector loads
+    int stride;
+    float *matrix;
+
+} FUSED_COMMAND_MATRIX;
+
+#define LATENCY_UPDATE_PERIOD 100
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static errno_t help_function() {
+    return RETURN_SUCCESS;
+}
+
+static errno_t customCONFsetup() {
+    if (data.fpsptr != NULL) {
+        data.fpsptr->parray[fpi_algorithm].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_algorithm].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_algorithm].val.i64[1] = 0; // min
+        data.fpsptr->parray[fpi_algorithm].val.i64[2] = 1; // max
+
+        data.fpsptr->parray[fpi_flux_threshold].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_flux_threshold].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_flux_threshold].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_flux_threshold].val.i64[1] = 1;     // min
+        data.fpsptr->parray[fpi_flux_threshold].val.i64[2] = 65535; // max
+
+        data.fpsptr->parray[fpi_bias_mode].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_bias_mode].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_bias_mode].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_bias_mode].val.i64[1] = 0; // min
+        data.fpsptr->parray[fpi_bias_mode].val.i64[2] = 2; // max
+
+        data.fpsptr->parray[fpi_CM_fname].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_loop].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_loop_reset].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_gain].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_gain].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_gain].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_gain].val.f32[1] = 0; // min
+        data.fpsptr->parray[fpi_gain].val.f32[2] = 1; // max
+
+        data.fpsptr->parray[fpi_leak].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_leak].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_leak].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_leak].val.f32[1] = 0; // min
+        data.fpsptr->parray[fpi_leak].val.f32[2] = 1; // max
+
+        data.fpsptr->parray[fpi_max_stroke].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_max_stroke].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_max_stroke].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_max_stroke].val.f32[1] = 0; // min
+        data.fpsptr->parray[fpi_max_stroke].val.f32[2] = 1; // max
+
+        data.fpsptr->parray[fpi_stroke_mode].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_stroke_mode].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_stroke_mode].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_stroke_mode].val.i64[1] = 0; // min
+        data.fpsptr->parray[fpi_stroke_mode].val.i64[2] = 1; // max
+
+        data.fpsptr->parray[fpi_target_stroke].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_target_stroke].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_target_stroke].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_target_stroke].val.f32[1] = 0; // min
+        data.fpsptr->parray[fpi_target_stroke].val.f32[2] = 1; // max
+
+        data.fpsptr->parray[fpi_linearization].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_linearization_fname].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_latency_reset].fpflag |= FPFLAG_WRITERUN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static int load_command_matrix(FUSED_COMMAND_MATRIX *CM, int NBslopes) {
+    imageID CMtmpID = -1;
+
+    if (!file_exists(CM_fname)) {
+        printf("Command matrix file %s not found\n", CM_fname);
+    } else if (!is_fits_file(CM_fname)) {
+        printf("Command matrix file %s is not a valid FITS file\n", CM_fname);
+    } else {
+        load_fits(CM_fname, "fused_cm_tmp", 1, &CMtmpID);
+
+        if (data.image[CMtmpID].md->datatype != _DATATYPE_FLOAT) {
+            printf("Wrong data type for command matrix file %s\n", CM_fname);
+            CMtmpID = -1;
+        } else if (data.image[CMtmpID].md->nelement != (uint64_t)NBslopes * NB_COMMANDS) {
+            printf("Wrong size for command matrix file %s\n", CM_fname);
+            CMtmpID = -1;
+        }
+    }
+
+    // Without a valid matrix, the reconstruction gives no correction
+    for (int c = 0; c < NB_COMMANDS; c++) {
+        for (int s = 0; s < CM->stride; s++) {
+            CM->matrix[c * CM->stride + s] = 0;
+        }
+    }
+
+    if (CMtmpID == -1) {
+        return RETURN_FAILURE;
+    }
+
+    for (int c = 0; c < NB_COMMANDS; c++) {
+        for (int s = 0; s < NBslopes; s++) {
+            CM->matrix[c * CM->stride + s] = data.image[CMtmpID].array.F[c * NBslopes + s];
+        }
+    }
+
+    printf("Loaded command matrix %d x %d\n", NBslopes, NB_COMMANDS);
+
+    return RETURN_SUCCESS;
+}
+
+// out = CM . residual, residual padded with zeros to the matrix stride
+static void reconstruct(
+    FUSED_COMMAND_MATRIX *CM,
+    const float *restrict residual,
+    float *restrict out) {
+    int stride = CM->stride;
+
+    const float *restrict M = __builtin_assume_aligned(CM->matrix, 64);
+    const float *restrict r = __builtin_assume_aligned(residual, 64);
+
+    for (int c = 0; c < NB_COMMANDS; c++) {
+        const float *restrict row = &M[c * stride];
+        float sum = 0;
+
+        for (int s = 0; s < stride; s++)
+            sum += row[s] * r[s];
+
+        out[c] = sum;
+    }
+}
+
+static void pin_thread(int cpu_index) {
+    if (cpu_index < 0) {
+        return;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu_index, &cpuset);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+        printf("Unable to pin pipeline to CPU %d\n", cpu_index);
+    } else {
+        printf("Pipeline pinned to CPU %d\n", cpu_index);
+    }
+}
+
+static errno_t compute_function() {
+    DEBUG_TRACE_FSTART();
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+
+    /********** Variables **********/
+
+    int error = NO_ERR;
+    DM dm = {};
+    uint32_t *map_lut;
+    double *dm_array;
+    double *dm_send;
+    int k;
+
+    pin_thread(*cpu);
+
+    /********** Load spots coordinates **********/
+
+    SHWFS_SPOTS *spotcoord = (SHWFS_SPOTS *)malloc(sizeof(SHWFS_SPOTS) * MAXNB_SPOT);
+
+    char msgstring[200];
+    sprintf(msgstring, "Loading spot <- %s", spotcoords_fname);
+    processinfo_WriteMessage(processinfo, msgstring);
+
+    int NBspot = shwfs_read_spots(spotcoords_fname, spotcoord);
+
+    uint32_t sizeoutX;
+    uint32_t sizeoutY;
+
+    shwfs_spots_layout(spotcoord, NBspot, &sizeoutX, &sizeoutY);
+
+    int NBslopes = 2 * sizeoutX * sizeoutY;
+
+    printf("Output 2D representation: %d x %d\n", sizeoutX, sizeoutY);
+
+    /********** Open streams **********/
+
+    processinfo_WriteMessage(processinfo, "Connecting to streams");
+
+    imageID inID = processinfo->triggerstreamID;
+    imageID wfsrefID = image_ID(wfsref_streamname);
+    imageID DMoffsetID = image_ID(DMoffset_streamname);
+    imageID TTMoffsetID = image_ID(TTMoffset_streamname);
+
+    if (DMoffsetID != -1 && data.image[DMoffsetID].md->nelement != DM_SIZE * DM_SIZE) {
+        printf("Wrong size for DM offset %s, ignoring\n", DMoffset_streamname);
+        DMoffsetID = -1;
+    }
+
+    if (TTMoffsetID != -1 && data.image[TTMoffsetID].md->nelement != NB_TTM_CHANNELS) {
+        printf("Wrong size for Tip-Tilt offset %s, ignoring\n", TTMoffset_streamname);
+        TTMoffsetID = -1;
+    }
+
+    /********** Allocate streams **********/
+
+    processinfo_WriteMessage(processinfo, "Allocating streams");
+
+    // Bias and flat are maintained by acquire, defaults if it did not run yet
+    imageID biasID = image_ID("nuvu_bias");
+    imageID flatID = image_ID("nuvu_flat");
+
+    imageID calID = image_ID("nuvu_stream");
+    imageID dynamicBiasID = image_ID("nuvu_dynamic_bias");
+    imageID slopesID = image_ID("shwfs_slopes");
+    imageID fluxID = image_ID("shwfs_flux");
+    imageID statsID = image_ID("shwfs_stats");
+    imageID DMoutID = image_ID("bmc_commands_dm");
+    imageID TTMoutID = image_ID("bmc_commands_ttm");
+
+    uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+    {
+        imsizearray[0] = WIDTH;
+        imsizearray[1] = HEIGHT;
+
+        if (biasID == -1) {
+            create_image_ID("nuvu_bias", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &biasID);
+
+            for (k = 0; k < WIDTH * HEIGHT; k++)
+                data.image[biasID].array.F[k] = 0;
+        }
+
+        if (flatID == -1) {
+            create_image_ID("nuvu_flat", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &flatID);
+
+            for (k = 0; k < WIDTH * HEIGHT; k++)
+                data.image[flatID].array.F[k] = 1;
+        }
+
+        create_image_ID("nuvu_stream", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &calID);
+        create_image_ID("nuvu_dynamic_bias", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &dynamicBiasID);
+
+        // slopes
+        imsizearray[0] = sizeoutX * 2;
+        imsizearray[1] = sizeoutY;
+        create_image_ID("shwfs_slopes", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &slopesID);
+
+        // flux
+        imsizearray[0] = sizeoutX;
+        imsizearray[1] = sizeoutY;
+        create_image_ID("shwfs_flux", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &fluxID);
+
+        // per-frame statistics, see KalAO_SHWFS/stats.h
+        imsizearray[0] = SHWFS_STATS_NBFIELDS;
+        imsizearray[1] = SHWFS_STATS_RING;
+        create_image_ID("shwfs_stats", 2, imsizearray, _DATATYPE_DOUBLE, 1, 10, 0, &statsID);
+
+        imsizearray[0] = DM_SIZE;
+        imsizearray[1] = DM_SIZE;
+        create_image_ID("bmc_commands_dm", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &DMoutID);
+
+        imsizearray[0] = NB_TTM_CHANNELS;
+        imsizearray[1] = 1;
+        create_image_ID("bmc_commands_ttm", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &TTMoutID);
+
+        free(imsizearray);
+    }
+
+    for (uint64_t i = 0; i < data.image[statsID].md->nelement; i++) {
+        data.image[statsID].array.D[i] = 0;
+    }
+
+    strcpy(data.image[statsID].kw[0].name, SHWFS_STATS_KW_RECORDS);
+    data.image[statsID].kw[0].type = 'L';
+    data.image[statsID].kw[0].value.numl = 0;
+    strcpy(data.image[statsID].kw[0].comment, "Number of complete records");
+
+    int stats_kw = 0;
+    uint64_t stats_records = 0;
+
+    // Frame trace, see KalAO_Telemetry/trace.h
+    int trace_cal_kw = kalao_trace_init(&data.image[calID]);
+    int trace_slopes_kw = kalao_trace_init(&data.image[slopesID]);
+    int trace_dm_kw = kalao_trace_init(&data.image[DMoutID]);
+    KALAO_TRACE trace;
+
+    /********** Open BMC **********/
+
+    processinfo_WriteMessage(processinfo, "Opening DM");
+
+    error = BMCOpen(&dm, "17DW019#50D");
+    if (error) {
+        printf("\nThe error %d happened while opening deformable mirror\n", error);
+        return error;
+    }
+
+    processinfo_WriteMessage(processinfo, "Creating DM LUT Map");
+
+    map_lut = (uint32_t *)malloc(sizeof(uint32_t) * MAX_DM_SIZE);
+
+    for (k = 0; k < (int)dm.ActCount; k++)
+        map_lut[k] = 0;
+
+    error = BMCLoadMap(&dm, NULL, map_lut);
+    if (error) {
+        printf("\nThe error %d happened while loading map for deformable mirror\n", error);
+        return error;
+    }
+
+    processinfo_WriteMessage(processinfo, "Creating DM array");
+
+    dm_array = malloc(sizeof(double) * (int)dm.ActCount);
+    dm_send = malloc(sizeof(double) * (int)dm.ActCount);
+
+    for (k = 0; k < (int)dm.ActCount; k++) {
+        dm_array[k] = 0;
+        dm_send[k] = 0;
+    }
+
+    error = BMCSetArray(&dm, dm_array, map_lut);
+    if (error) {
+        printf("\nThe error %d happened while setting array for deformable mirror\n", error);
+        return error;
+    }
+
+    /********** Load linearization **********/
+
+    processinfo_WriteMessage(processinfo, "Loading linearization");
+
+    BMC_LINEARIZATION_LUT lut = {0, NULL, NULL};
+
+    bmc_load_linearization(&lut, linearization_fname, "bmc_linearization_tmp");
+    long linearization_cnt0 = data.fpsptr->parray[fpi_linearization_fname].cnt0;
+
+    /********** Load command matrix **********/
+
+    processinfo_WriteMessage(processinfo, "Loading command matrix");
+
+    FUSED_COMMAND_MATRIX CM;
+
+    CM.NBslopes = NBslopes;
+    CM.stride = (NBslopes + 15) & ~15;
+    CM.matrix = (float *)aligned_alloc(64, sizeof(float) * CM.stride * NB_COMMANDS);
+
+    load_command_matrix(&CM, NBslopes);
+    long CM_cnt0 = data.fpsptr->parray[fpi_CM_fname].cnt0;
+
+    /********** Working buffers **********/
+
+    // Residual slopes in the slopes layout, padded to the matrix stride
+    float *residual = (float *)aligned_alloc(64, sizeof(float) * CM.stride);
+
+    for (k = 0; k < CM.stride; k++)
+        residual[k] = 0;
+
+    float correction[NB_COMMANDS];
+    float integrator[NB_COMMANDS];
+    float dm_input[NB_ACTUATORS];
+    float ttm_input[NB_TTM_CHANNELS];
+
+    for (k = 0; k < NB_COMMANDS; k++)
+        integrator[k] = 0;
+
+    SHWFS_CENTROID_STATS centroid_stats;
+
+    /********** Latency statistics **********/
+
+    KALAO_HISTOGRAM *latency_hist = (KALAO_HISTOGRAM *)malloc(sizeof(KALAO_HISTOGRAM));
+
+    kalao_histogram_reset(latency_hist);
+
+    struct timespec t_send;
+
+    /********** Loop **********/
+
+    int ii;
+
+    processinfo_WriteMessage(processinfo, "Looping");
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    if (data.fpsptr->parray[fpi_linearization_fname].cnt0 != linearization_cnt0) {
+        linearization_cnt0 = data.fpsptr->parray[fpi_linearization_fname].cnt0;
+
+        processinfo_WriteMessage(processinfo, "Loading linearization");
+
+        bmc_load_linearization(&lut, linearization_fname, "bmc_linearization_tmp");
+
+        processinfo_WriteMessage(processinfo, "Looping");
+    }
+
+    if (data.fpsptr->parray[fpi_CM_fname].cnt0 != CM_cnt0) {
+        CM_cnt0 = data.fpsptr->parray[fpi_CM_fname].cnt0;
+
+        processinfo_WriteMessage(processinfo, "Loading command matrix");
+
+        load_command_matrix(&CM, NBslopes);
+
+        processinfo_WriteMessage(processinfo, "Looping");
+    }
+
+    if (data.fpsptr->parray[fpi_loop_reset].fpflag & FPFLAG_ONOFF) {
+        for (k = 0; k < NB_COMMANDS; k++)
+            integrator[k] = 0;
+
+        data.fpsptr->parray[fpi_loop_reset].fpflag &= ~FPFLAG_ONOFF;
+        data.fpsptr->parray[fpi_loop_reset].cnt0++;
+    }
+
+    if (data.fpsptr->parray[fpi_latency_reset].fpflag & FPFLAG_ONOFF) {
+        kalao_histogram_reset(latency_hist);
+
+        data.fpsptr->parray[fpi_latency_reset].fpflag &= ~FPFLAG_ONOFF;
+        data.fpsptr->parray[fpi_latency_reset].cnt0++;
+    }
+
+    /***** Calibration *****/
+
+    kalao_trace_from_raw(&data.image[inID], &trace);
+
+    nuvu_calibrate(data.image[inID].array.UI16, data.image[biasID].array.F, data.image[flatID].array.F, *bias_mode, data.image[calID].array.F, data.image[dynamicBiasID].array.F);
+
+    trace.fields[KALAO_TRACE_T_CAL] = kalao_trace_now();
+
+    /***** Centroiding *****/
+
+    shwfs_centroid(data.image[calID].array.F, WIDTH, spotcoord, NBspot, *algorithm, *flux_threshold, data.image[wfsrefID].array.F, residual, &centroid_stats);
+
+    trace.fields[KALAO_TRACE_T_SLP] = kalao_trace_now();
+
+    /***** Reconstruction *****/
+
+    if (data.fpsptr->parray[fpi_loop].fpflag & FPFLAG_ONOFF) {
+        reconstruct(&CM, residual, correction);
+
+        for (k = 0; k < NB_COMMANDS; k++)
+            integrator[k] = *leak * integrator[k] - *gain * correction[k];
+    }
+
+    for (ii = 0; ii < NB_ACTUATORS; ii++)
+        dm_input[ii] = integrator[ii];
+
+    for (ii = 0; ii < NB_TTM_CHANNELS; ii++)
+        ttm_input[ii] = integrator[NB_ACTUATORS + ii];
+
+    if (DMoffsetID != -1) {
+        for (ii = 0; ii < NB_ACTUATORS; ii++)
+            dm_input[ii] += data.image[DMoffsetID].array.F[actuator_pixel(ii)];
+    }
+
+    if (TTMoffsetID != -1) {
+        for (ii = 0; ii < NB_TTM_CHANNELS; ii++)
+            ttm_input[ii] += data.image[TTMoffsetID].array.F[ii];
+    }
+
+    /***** Send command to DM *****/
+
+    bmc_build_command(dm_input, ttm_input, *max_stroke, *stroke_mode, *target_stroke, dm_array);
+
+    double *dm_cmd = dm_array;
+
+    if ((data.fpsptr->parray[fpi_linearization].fpflag & FPFLAG_ONOFF) && lut.NBpts > 0) {
+        bmc_apply_linearization(&lut, 0, dm_array, dm_send, NB_ACTUATORS);
+        bmc_apply_linearization(&lut, NB_ACTUATORS, &dm_array[TTM_INDEX], &dm_send[TTM_INDEX], NB_TTM_CHANNELS);
+
+        dm_cmd = dm_send;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &t_send);
+
+    error = BMCSetArray(&dm, dm_cmd, map_lut);
+    if (error) {
+        printf("\nThe error %d happened while setting array for deformable mirror\n", error);
+        return error;
+    }
+
+    trace.fields[KALAO_TRACE_T_DM] = kalao_trace_ns(&t_send);
+
+    kalao_histogram_record(latency_hist, kalao_timespec_diff_ns(&data.image[inID].md->writetime, &t_send));
+
+    if (latency_hist->count % LATENCY_UPDATE_PERIOD == 0) {
+        *latency_p50 = kalao_histogram_percentile(latency_hist, 0.50) / 1e3;
+        *latency_p99 = kalao_histogram_percentile(latency_hist, 0.99) / 1e3;
+        *latency_max = latency_hist->max / 1e3;
+
+        data.fpsptr->parray[fpi_latency_p50].cnt0++;
+        data.fpsptr->parray[fpi_latency_p99].cnt0++;
+        data.fpsptr->parray[fpi_latency_max].cnt0++;
+    }
+
+    /***** Side outputs *****/
+
+    // Everything below is for monitoring and happens after the DM is updated
+
+    data.image[calID].md->write = 1;
+
+    if (trace_cal_kw != -1)
+        kalao_trace_write(&data.image[calID], trace_cal_kw, &trace);
+
+    processinfo_update_output_stream(processinfo, calID);
+
+    data.image[dynamicBiasID].md->write = 1;
+    processinfo_update_output_stream(processinfo, dynamicBiasID);
+
+    data.image[slopesID].md->write = 1;
+
+    for (int spot = 0; spot < NBspot; spot++) {
+        data.image[slopesID].array.F[spotcoord[spot].XYout_dx] = spotcoord[spot].dx;
+        data.image[slopesID].array.F[spotcoord[spot].XYout_dy] = spotcoord[spot].dy;
+    }
+
+    if (trace_slopes_kw != -1)
+        kalao_trace_write(&data.image[slopesID], trace_slopes_kw, &trace);
+
+    processinfo_update_output_stream(processinfo, slopesID);
+
+    data.image[fluxID].md->write = 1;
+
+    for (int spot = 0; spot < NBspot; spot++) {
+        data.image[fluxID].array.F[spotcoord[spot].fluxout] = spotcoord[spot].flux;
+    }
+
+    processinfo_update_output_stream(processinfo, fluxID);
+
+    data.image[DMoutID].md->write = 1;
+    data.image[TTMoutID].md->write = 1;
+
+    bmc_write_commands(dm_array, data.image[DMoutID].array.F, data.image[TTMoutID].array.F);
+
+    if (trace_dm_kw != -1)
+        kalao_trace_write(&data.image[DMoutID], trace_dm_kw, &trace);
+
+    processinfo_update_output_stream(processinfo, DMoutID);
+    processinfo_update_output_stream(processinfo, TTMoutID);
+
+    *flux_max = centroid_stats.flux_max;
+    *flux_avg = centroid_stats.flux_avg;
+    *residual_rms = centroid_stats.residual_rms;
+    *slope_x_avg = centroid_stats.slope_x_avg;
+    *slope_y_avg = centroid_stats.slope_y_avg;
+
+    data.fpsptr->parray[fpi_flux_max].cnt0++;
+    data.fpsptr->parray[fpi_flux_avg].cnt0++;
+    data.fpsptr->parray[fpi_residual_rms].cnt0++;
+    data.fpsptr->parray[fpi_slope_x_avg].cnt0++;
+    data.fpsptr->parray[fpi_slope_y_avg].cnt0++;
+
+    data.image[statsID].md->write = 1;
+
+    {
+        double *record = &data.image[statsID].array.D[(stats_records % SHWFS_STATS_RING) * SHWFS_STATS_NBFIELDS];
+
+        shwfs_stats_write_begin(&data.image[statsID], stats_records);
+
+        record[SHWFS_STATS_CNT0] = data.image[inID].md->cnt0;
+        record[SHWFS_STATS_TIME] = data.image[inID].md->writetime.tv_sec + 1e-9 * data.image[inID].md->writetime.tv_nsec;
+        record[SHWFS_STATS_FLUX_AVG] = *flux_avg;
+        record[SHWFS_STATS_FLUX_MAX] = *flux_max;
+        record[SHWFS_STATS_RESIDUAL_RMS] = *residual_rms;
+        record[SHWFS_STATS_SLOPE_X_AVG] = *slope_x_avg;
+        record[SHWFS_STATS_SLOPE_Y_AVG] = *slope_y_avg;
+        record[SHWFS_STATS_VALID_SPOTS] = centroid_stats.valid_spots;
+
+        shwfs_stats_write_end(&data.image[statsID], stats_kw, stats_records);
+    }
+
+    data.image[statsID].md->cnt1 = stats_records % SHWFS_STATS_RING;
+    stats_records++;
+
+    processinfo_update_output_stream(processinfo, statsID);
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    free(spotcoord);
+    free(dm_array);
+    free(dm_send);
+    free(residual);
+    free(CM.matrix);
+    free(latency_hist);
+    free(lut.y0);
+    free(lut.slope);
+
+    processinfo_WriteMessage(processinfo, "Clearing array");
+    error = BMCClearArray(&dm);
+    if (error) {
+        printf("\nThe error %d happened while clearing deforamble mirror\n", error);
+        return error;
+    }
+
+    processinfo_WriteMessage(processinfo, "Closing DM");
+    error = BMCClose(&dm);
+    if (error) {
+        printf("\nThe error %d happened while closing the shutter\n", error);
+        return error;
+    }
+
+    DEBUG_TRACE_FEXIT();
+
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_KalAO_BMC__fused() {
+    CLIcmddata.FPS_customCONFsetup = customCONFsetup;
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef _MILK_KALAO_BMC_FUSED_H
+#define _MILK_KALAO_BMC_FUSED_H
+
+errno_t CLIADDCMD_KalAO_BMC__fused();
+
+#endif
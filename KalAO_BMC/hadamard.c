@@ -0,0 +1,439 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+#include "CommandLineInterface/fps/fps_GetParamIndex.h"
+
+#include "COREMOD_iofits/savefits.h"
+
+#include "actuators.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+// Sylvester Hadamard matrix of the smallest order >= NB_CALIB_CHANNELS
+#define NB_CALIB_CHANNELS (NB_ACTUATORS + NB_TTM_CHANNELS)
+#define HADAMARD_ORDER 256
+
+#define FRAME_RING_SIZE 16
+
+typedef struct
+{
+    int pattern;
+    int sign;
+
+} HADAMARD_FRAME_TAG;
+
+typedef struct
+{
+    uint64_t NBslopes;
+
+    // frames handed to the worker thread (single producer, single consumer)
+    float *frames;
+    HADAMARD_FRAME_TAG tags[FRAME_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    sem_t frame_ready;
+    int stop;
+
+    // (push - pull) / 2 per pattern, HADAMARD_ORDER x NBslopes
+    double *acc;
+    double weight;
+
+} HADAMARD_ACCUMULATOR;
+
+static char *DMout_streamname;
+static long fpi_DMout_streamname;
+
+static char *TTMout_streamname;
+static long fpi_TTMout_streamname;
+
+static float *amplitude;
+static long fpi_amplitude;
+
+static float *amplitude_ttm;
+static long fpi_amplitude_ttm;
+
+static int64_t *settle_frames;
+static long fpi_settle_frames;
+
+static int64_t *nb_frames;
+static long fpi_nb_frames;
+
+static char *output_fname;
+static long fpi_output_fname;
+
+static float *progress;
+static long fpi_progress;
+
+static CLICMDARGDEF farg[] =
+    {
+        {
+            CLIARG_STR,
+            ".DMout",
+            "DM channel used for the patterns",
+            "dm_calib",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&DMout_streamname,
+            &fpi_DMout_streamname,
+        },
+        {
+            CLIARG_STR,
+            ".TTMout",
+            "Tip-Tilt channel used for the patterns",
+            "ttm_calib",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&TTMout_streamname,
+            &fpi_TTMout_streamname,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".amplitude",
+            "Poke amplitude on DM actuators [DMin units]",
+            "0.1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&amplitude,
+            &fpi_amplitude,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".amplitude_ttm",
+            "Poke amplitude on Tip-Tilt [TTMin units]",
+            "0.1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&amplitude_ttm,
+            &fpi_amplitude_ttm,
+        },
+        {
+            CLIARG_INT64,
+            ".settle_frames",
+            "WFS frames skipped after each command change",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&settle_frames,
+            &fpi_settle_frames,
+        },
+        {
+            CLIARG_INT64,
+            ".nb_frames",
+            "WFS frames averaged for each pattern and sign",
+            "10",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&nb_frames,
+            &fpi_nb_frames,
+        },
+        {
+            CLIARG_STR,
+            ".output",
+            "Interaction matrix output file",
+            "interaction_matrix.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&output_fname,
+            &fpi_output_fname,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".progress",
+            "Calibration progress [%]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&progress,
+            &fpi_progress,
+        },
+};
+
+static CLICMDDATA CLIcmddata =
+    {
+        "hadamard",
+        "Measure interaction matrix with Hadamard patterns (triggered by SHWFS slopes)",
+        CLICMD_FIELDS_DEFAULTS,
+};
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static errno_t help_function() {
+    return RETURN_SUCCESS;
+}
+
+static errno_t customCONFsetup() {
+    if (data.fpsptr != NULL) {
+        data.fpsptr->parray[fpi_settle_frames].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_settle_frames].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_settle_frames].val.i64[1] = 0;   // min
+        data.fpsptr->parray[fpi_settle_frames].val.i64[2] = 100; // max
+
+        data.fpsptr->parray[fpi_nb_frames].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_nb_frames].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_nb_frames].val.i64[1] = 1;     // min
+        data.fpsptr->parray[fpi_nb_frames].val.i64[2] = 10000; // max
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static inline int hadamard(int i, int j) {
+    return (__builtin_popcount(i & j) & 1) ? -1 : 1;
+}
+
+static imageID open_output_channel(char *name, uint32_t sizeX, uint32_t sizeY) {
+    imageID ID = image_ID(name);
+
+    if (ID == -1) {
+        uint32_t *imsize = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+
+        imsize[0] = sizeX;
+        imsize[1] = sizeY;
+        create_image_ID(name, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &ID);
+
+        free(imsize);
+    }
+
+    return ID;
+}
+
+static void write_pattern(
+    PROCESSINFO *processinfo,
+    imageID DMoutID,
+    imageID TTMoutID,
+    int pattern,
+    float sign) {
+    data.image[DMoutID].md->write = 1;
+
+    for (uint64_t i = 0; i < data.image[DMoutID].md->nelement; i++)
+        data.image[DMoutID].array.F[i] = 0;
+
+    // pattern == -1 is the neutral command
+    if (pattern >= 0) {
+        for (int ii = 0; ii < NB_ACTUATORS; ii++)
+            data.image[DMoutID].array.F[actuator_pixel(ii)] = sign * *amplitude * hadamard(pattern, ii);
+    }
+
+    processinfo_update_output_stream(processinfo, DMoutID);
+
+    data.image[TTMoutID].md->write = 1;
+
+    for (int ii = 0; ii < NB_TTM_CHANNELS; ii++) {
+        if (pattern >= 0)
+            data.image[TTMoutID].array.F[ii] = sign * *amplitude_ttm * hadamard(pattern, NB_ACTUATORS + ii);
+        else
+            data.image[TTMoutID].array.F[ii] = 0;
+    }
+
+    processinfo_update_output_stream(processinfo, TTMoutID);
+}
+
+static void *accumulate_thread(void *ptr) {
+    HADAMARD_ACCUMULATOR *accumulator = (HADAMARD_ACCUMULATOR *)ptr;
+
+    while (1) {
+        sem_wait(&accumulator->frame_ready);
+
+        uint64_t head = __atomic_load_n(&accumulator->head, __ATOMIC_ACQUIRE);
+
+        if (accumulator->tail == head) {
+            if (__atomic_load_n(&accumulator->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t slot = accumulator->tail % FRAME_RING_SIZE;
+        float *frame = &accumulator->frames[slot * accumulator->NBslopes];
+        double *acc = &accumulator->acc[accumulator->tags[slot].pattern * accumulator->NBslopes];
+        double weight = accumulator->tags[slot].sign * accumulator->weight;
+
+        for (uint64_t s = 0; s < accumulator->NBslopes; s++)
+            acc[s] += weight * frame[s];
+
+        __atomic_store_n(&accumulator->tail, accumulator->tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static errno_t compute_function() {
+    DEBUG_TRACE_FSTART();
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+
+    /********** Open streams **********/
+
+    processinfo_WriteMessage(processinfo, "Connecting to streams");
+
+    imageID slopesID = processinfo->triggerstreamID;
+    uint64_t NBslopes = data.image[slopesID].md->nelement;
+
+    /********** Allocate streams **********/
+
+    processinfo_WriteMessage(processinfo, "Allocating streams");
+
+    imageID DMoutID = open_output_channel(DMout_streamname, DM_SIZE, DM_SIZE);
+    imageID TTMoutID = open_output_channel(TTMout_streamname, NB_TTM_CHANNELS, 1);
+    imageID imID = image_ID("bmc_interaction_matrix");
+
+    {
+        uint32_t *imsize = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+
+        imsize[0] = NBslopes;
+        imsize[1] = NB_CALIB_CHANNELS;
+        create_image_ID("bmc_interaction_matrix", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &imID);
+
+        free(imsize);
+    }
+
+    /********** Start accumulator **********/
+
+    processinfo_WriteMessage(processinfo, "Starting accumulator");
+
+    HADAMARD_ACCUMULATOR accumulator;
+
+    accumulator.NBslopes = NBslopes;
+    accumulator.frames = (float *)malloc(sizeof(float) * FRAME_RING_SIZE * NBslopes);
+    accumulator.head = 0;
+    accumulator.tail = 0;
+    accumulator.stop = 0;
+    accumulator.acc = (double *)calloc(HADAMARD_ORDER * NBslopes, sizeof(double));
+    accumulator.weight = 1.0 / (2 * *nb_frames);
+    sem_init(&accumulator.frame_ready, 0, 0);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, accumulate_thread, &accumulator);
+
+    /********** Loop **********/
+
+    int pattern = 0;
+    int sign = 1;
+    int frames = 0;
+    int done = 0;
+
+    uint64_t dropped = 0;
+    uint64_t cnt0_command = data.image[slopesID].md->cnt0;
+
+    write_pattern(processinfo, DMoutID, TTMoutID, pattern, sign);
+
+    processinfo_WriteMessage(processinfo, "Calibrating");
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    uint64_t cnt0 = data.image[slopesID].md->cnt0;
+
+    // Skip frames which may straddle the command change
+    if (!done && cnt0 > cnt0_command + *settle_frames) {
+        uint64_t head = accumulator.head;
+
+        if (head - __atomic_load_n(&accumulator.tail, __ATOMIC_ACQUIRE) < FRAME_RING_SIZE) {
+            uint64_t slot = head % FRAME_RING_SIZE;
+
+            for (uint64_t s = 0; s < NBslopes; s++)
+                accumulator.frames[slot * NBslopes + s] = data.image[slopesID].array.F[s];
+
+            accumulator.tags[slot].pattern = pattern;
+            accumulator.tags[slot].sign = sign;
+
+            __atomic_store_n(&accumulator.head, head + 1, __ATOMIC_RELEASE);
+            sem_post(&accumulator.frame_ready);
+
+            frames++;
+        } else {
+            // Worker is behind, frame is not counted
+            dropped++;
+        }
+
+        if (frames == *nb_frames) {
+            frames = 0;
+
+            if (sign == 1) {
+                sign = -1;
+            } else {
+                sign = 1;
+                pattern++;
+
+                *progress = 100.0 * pattern / HADAMARD_ORDER;
+                data.fpsptr->parray[fpi_progress].cnt0++;
+            }
+
+            if (pattern < HADAMARD_ORDER) {
+                write_pattern(processinfo, DMoutID, TTMoutID, pattern, sign);
+                cnt0_command = data.image[slopesID].md->cnt0;
+            } else {
+                done = 1;
+
+                write_pattern(processinfo, DMoutID, TTMoutID, -1, 0);
+
+                processinfo_WriteMessage(processinfo, "Decoding");
+
+                // Wait for the worker to drain the frames
+                __atomic_store_n(&accumulator.stop, 1, __ATOMIC_RELEASE);
+                sem_post(&accumulator.frame_ready);
+                pthread_join(thread, NULL);
+
+                // IM_b = sum_p H[p][b] d_p / (N * amplitude_b)
+                data.image[imID].md->write = 1;
+
+                for (int ch = 0; ch < NB_CALIB_CHANNELS; ch++) {
+                    double amp = ch < NB_ACTUATORS ? *amplitude : *amplitude_ttm;
+
+                    for (uint64_t s = 0; s < NBslopes; s++) {
+                        double response = 0;
+
+                        for (int p = 0; p < HADAMARD_ORDER; p++)
+                            response += hadamard(p, ch) * accumulator.acc[p * NBslopes + s];
+
+                        data.image[imID].array.F[ch * NBslopes + s] = response / (HADAMARD_ORDER * amp);
+                    }
+                }
+
+                processinfo_update_output_stream(processinfo, imID);
+
+                save_fits("bmc_interaction_matrix", output_fname);
+
+                printf("Interaction matrix saved to %s (%lu frames dropped)\n", output_fname, dropped);
+
+                processinfo_WriteMessage(processinfo, "Calibration done");
+            }
+        }
+    }
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    if (!done) {
+        write_pattern(processinfo, DMoutID, TTMoutID, -1, 0);
+
+        __atomic_store_n(&accumulator.stop, 1, __ATOMIC_RELEASE);
+        sem_post(&accumulator.frame_ready);
+        pthread_join(thread, NULL);
+    }
+
+    sem_destroy(&accumulator.frame_ready);
+    free(accumulator.frames);
+    free(accumulator.acc);
+
+    DEBUG_TRACE_FEXIT();
+
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_KalAO_BMC__hadamard() {
+    CLIcmddata.FPS_customCONFsetup = customCONFsetup;
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef _MILK_KALAO_BMC_HADAMARD_H
+#define _MILK_KALAO_BMC_HADAMARD_H
+
+errno_t CLIADDCMD_KalAO_BMC__hadamard();
+
+#endif
@@ -28,6 +28,7 @@
 // If functions are in separate .c files, include here the corresponding .h files
 //
 #include "acquire.h"
+#include "simulator.h"
 
 /* ================================================================== */
 /* ================================================================== */
@@ -49,6 +50,7 @@ INIT_MODULE_LIB(KalAO_Nuvu)
  */
 static errno_t init_module_CLI() {
     CLIADDCMD_KalAO_Nuvu__acquire();
+    CLIADDCMD_KalAO_Nuvu__simulator();
 
     return RETURN_SUCCESS;
 }
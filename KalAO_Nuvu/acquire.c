@@ -12,9 +12,16 @@
 #include "COREMOD_iofits/is_fits_file.h"
 #include "COREMOD_iofits/loadfits.h"
 
+#include "KalAO_Telemetry/instance.h"
+#include "KalAO_Telemetry/section_timers.h"
+#include "KalAO_Telemetry/trace.h"
+
+#include "calibration.h"
+
 #include <limits.h>
 #include <math.h>
 #include <stdlib.h>
+#include <time.h>
 
 /* ================================================================== */
 /* ================================================================== */
@@ -22,6 +29,13 @@
 /* ================================================================== */
 /* ================================================================== */
 
+// Sections of the loop, see KalAO_Telemetry/section_timers.h
+enum {
+    SECTION_SETTINGS,
+    SECTION_CALIBRATION,
+    SECTION_AUTOGAIN
+};
+
 typedef struct
 {
     int64_t emgain;
@@ -30,12 +44,31 @@ typedef struct
 
 } NUVU_AUTOGAIN_PARAMS;
 
+// Frames seen by acquire, see count_frames()
+typedef struct
+{
+    uint64_t cnt0;
+    uint16_t counter;
+    int64_t index;
+
+    // Start of the current drop rate interval
+    int64_t dropped;
+    struct timespec t;
+
+} NUVU_FRAME_COUNT;
+
 #define MAXNB_AUTOGAIN_PARAMS 100
 #define EPSILON 0.01
 #define FPFLAG_KALAO_AUTOGAIN 0x1000000000000000
-#define DYNAMIC_BIAS_SIZE 8
 #define READOUT_TIME 0.5538
 
+#define AUTOGAIN_SOURCE_FRAME 0
+#define AUTOGAIN_SOURCE_EXTERNAL 1
+
+#define AUTOGAIN_STATISTIC_MAX 0
+#define AUTOGAIN_STATISTIC_P999 1
+#define AUTOGAIN_STATISTIC_P99 2
+
 static int64_t *temperature;
 static long fpi_temperature;
 
@@ -72,6 +105,12 @@ static long fpi_autogain_setting;
 static char *autogain_params_fname;
 static long fpi_autogain_params_fname;
 
+static int64_t *autogain_source;
+static long fpi_autogain_source;
+
+static int64_t *autogain_statistic;
+static long fpi_autogain_statistic;
+
 static char *autogain_flux_param;
 static long fpi_autogain_flux_param;
 
@@ -87,9 +126,69 @@ static long fpi_autogain_highgain_lower;
 static int64_t *autogain_highgain_upper;
 static long fpi_autogain_highgain_upper;
 
+static int64_t *autogain_frame_lowgain_lower;
+static long fpi_autogain_frame_lowgain_lower;
+
+static int64_t *autogain_frame_lowgain_upper;
+static long fpi_autogain_frame_lowgain_upper;
+
+static int64_t *autogain_frame_highgain_lower;
+static long fpi_autogain_frame_highgain_lower;
+
+static int64_t *autogain_frame_highgain_upper;
+static long fpi_autogain_frame_highgain_upper;
+
 static int64_t *autogain_wait;
 static long fpi_autogain_wait;
 
+static uint64_t *calibration;
+static long fpi_calibration;
+
+static uint64_t *photon_counting;
+static long fpi_photon_counting;
+
+static char *photon_counting_readnoise_fname;
+static long fpi_photon_counting_readnoise_fname;
+
+static float *photon_counting_readnoise;
+static long fpi_photon_counting_readnoise;
+
+static float *photon_counting_threshold;
+static long fpi_photon_counting_threshold;
+
+static int64_t *photon_counting_window;
+static long fpi_photon_counting_window;
+
+static int64_t *coadd;
+static long fpi_coadd;
+
+static int64_t *frames_counter_px;
+static long fpi_frames_counter_px;
+
+static int64_t *frames_received;
+static long fpi_frames_received;
+
+static int64_t *frames_dropped;
+static long fpi_frames_dropped;
+
+static float *frames_drop_rate;
+static long fpi_frames_drop_rate;
+
+static float *frame_max;
+static long fpi_frame_max;
+
+static float *frame_p999;
+static long fpi_frame_p999;
+
+static float *frame_p99;
+static long fpi_frame_p99;
+
+static int64_t *frame_saturated;
+static long fpi_frame_saturated;
+
+static char *instance;
+static long fpi_instance;
+
 static CLICMDARGDEF farg[] =
     {
         {
@@ -200,10 +299,28 @@ static CLICMDARGDEF farg[] =
             (void **)&autogain_params_fname,
             &fpi_autogain_params_fname,
         },
+        {
+            CLIARG_INT64,
+            ".autogain.source",
+            "Autogain flux (0 = Frame statistic, 1 = External .autogain.flux_param)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&autogain_source,
+            &fpi_autogain_source,
+        },
+        {
+            CLIARG_INT64,
+            ".autogain.statistic",
+            "Frame statistic for autogain (0 = Max, 1 = 99.9th percentile, 2 = 99th percentile)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&autogain_statistic,
+            &fpi_autogain_statistic,
+        },
         {
             CLIARG_STR,
             ".autogain.flux_param",
-            "Flux param to use for autogain",
+            "External flux param to use for autogain (e.g. shwfs_process-1.flux_max)",
             "",
             CLIARG_HIDDEN_DEFAULT,
             (void **)&autogain_flux_param,
@@ -212,7 +329,7 @@ static CLICMDARGDEF farg[] =
         {
             CLIARG_INT64,
             ".autogain.lowgain_lower",
-            "Auto-gain Lower Limit in low gain regime [ADU]",
+            "Auto-gain Lower Limit in low gain regime, external flux [ADU]",
             "25000",
             CLIARG_HIDDEN_DEFAULT,
             (void **)&autogain_lowgain_lower,
@@ -221,7 +338,7 @@ static CLICMDARGDEF farg[] =
         {
             CLIARG_INT64,
             ".autogain.lowgain_upper",
-            "Auto-gain Upper Limit in low gain regime [ADU]",
+            "Auto-gain Upper Limit in low gain regime, external flux [ADU]",
             "60000",
             CLIARG_HIDDEN_DEFAULT,
             (void **)&autogain_lowgain_upper,
@@ -230,7 +347,7 @@ static CLICMDARGDEF farg[] =
         {
             CLIARG_INT64,
             ".autogain.highgain_lower",
-            "Auto-gain Lower Limit in high gain regime [ADU]",
+            "Auto-gain Lower Limit in high gain regime, external flux [ADU]",
             "1000",
             CLIARG_HIDDEN_DEFAULT,
             (void **)&autogain_highgain_lower,
@@ -239,12 +356,48 @@ static CLICMDARGDEF farg[] =
         {
             CLIARG_INT64,
             ".autogain.highgain_upper",
-            "Auto-gain Upper Limit in high gain regime [ADU]",
+            "Auto-gain Upper Limit in high gain regime, external flux [ADU]",
             "3000",
             CLIARG_HIDDEN_DEFAULT,
             (void **)&autogain_highgain_upper,
             &fpi_autogain_highgain_upper,
         },
+        {
+            CLIARG_INT64,
+            ".autogain.frame.lowgain_lower",
+            "Auto-gain Lower Limit in low gain regime, frame statistic [px ADU]",
+            "8000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&autogain_frame_lowgain_lower,
+            &fpi_autogain_frame_lowgain_lower,
+        },
+        {
+            CLIARG_INT64,
+            ".autogain.frame.lowgain_upper",
+            "Auto-gain Upper Limit in low gain regime, frame statistic [px ADU]",
+            "20000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&autogain_frame_lowgain_upper,
+            &fpi_autogain_frame_lowgain_upper,
+        },
+        {
+            CLIARG_INT64,
+            ".autogain.frame.highgain_lower",
+            "Auto-gain Lower Limit in high gain regime, frame statistic [px ADU]",
+            "300",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&autogain_frame_highgain_lower,
+            &fpi_autogain_frame_highgain_lower,
+        },
+        {
+            CLIARG_INT64,
+            ".autogain.frame.highgain_upper",
+            "Auto-gain Upper Limit in high gain regime, frame statistic [px ADU]",
+            "1000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&autogain_frame_highgain_upper,
+            &fpi_autogain_frame_highgain_upper,
+        },
         {
             CLIARG_INT64,
             ".autogain.wait_time",
@@ -254,6 +407,150 @@ static CLICMDARGDEF farg[] =
             (void **)&autogain_wait,
             &fpi_autogain_wait,
         },
+        {
+            CLIARG_ONOFF,
+            ".calibration_on",
+            "Calibrate frames in nuvu_stream ON/OFF (OFF with the fused pipeline)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&calibration,
+            &fpi_calibration,
+        },
+        {
+            CLIARG_ONOFF,
+            ".photon_counting_on",
+            "Photon counting ON/OFF (0/1 events instead of calibrated values)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&photon_counting,
+            &fpi_photon_counting,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".photon_counting.readnoise",
+            "Read noise files [ADU]",
+            "readnoise/readnoise_%02ldC_%02ldrom_%01ldb_%04ldg.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&photon_counting_readnoise_fname,
+            &fpi_photon_counting_readnoise_fname,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".photon_counting.readnoise_global",
+            "Read noise used when there is no read noise file [ADU]",
+            "50",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&photon_counting_readnoise,
+            &fpi_photon_counting_readnoise,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".photon_counting.threshold",
+            "Photon event threshold [read noise]",
+            "5.5",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&photon_counting_threshold,
+            &fpi_photon_counting_threshold,
+        },
+        {
+            CLIARG_INT64,
+            ".photon_counting.window",
+            "Number of frames over which events are summed (unused when co-adding)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&photon_counting_window,
+            &fpi_photon_counting_window,
+        },
+        {
+            CLIARG_INT64,
+            ".coadd",
+            "Number of calibrated frames summed in each frame of nuvu_stream",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&coadd,
+            &fpi_coadd,
+        },
+        {
+            CLIARG_INT64,
+            ".frames.counter_px",
+            "Raw pixel holding a 16-bit hardware frame counter, e.g. in the prescan rows (-1 = none)",
+            "-1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&frames_counter_px,
+            &fpi_frames_counter_px,
+        },
+        {
+            CLIARG_INT64,
+            ".frames.received",
+            "Number of frames received",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frames_received,
+            &fpi_frames_received,
+        },
+        {
+            CLIARG_INT64,
+            ".frames.dropped",
+            "Number of frames dropped",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frames_dropped,
+            &fpi_frames_dropped,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".frames.drop_rate",
+            "Frames dropped per second",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frames_drop_rate,
+            &fpi_frames_drop_rate,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".frame.max",
+            "Max. pixel above bias [ADU]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frame_max,
+            &fpi_frame_max,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".frame.p999",
+            "99.9th percentile of the pixels above bias [ADU]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frame_p999,
+            &fpi_frame_p999,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".frame.p99",
+            "99th percentile of the pixels above bias [ADU]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frame_p99,
+            &fpi_frame_p99,
+        },
+        {
+            CLIARG_INT64,
+            ".frame.saturated",
+            "Number of saturated pixels",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frame_saturated,
+            &fpi_frame_saturated,
+        },
+        {
+            CLIARG_STR,
+            ".instance",
+            "Instance name, suffix of the output streams (empty for the main pipeline)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&instance,
+            &fpi_instance,
+        },
 };
 
 static CLICMDDATA CLIcmddata =
@@ -263,6 +560,66 @@ static CLICMDDATA CLIcmddata =
         CLICMD_FIELDS_DEFAULTS,
 };
 
+/*
+ * State of one instance: parameters point into the FPS of the instance and
+ * streams get its .instance suffix (see KalAO_Telemetry/instance.h).
+ * Instances run side by side as separate processes, the milk process loop
+ * is bound to data.fpsptr.
+ */
+typedef struct
+{
+    FUNCTION_PARAMETER_STRUCT *fps;
+    char *instance;
+
+    int64_t *temperature;
+    int64_t *readoutmode;
+    int64_t *binning;
+    int64_t *emgain;
+    float *exposuretime;
+    char *bias_fname;
+    char *flat_fname;
+    int64_t *dynamic_bias_algorithm;
+    int64_t *autogain_setting;
+    char *autogain_params_fname;
+    int64_t *autogain_source;
+    int64_t *autogain_statistic;
+    char *autogain_flux_param;
+    int64_t *autogain_lowgain_lower;
+    int64_t *autogain_lowgain_upper;
+    int64_t *autogain_highgain_lower;
+    int64_t *autogain_highgain_upper;
+    int64_t *autogain_frame_lowgain_lower;
+    int64_t *autogain_frame_lowgain_upper;
+    int64_t *autogain_frame_highgain_lower;
+    int64_t *autogain_frame_highgain_upper;
+    int64_t *autogain_wait;
+    char *photon_counting_readnoise_fname;
+    float *photon_counting_readnoise;
+    float *photon_counting_threshold;
+    int64_t *photon_counting_window;
+    int64_t *coadd;
+    int64_t *frames_counter_px;
+    int64_t *frames_received;
+    int64_t *frames_dropped;
+    float *frames_drop_rate;
+    float *frame_max;
+    float *frame_p999;
+    float *frame_p99;
+    int64_t *frame_saturated;
+
+    char stream_streamname[KALAO_STREAMNAME_LEN];
+    char flat_streamname[KALAO_STREAMNAME_LEN];
+    char bias_streamname[KALAO_STREAMNAME_LEN];
+    char dynamic_bias_streamname[KALAO_STREAMNAME_LEN];
+    char flat_tmp_streamname[KALAO_STREAMNAME_LEN];
+    char bias_tmp_streamname[KALAO_STREAMNAME_LEN];
+    char readnoise_streamname[KALAO_STREAMNAME_LEN];
+    char readnoise_tmp_streamname[KALAO_STREAMNAME_LEN];
+    char threshold_streamname[KALAO_STREAMNAME_LEN];
+    char timers_streamname[KALAO_STREAMNAME_LEN];
+
+} NUVU_ACQUIRE_CONTEXT;
+
 /* ================================================================== */
 /* ================================================================== */
 /*  FUNCTIONS                                                                                                                                        	   */
@@ -318,6 +675,12 @@ static errno_t customCONFsetup() {
         data.fpsptr->parray[fpi_autogain_setting].val.i64[1] = 0;                     // min
         data.fpsptr->parray[fpi_autogain_setting].val.i64[2] = MAXNB_AUTOGAIN_PARAMS; // max
 
+        data.fpsptr->parray[fpi_autogain_statistic].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_autogain_statistic].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_autogain_statistic].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_autogain_statistic].val.i64[1] = AUTOGAIN_STATISTIC_MAX; // min
+        data.fpsptr->parray[fpi_autogain_statistic].val.i64[2] = AUTOGAIN_STATISTIC_P99; // max
+
         data.fpsptr->parray[fpi_autogain_lowgain_lower].fpflag |= FPFLAG_WRITERUN;
         data.fpsptr->parray[fpi_autogain_lowgain_lower].fpflag |= FPFLAG_MINLIMIT;
         data.fpsptr->parray[fpi_autogain_lowgain_lower].fpflag |= FPFLAG_MAXLIMIT;
@@ -342,22 +705,75 @@ static errno_t customCONFsetup() {
         data.fpsptr->parray[fpi_autogain_highgain_upper].val.i64[1] = 0;         // min
         data.fpsptr->parray[fpi_autogain_highgain_upper].val.i64[2] = 4 * 65535; // max
 
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_lower].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_lower].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_lower].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_lower].val.i64[1] = 0;     // min
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_lower].val.i64[2] = 65535; // max
+
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_upper].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_upper].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_upper].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_upper].val.i64[1] = 0;     // min
+        data.fpsptr->parray[fpi_autogain_frame_lowgain_upper].val.i64[2] = 65535; // max
+
+        data.fpsptr->parray[fpi_autogain_frame_highgain_lower].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_autogain_frame_highgain_lower].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_highgain_lower].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_highgain_lower].val.i64[1] = 0;     // min
+        data.fpsptr->parray[fpi_autogain_frame_highgain_lower].val.i64[2] = 65535; // max
+
+        data.fpsptr->parray[fpi_autogain_frame_highgain_upper].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_autogain_frame_highgain_upper].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_highgain_upper].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_autogain_frame_highgain_upper].val.i64[1] = 0;     // min
+        data.fpsptr->parray[fpi_autogain_frame_highgain_upper].val.i64[2] = 65535; // max
+
         data.fpsptr->parray[fpi_autogain_wait].fpflag |= FPFLAG_WRITERUN;
         data.fpsptr->parray[fpi_autogain_wait].fpflag |= FPFLAG_MINLIMIT;
         data.fpsptr->parray[fpi_autogain_wait].fpflag |= FPFLAG_MAXLIMIT;
         data.fpsptr->parray[fpi_autogain_wait].val.i64[1] = 0;    // min
         data.fpsptr->parray[fpi_autogain_wait].val.i64[2] = 10e6; // max
+
+        data.fpsptr->parray[fpi_calibration].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_photon_counting].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_photon_counting_readnoise].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_photon_counting_readnoise].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_photon_counting_readnoise].val.f32[1] = 0; // min
+
+        data.fpsptr->parray[fpi_photon_counting_threshold].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_photon_counting_threshold].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_photon_counting_threshold].val.f32[1] = 0; // min
+
+        data.fpsptr->parray[fpi_photon_counting_window].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_photon_counting_window].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_photon_counting_window].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_photon_counting_window].val.i64[1] = 1;                 // min
+        data.fpsptr->parray[fpi_photon_counting_window].val.i64[2] = NUVU_PC_MAXWINDOW; // max
+
+        data.fpsptr->parray[fpi_coadd].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_coadd].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_coadd].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_coadd].val.i64[1] = 1;    // min
+        data.fpsptr->parray[fpi_coadd].val.i64[2] = 1000; // max
+
+        data.fpsptr->parray[fpi_frames_counter_px].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_frames_counter_px].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_frames_counter_px].val.i64[1] = -1;                       // min
+        data.fpsptr->parray[fpi_frames_counter_px].val.i64[2] = WIDTH_IN * HEIGHT_IN - 1; // max
     }
 
     return RETURN_SUCCESS;
 }
 
-static int read_exposure_params(NUVU_AUTOGAIN_PARAMS *autogain_params, int64_t *max_gain, float *min_exposuretime) {
+static int read_exposure_params(NUVU_ACQUIRE_CONTEXT *ctx, NUVU_AUTOGAIN_PARAMS *autogain_params, int64_t *max_gain, float *min_exposuretime) {
     int NBautogain_params = 0;
 
     FILE *fp;
 
-    fp = fopen(autogain_params_fname, "r");
+    fp = fopen(ctx->autogain_params_fname, "r");
     if (fp == NULL) {
         perror("Unable to open file!"); // %s",  autogain_params_fname);
         exit(1);
@@ -396,43 +812,44 @@ static int read_exposure_params(NUVU_AUTOGAIN_PARAMS *autogain_params, int64_t *
 
     fclose(fp);
 
-    data.fpsptr->parray[fpi_autogain_setting].val.i64[2] = NBautogain_params - 1;
+    ctx->fps->parray[fpi_autogain_setting].val.i64[2] = NBautogain_params - 1;
 
     return NBautogain_params;
 }
 
-void increase_autogain(int NBautogain_params) {
-    if (*autogain_setting < NBautogain_params - 1) {
-        (*autogain_setting)++;
-        data.fpsptr->parray[fpi_autogain_setting].cnt0++;
+void increase_autogain(NUVU_ACQUIRE_CONTEXT *ctx, int NBautogain_params) {
+    if (*ctx->autogain_setting < NBautogain_params - 1) {
+        (*ctx->autogain_setting)++;
+        ctx->fps->parray[fpi_autogain_setting].cnt0++;
     }
 }
 
-void decrease_autogain(int NBautogain_params) {
-    if (*autogain_setting > 0) {
-        (*autogain_setting)--;
-        data.fpsptr->parray[fpi_autogain_setting].cnt0++;
+void decrease_autogain(NUVU_ACQUIRE_CONTEXT *ctx, int NBautogain_params) {
+    if (*ctx->autogain_setting > 0) {
+        (*ctx->autogain_setting)--;
+        ctx->fps->parray[fpi_autogain_setting].cnt0++;
     }
 }
 
 void update_exposure_parameters(
+    NUVU_ACQUIRE_CONTEXT *ctx,
     NUVU_AUTOGAIN_PARAMS *autogain_params) {
     // Signal that emgain and exposuretime will be updated by autogain
-    data.fpsptr->parray[fpi_emgain].userflag |= FPFLAG_KALAO_AUTOGAIN;
-    data.fpsptr->parray[fpi_exposuretime].userflag |= FPFLAG_KALAO_AUTOGAIN;
+    ctx->fps->parray[fpi_emgain].userflag |= FPFLAG_KALAO_AUTOGAIN;
+    ctx->fps->parray[fpi_exposuretime].userflag |= FPFLAG_KALAO_AUTOGAIN;
 
-    *emgain = autogain_params[*autogain_setting].emgain;
-    *exposuretime = autogain_params[*autogain_setting].exposuretime;
+    *ctx->emgain = autogain_params[*ctx->autogain_setting].emgain;
+    *ctx->exposuretime = autogain_params[*ctx->autogain_setting].exposuretime;
 
-    data.fpsptr->parray[fpi_emgain].cnt0++;
-    data.fpsptr->parray[fpi_exposuretime].cnt0++;
+    ctx->fps->parray[fpi_emgain].cnt0++;
+    ctx->fps->parray[fpi_exposuretime].cnt0++;
 }
 
-int update_exposuretime() {
-    printf("Exposure time to be set: %f\n", *exposuretime);
+int update_exposuretime(NUVU_ACQUIRE_CONTEXT *ctx) {
+    printf("Exposure time to be set: %f\n", *ctx->exposuretime);
 
     char set_exposuretime[255];
-    sprintf(set_exposuretime, "tmux send-keys -t kalaocam_ctrl \"SetExposureTime(%f)\" Enter", *exposuretime);
+    sprintf(set_exposuretime, "tmux send-keys -t kalaocam_ctrl \"SetExposureTime(%f)\" Enter", *ctx->exposuretime);
 
     int status = system(set_exposuretime);
     (void)status;
@@ -440,11 +857,11 @@ int update_exposuretime() {
     return RETURN_SUCCESS;
 }
 
-int update_emgain() {
-    printf("EMgain to be set: %ld\n", *emgain);
+int update_emgain(NUVU_ACQUIRE_CONTEXT *ctx) {
+    printf("EMgain to be set: %ld\n", *ctx->emgain);
 
     char set_emgain[255];
-    sprintf(set_emgain, "tmux send-keys -t kalaocam_ctrl \"SetEMCalibratedGain(%ld)\" Enter", *emgain);
+    sprintf(set_emgain, "tmux send-keys -t kalaocam_ctrl \"SetEMCalibratedGain(%ld)\" Enter", *ctx->emgain);
 
     int status = system(set_emgain);
     (void)status;
@@ -453,14 +870,15 @@ int update_emgain() {
 }
 
 void load_bias_and_flat(
+    NUVU_ACQUIRE_CONTEXT *ctx,
     PROCESSINFO *processinfo,
     imageID biasID,
     imageID flatID) {
     char biasfile[255];
     char flatfile[255];
 
-    sprintf(biasfile, bias_fname, *temperature, *readoutmode, *binning, *emgain);
-    sprintf(flatfile, flat_fname, *temperature, *readoutmode, *binning, *emgain);
+    sprintf(biasfile, ctx->bias_fname, *ctx->temperature, *ctx->readoutmode, *ctx->binning, *ctx->emgain);
+    sprintf(flatfile, ctx->flat_fname, *ctx->temperature, *ctx->readoutmode, *ctx->binning, *ctx->emgain);
 
     imageID biastmpID = -1;
     imageID flattmpID = -1;
@@ -472,7 +890,7 @@ void load_bias_and_flat(
     } else if (!is_fits_file(biasfile)) {
         printf("Bias file %s is not a valid FITS file\n", biasfile);
     } else {
-        load_fits(biasfile, "nuvu_bias_tmp", 1, &biastmpID);
+        load_fits(biasfile, ctx->bias_tmp_streamname, 1, &biastmpID);
 
         if (data.image[biasID].md->datatype != data.image[biastmpID].md->datatype) {
             printf("Wrong data type for bias file %s\n", biasfile);
@@ -490,14 +908,14 @@ void load_bias_and_flat(
         for (uint64_t i = 0; i < data.image[biasID].md->nelement; i++)
             data.image[biasID].array.F[i] = data.image[biastmpID].array.F[i];
 
-        data.fpsptr->parray[fpi_dynamic_bias].fpflag &= ~FPFLAG_ONOFF;
-        data.fpsptr->parray[fpi_dynamic_bias].cnt0++;
+        ctx->fps->parray[fpi_dynamic_bias].fpflag &= ~FPFLAG_ONOFF;
+        ctx->fps->parray[fpi_dynamic_bias].cnt0++;
     } else {
         for (uint64_t i = 0; i < data.image[biasID].md->nelement; i++)
             data.image[biasID].array.F[i] = 0;
 
-        data.fpsptr->parray[fpi_dynamic_bias].fpflag |= FPFLAG_ONOFF;
-        data.fpsptr->parray[fpi_dynamic_bias].cnt0++;
+        ctx->fps->parray[fpi_dynamic_bias].fpflag |= FPFLAG_ONOFF;
+        ctx->fps->parray[fpi_dynamic_bias].cnt0++;
     }
 
     processinfo_update_output_stream(processinfo, biasID);
@@ -509,7 +927,7 @@ void load_bias_and_flat(
     } else if (!is_fits_file(flatfile)) {
         printf("Flat file %s is not a valid FITS file\n", flatfile);
     } else {
-        load_fits(flatfile, "nuvu_flat_tmp", 1, &flattmpID);
+        load_fits(flatfile, ctx->flat_tmp_streamname, 1, &flattmpID);
 
         if (data.image[flatID].md->datatype != data.image[flattmpID].md->datatype) {
             printf("Wrong data type for flat file %s\n", flatfile);
@@ -534,38 +952,235 @@ void load_bias_and_flat(
     processinfo_update_output_stream(processinfo, flatID);
 }
 
-#define WIDTH_IN 520
-#define HEIGHT_IN 70
+void load_readnoise(
+    NUVU_ACQUIRE_CONTEXT *ctx,
+    PROCESSINFO *processinfo,
+    imageID readnoiseID) {
+    char readnoisefile[255];
+
+    sprintf(readnoisefile, ctx->photon_counting_readnoise_fname, *ctx->temperature, *ctx->readoutmode, *ctx->binning, *ctx->emgain);
+
+    imageID readnoisetmpID = -1;
+
+    if (!file_exists(readnoisefile)) {
+        printf("Read noise file %s not found\n", readnoisefile);
+    } else if (!is_fits_file(readnoisefile)) {
+        printf("Read noise file %s is not a valid FITS file\n", readnoisefile);
+    } else {
+        load_fits(readnoisefile, ctx->readnoise_tmp_streamname, 1, &readnoisetmpID);
+
+        if (data.image[readnoiseID].md->datatype != data.image[readnoisetmpID].md->datatype) {
+            printf("Wrong data type for read noise file %s\n", readnoisefile);
+            readnoisetmpID = -1;
+        } else if (data.image[readnoiseID].md->nelement != data.image[readnoisetmpID].md->nelement) {
+            printf("Wrong size for read noise file %s\n", readnoisefile);
+            readnoisetmpID = -1;
+        }
+    }
+
+    data.image[readnoiseID].md->write = 1;
+
+    if (readnoisetmpID != -1) {
+        for (uint64_t i = 0; i < data.image[readnoiseID].md->nelement; i++)
+            data.image[readnoiseID].array.F[i] = data.image[readnoisetmpID].array.F[i];
+    } else {
+        // Same read noise for all pixels
+        for (uint64_t i = 0; i < data.image[readnoiseID].md->nelement; i++)
+            data.image[readnoiseID].array.F[i] = *ctx->photon_counting_readnoise;
+    }
+
+    processinfo_update_output_stream(processinfo, readnoiseID);
+}
+
+/*
+ * Photon event thresholds on the calibrated frame, which is flat-fielded:
+ * threshold x read noise x flat.
+ */
+void update_photon_threshold(
+    NUVU_ACQUIRE_CONTEXT *ctx,
+    PROCESSINFO *processinfo,
+    imageID readnoiseID,
+    imageID flatID,
+    imageID thresholdID) {
+    data.image[thresholdID].md->write = 1;
+
+    for (uint64_t i = 0; i < data.image[thresholdID].md->nelement; i++)
+        data.image[thresholdID].array.F[i] = *ctx->photon_counting_threshold * data.image[readnoiseID].array.F[i] * data.image[flatID].array.F[i];
 
-#define WIDTH 64
-#define HEIGHT 64
+    processinfo_update_output_stream(processinfo, thresholdID);
+}
 
-// With parenthesis around the arguments and the expression to avoid operator precedence issues
-#define RAW_PX_INDEX(i, j) (((j) + 4) * WIDTH_IN + 8 * (WIDTH - (i)))
+void init_frame_count(NUVU_ACQUIRE_CONTEXT *ctx, IMAGE *raw, NUVU_FRAME_COUNT *count) {
+    count->cnt0 = raw->md->cnt0;
+    count->index = raw->md->cnt0;
+
+    if (*ctx->frames_counter_px != -1) {
+        count->counter = raw->array.UI16[*ctx->frames_counter_px];
+    }
+
+    count->dropped = *ctx->frames_dropped;
+    clock_gettime(CLOCK_MONOTONIC, &count->t);
+}
+
+/*
+ * Count the frames since the previous one. The hardware counter, if there is
+ * one, also sees the frames lost by the grabber, cnt0 of the raw stream only
+ * those lost by acquire. index is the true index of the frame, used by
+ * autogain to count frames.
+ */
+void count_frames(NUVU_ACQUIRE_CONTEXT *ctx, IMAGE *raw, NUVU_FRAME_COUNT *count) {
+    int64_t delta;
+
+    if (*ctx->frames_counter_px != -1) {
+        uint16_t counter = raw->array.UI16[*ctx->frames_counter_px];
+
+        // Wraps around at 65536
+        delta = (uint16_t)(counter - count->counter);
+        count->counter = counter;
+    } else if (raw->md->cnt0 < count->cnt0) {
+        // Restart of the raw stream
+        delta = 1;
+    } else {
+        delta = raw->md->cnt0 - count->cnt0;
+    }
+
+    count->cnt0 = raw->md->cnt0;
+
+    if (delta > 1) {
+        *ctx->frames_dropped += delta - 1;
+        ctx->fps->parray[fpi_frames_dropped].cnt0++;
+    }
+
+    if (delta > 0) {
+        count->index += delta;
+
+        (*ctx->frames_received)++;
+        ctx->fps->parray[fpi_frames_received].cnt0++;
+    }
+
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    double dt = (t.tv_sec - count->t.tv_sec) + (t.tv_nsec - count->t.tv_nsec) / 1e9;
+
+    if (dt >= 1) {
+        *ctx->frames_drop_rate = (*ctx->frames_dropped - count->dropped) / dt;
+        ctx->fps->parray[fpi_frames_drop_rate].cnt0++;
+
+        count->dropped = *ctx->frames_dropped;
+        count->t = t;
+    }
+}
+
+static void context_init(NUVU_ACQUIRE_CONTEXT *ctx, FUNCTION_PARAMETER_STRUCT *fps) {
+    ctx->fps = fps;
+    ctx->instance = fps->parray[fpi_instance].val.string[0];
+
+    ctx->temperature = &fps->parray[fpi_temperature].val.i64[0];
+    ctx->readoutmode = &fps->parray[fpi_readoutmode].val.i64[0];
+    ctx->binning = &fps->parray[fpi_binning].val.i64[0];
+    ctx->emgain = &fps->parray[fpi_emgain].val.i64[0];
+    ctx->exposuretime = &fps->parray[fpi_exposuretime].val.f32[0];
+    ctx->bias_fname = fps->parray[fpi_bias_fname].val.string[0];
+    ctx->flat_fname = fps->parray[fpi_flat_fname].val.string[0];
+    ctx->dynamic_bias_algorithm = &fps->parray[fpi_dynamic_bias_algorithm].val.i64[0];
+    ctx->autogain_setting = &fps->parray[fpi_autogain_setting].val.i64[0];
+    ctx->autogain_params_fname = fps->parray[fpi_autogain_params_fname].val.string[0];
+    ctx->autogain_source = &fps->parray[fpi_autogain_source].val.i64[0];
+    ctx->autogain_statistic = &fps->parray[fpi_autogain_statistic].val.i64[0];
+    ctx->autogain_flux_param = fps->parray[fpi_autogain_flux_param].val.string[0];
+    ctx->autogain_lowgain_lower = &fps->parray[fpi_autogain_lowgain_lower].val.i64[0];
+    ctx->autogain_lowgain_upper = &fps->parray[fpi_autogain_lowgain_upper].val.i64[0];
+    ctx->autogain_highgain_lower = &fps->parray[fpi_autogain_highgain_lower].val.i64[0];
+    ctx->autogain_highgain_upper = &fps->parray[fpi_autogain_highgain_upper].val.i64[0];
+    ctx->autogain_frame_lowgain_lower = &fps->parray[fpi_autogain_frame_lowgain_lower].val.i64[0];
+    ctx->autogain_frame_lowgain_upper = &fps->parray[fpi_autogain_frame_lowgain_upper].val.i64[0];
+    ctx->autogain_frame_highgain_lower = &fps->parray[fpi_autogain_frame_highgain_lower].val.i64[0];
+    ctx->autogain_frame_highgain_upper = &fps->parray[fpi_autogain_frame_highgain_upper].val.i64[0];
+    ctx->autogain_wait = &fps->parray[fpi_autogain_wait].val.i64[0];
+    ctx->photon_counting_readnoise_fname = fps->parray[fpi_photon_counting_readnoise_fname].val.string[0];
+    ctx->photon_counting_readnoise = &fps->parray[fpi_photon_counting_readnoise].val.f32[0];
+    ctx->photon_counting_threshold = &fps->parray[fpi_photon_counting_threshold].val.f32[0];
+    ctx->photon_counting_window = &fps->parray[fpi_photon_counting_window].val.i64[0];
+    ctx->coadd = &fps->parray[fpi_coadd].val.i64[0];
+    ctx->frames_counter_px = &fps->parray[fpi_frames_counter_px].val.i64[0];
+    ctx->frames_received = &fps->parray[fpi_frames_received].val.i64[0];
+    ctx->frames_dropped = &fps->parray[fpi_frames_dropped].val.i64[0];
+    ctx->frames_drop_rate = &fps->parray[fpi_frames_drop_rate].val.f32[0];
+    ctx->frame_max = &fps->parray[fpi_frame_max].val.f32[0];
+    ctx->frame_p999 = &fps->parray[fpi_frame_p999].val.f32[0];
+    ctx->frame_p99 = &fps->parray[fpi_frame_p99].val.f32[0];
+    ctx->frame_saturated = &fps->parray[fpi_frame_saturated].val.i64[0];
+
+    kalao_instance_name(ctx->stream_streamname, ctx->instance, "nuvu_stream");
+    kalao_instance_name(ctx->flat_streamname, ctx->instance, "nuvu_flat");
+    kalao_instance_name(ctx->bias_streamname, ctx->instance, "nuvu_bias");
+    kalao_instance_name(ctx->dynamic_bias_streamname, ctx->instance, "nuvu_dynamic_bias");
+    kalao_instance_name(ctx->flat_tmp_streamname, ctx->instance, "nuvu_flat_tmp");
+    kalao_instance_name(ctx->bias_tmp_streamname, ctx->instance, "nuvu_bias_tmp");
+    kalao_instance_name(ctx->readnoise_streamname, ctx->instance, "nuvu_readnoise");
+    kalao_instance_name(ctx->readnoise_tmp_streamname, ctx->instance, "nuvu_readnoise_tmp");
+    kalao_instance_name(ctx->threshold_streamname, ctx->instance, "nuvu_pc_threshold");
+    kalao_instance_name(ctx->timers_streamname, ctx->instance, "nuvu_acquire_timers");
+}
 
 static errno_t compute_function() {
     DEBUG_TRACE_FSTART();
 
-    int width = 64;
-    int height = 64;
+    NUVU_ACQUIRE_CONTEXT ctx;
+    context_init(&ctx, data.fpsptr);
+
+    int width = WIDTH;
+    int height = HEIGHT;
+
+    /********** Autogain flux **********/
+
+    // Statistic of the raw frame, or a param of another FPS
+    NUVU_HISTOGRAM *histogram = (NUVU_HISTOGRAM *)malloc(sizeof(NUVU_HISTOGRAM));
+    NUVU_FRAME_STATS frame_stats;
 
-    /********** Open fps **********/
+    float frame_flux = 0;
+    long frame_cnt0 = 0;
+
+    float *flux = &frame_flux;
+    long *flux_cnt0_ptr = &frame_cnt0;
 
     FUNCTION_PARAMETER_STRUCT shwfs_fps;
+    int shwfs_fps_connected = 0;
 
-    char shwfs_tmp[255];
-    char *shwfs_proc_name;
-    char *shwfs_flux_param;
+    if (*ctx.autogain_source == AUTOGAIN_SOURCE_EXTERNAL) {
+        char shwfs_tmp[255];
+        char *shwfs_proc_name;
+        char *shwfs_flux_param;
 
-    strcpy(shwfs_tmp, autogain_flux_param);
+        strncpy(shwfs_tmp, ctx.autogain_flux_param, sizeof(shwfs_tmp) - 1);
+        shwfs_tmp[sizeof(shwfs_tmp) - 1] = '\0';
 
-    shwfs_proc_name = strtok(shwfs_tmp, ".");
-    shwfs_flux_param = strtok(NULL, ".");
+        shwfs_proc_name = strtok(shwfs_tmp, ".");
+        shwfs_flux_param = strtok(NULL, ".");
 
-    function_parameter_struct_connect(shwfs_proc_name, &shwfs_fps, FPSCONNECT_SIMPLE);
+        if (shwfs_proc_name != NULL && shwfs_flux_param != NULL && function_parameter_struct_connect(shwfs_proc_name, &shwfs_fps, FPSCONNECT_SIMPLE) != -1) {
+            shwfs_fps_connected = 1;
 
-    float *flux = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, shwfs_flux_param);
-    long *flux_cnt0_ptr = &shwfs_fps.parray[functionparameter_GetParamIndex(&shwfs_fps, shwfs_flux_param)].cnt0;
+            flux = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, shwfs_flux_param);
+            flux_cnt0_ptr = &shwfs_fps.parray[functionparameter_GetParamIndex(&shwfs_fps, shwfs_flux_param)].cnt0;
+        } else {
+            printf("Unable to connect to %s, using frame statistic for autogain\n", ctx.autogain_flux_param);
+        }
+    }
+
+    // Limits in the units of the flux used: subaperture flux or pixels
+    int64_t *lowgain_lower = ctx.autogain_lowgain_lower;
+    int64_t *lowgain_upper = ctx.autogain_lowgain_upper;
+    int64_t *highgain_lower = ctx.autogain_highgain_lower;
+    int64_t *highgain_upper = ctx.autogain_highgain_upper;
+
+    if (!shwfs_fps_connected) {
+        lowgain_lower = ctx.autogain_frame_lowgain_lower;
+        lowgain_upper = ctx.autogain_frame_lowgain_upper;
+        highgain_lower = ctx.autogain_frame_highgain_lower;
+        highgain_upper = ctx.autogain_frame_highgain_upper;
+    }
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
 
@@ -574,41 +1189,72 @@ static errno_t compute_function() {
     processinfo_WriteMessage(processinfo, "Allocating streams");
 
     imageID inID = processinfo->triggerstreamID;
-    imageID outID = image_ID("nuvu_stream");
-    imageID flatID = image_ID("nuvu_flat");
-    imageID biasID = image_ID("nuvu_bias");
-    imageID dynamicBiasID = image_ID("nuvu_dynamic_bias");
+    imageID outID = image_ID(ctx.stream_streamname);
+    imageID flatID = image_ID(ctx.flat_streamname);
+    imageID biasID = image_ID(ctx.bias_streamname);
+    imageID dynamicBiasID = image_ID(ctx.dynamic_bias_streamname);
+    imageID readnoiseID = image_ID(ctx.readnoise_streamname);
+    imageID thresholdID = image_ID(ctx.threshold_streamname);
     {
         uint32_t *imsize = (uint32_t *)malloc(sizeof(uint32_t) * 2);
 
         imsize[0] = width;
         imsize[1] = height;
 
-        create_image_ID("nuvu_stream", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &outID);
-        create_image_ID("nuvu_flat", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &flatID);
-        create_image_ID("nuvu_bias", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &biasID);
-        create_image_ID("nuvu_dynamic_bias", 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &dynamicBiasID);
+        create_image_ID(ctx.stream_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &outID);
+        create_image_ID(ctx.flat_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &flatID);
+        create_image_ID(ctx.bias_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &biasID);
+        create_image_ID(ctx.dynamic_bias_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &dynamicBiasID);
+        create_image_ID(ctx.readnoise_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &readnoiseID);
+        create_image_ID(ctx.threshold_streamname, 2, imsize, _DATATYPE_FLOAT, 1, 10, 0, &thresholdID);
 
         free(imsize);
     }
 
+    // Frame trace, see KalAO_Telemetry/trace.h
+    int trace_kw = kalao_trace_init(&data.image[outID]);
+    KALAO_TRACE trace;
+
     /********** Configure camera **********/
 
     processinfo_WriteMessage(processinfo, "Configuring camera");
 
     // error =
-    update_exposuretime();
-    long exposuretime_cnt0 = data.fpsptr->parray[fpi_exposuretime].cnt0;
+    update_exposuretime(&ctx);
+    long exposuretime_cnt0 = ctx.fps->parray[fpi_exposuretime].cnt0;
 
     // error =
-    update_emgain();
-    long emgain_cnt0 = data.fpsptr->parray[fpi_emgain].cnt0;
+    update_emgain(&ctx);
+    long emgain_cnt0 = ctx.fps->parray[fpi_emgain].cnt0;
 
     /********** Load bias and flat **********/
 
     processinfo_WriteMessage(processinfo, "Loading flat and bias");
 
-    load_bias_and_flat(processinfo, biasID, flatID);
+    load_bias_and_flat(&ctx, processinfo, biasID, flatID);
+
+    /********** Photon counting **********/
+
+    processinfo_WriteMessage(processinfo, "Loading read noise");
+
+    load_readnoise(&ctx, processinfo, readnoiseID);
+    update_photon_threshold(&ctx, processinfo, readnoiseID, flatID, thresholdID);
+
+    long readnoise_cnt0 = ctx.fps->parray[fpi_photon_counting_readnoise].cnt0;
+    long threshold_cnt0 = ctx.fps->parray[fpi_photon_counting_threshold].cnt0;
+
+    // Events of the frames in the window, and their sum
+    uint8_t *pc_events = (uint8_t *)calloc(NUVU_PC_MAXWINDOW * WIDTH * HEIGHT, sizeof(uint8_t));
+    int32_t *pc_counts = (int32_t *)calloc(WIDTH * HEIGHT, sizeof(int32_t));
+    int64_t pc_window = 0;
+    int64_t pc_slot = 0;
+
+    /********** Co-adding **********/
+
+    // Sub-frames are calibrated in coadd_frame and summed in coadd_sum
+    float *coadd_frame = (float *)malloc(sizeof(float) * WIDTH * HEIGHT);
+    float *coadd_sum = (float *)calloc(WIDTH * HEIGHT, sizeof(float));
+    int64_t coadd_count = 0;
 
     /********** Load auto-gain parameters **********/
 
@@ -618,206 +1264,310 @@ static errno_t compute_function() {
     int64_t max_gain = 0;
     float min_exposuretime = 1e6;
 
-    int NBautogain_params = read_exposure_params(autogain_params, &max_gain, &min_exposuretime);
+    int NBautogain_params = read_exposure_params(&ctx, autogain_params, &max_gain, &min_exposuretime);
+
+    NUVU_FRAME_COUNT frame_count;
+    init_frame_count(&ctx, &data.image[inID], &frame_count);
+
+    frame_cnt0 = frame_count.index;
     long flux_cnt0 = *flux_cnt0_ptr;
-    long autogain_cnt0 = data.fpsptr->parray[fpi_autogain].cnt0;
 
-    if (data.fpsptr->parray[fpi_autogain].fpflag & FPFLAG_ONOFF) {
+    // Frame index of the last exposure change by autogain
+    int64_t change_index = frame_count.index;
+    long autogain_cnt0 = ctx.fps->parray[fpi_autogain].cnt0;
+
+    if (ctx.fps->parray[fpi_autogain].fpflag & FPFLAG_ONOFF) {
         // If autogain is on, apply setting
-        update_exposure_parameters(autogain_params);
+        update_exposure_parameters(&ctx, autogain_params);
     } else {
         // Needed to avoid race condition when enabling auto-gain
         // Explanation: cacao set flag to on and THEN increment cnt0, and our code can run in-between this two actions
         autogain_cnt0--;
     }
 
-    long autogain_setting_cnt0 = data.fpsptr->parray[fpi_autogain_setting].cnt0;
+    long autogain_setting_cnt0 = ctx.fps->parray[fpi_autogain_setting].cnt0;
 
     /********** Loop **********/
 
-    int ii, jj;
     uint64_t autogain_wait_frame;
     uint64_t avg_samples;
     float flux_avg = 0;
 
+    KALAO_SECTIONS(timers, ctx.timers_streamname, "settings", "calibration", "autogain");
+
     processinfo_WriteMessage(processinfo, "Looping");
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
 
-    if (data.fpsptr->parray[fpi_autogain_setting].cnt0 != autogain_setting_cnt0) {
-        autogain_setting_cnt0 = data.fpsptr->parray[fpi_autogain_setting].cnt0;
+    KALAO_SECTION_START(timers);
+
+    if (ctx.fps->parray[fpi_autogain_setting].cnt0 != autogain_setting_cnt0) {
+        autogain_setting_cnt0 = ctx.fps->parray[fpi_autogain_setting].cnt0;
 
-        update_exposure_parameters(autogain_params);
+        update_exposure_parameters(&ctx, autogain_params);
     }
 
-    if (data.fpsptr->parray[fpi_exposuretime].cnt0 != exposuretime_cnt0) {
-        exposuretime_cnt0 = data.fpsptr->parray[fpi_exposuretime].cnt0;
+    if (ctx.fps->parray[fpi_exposuretime].cnt0 != exposuretime_cnt0) {
+        exposuretime_cnt0 = ctx.fps->parray[fpi_exposuretime].cnt0;
 
-        if (data.fpsptr->parray[fpi_exposuretime].userflag & FPFLAG_KALAO_AUTOGAIN) {
+        if (ctx.fps->parray[fpi_exposuretime].userflag & FPFLAG_KALAO_AUTOGAIN) {
             // If updated by autogain, remove flag
-            data.fpsptr->parray[fpi_exposuretime].userflag &= ~FPFLAG_KALAO_AUTOGAIN;
+            ctx.fps->parray[fpi_exposuretime].userflag &= ~FPFLAG_KALAO_AUTOGAIN;
         } else {
             // If not (updated by user), deactivate autogain
-            data.fpsptr->parray[fpi_autogain].fpflag &= ~FPFLAG_ONOFF;
-            data.fpsptr->parray[fpi_autogain].cnt0++;
+            ctx.fps->parray[fpi_autogain].fpflag &= ~FPFLAG_ONOFF;
+            ctx.fps->parray[fpi_autogain].cnt0++;
         }
 
         processinfo_WriteMessage(processinfo, "New exposure time");
 
         // error =
-        update_exposuretime();
+        update_exposuretime(&ctx);
+        change_index = frame_count.index;
 
         processinfo_WriteMessage(processinfo, "Looping");
     }
 
-    if (data.fpsptr->parray[fpi_emgain].cnt0 != emgain_cnt0) {
-        emgain_cnt0 = data.fpsptr->parray[fpi_emgain].cnt0;
+    if (ctx.fps->parray[fpi_emgain].cnt0 != emgain_cnt0) {
+        emgain_cnt0 = ctx.fps->parray[fpi_emgain].cnt0;
 
-        if (data.fpsptr->parray[fpi_emgain].userflag & FPFLAG_KALAO_AUTOGAIN) {
+        if (ctx.fps->parray[fpi_emgain].userflag & FPFLAG_KALAO_AUTOGAIN) {
             // If updated by autogain, remove flag
-            data.fpsptr->parray[fpi_emgain].userflag &= ~FPFLAG_KALAO_AUTOGAIN;
+            ctx.fps->parray[fpi_emgain].userflag &= ~FPFLAG_KALAO_AUTOGAIN;
         } else {
             // If not (updated by user), deactivate autogain
-            data.fpsptr->parray[fpi_autogain].fpflag &= ~FPFLAG_ONOFF;
-            data.fpsptr->parray[fpi_autogain].cnt0++;
+            ctx.fps->parray[fpi_autogain].fpflag &= ~FPFLAG_ONOFF;
+            ctx.fps->parray[fpi_autogain].cnt0++;
         }
 
         processinfo_WriteMessage(processinfo, "New EM gain");
 
         // error =
-        update_emgain();
+        update_emgain(&ctx);
+        change_index = frame_count.index;
 
-        load_bias_and_flat(processinfo, biasID, flatID);
+        load_bias_and_flat(&ctx, processinfo, biasID, flatID);
+        load_readnoise(&ctx, processinfo, readnoiseID);
+        update_photon_threshold(&ctx, processinfo, readnoiseID, flatID, thresholdID);
 
         processinfo_WriteMessage(processinfo, "Looping");
     }
 
-    /***** Write output stream *****/
+    if (ctx.fps->parray[fpi_photon_counting_readnoise].cnt0 != readnoise_cnt0) {
+        readnoise_cnt0 = ctx.fps->parray[fpi_photon_counting_readnoise].cnt0;
 
-    data.image[outID].md->write = 1;
-    data.image[dynamicBiasID].md->write = 1;
+        load_readnoise(&ctx, processinfo, readnoiseID);
+        update_photon_threshold(&ctx, processinfo, readnoiseID, flatID, thresholdID);
+    }
 
-    if (data.fpsptr->parray[fpi_dynamic_bias].fpflag & FPFLAG_ONOFF) {
-        float bias[4] = {0, 0, 0, 0};
+    if (ctx.fps->parray[fpi_photon_counting_threshold].cnt0 != threshold_cnt0) {
+        threshold_cnt0 = ctx.fps->parray[fpi_photon_counting_threshold].cnt0;
 
-        int ii_0[] = {0, width - DYNAMIC_BIAS_SIZE};
-        int jj_0[] = {0, height - DYNAMIC_BIAS_SIZE};
+        update_photon_threshold(&ctx, processinfo, readnoiseID, flatID, thresholdID);
+    }
 
-        for (int k = 0; k < 2; k++) {
-            for (int l = 0; l < 2; l++) {
-                for (ii = 0; ii < DYNAMIC_BIAS_SIZE; ii++)
-                    for (jj = 0; jj < DYNAMIC_BIAS_SIZE; jj++)
-                        bias[l * 2 + k] += data.image[inID].array.UI16[RAW_PX_INDEX(ii_0[k] + ii, jj_0[l] + jj)];
+    KALAO_SECTION_LAP(timers, SECTION_SETTINGS);
 
-                bias[l * 2 + k] /= DYNAMIC_BIAS_SIZE * DYNAMIC_BIAS_SIZE;
-            }
+    /***** Count frames *****/
+
+    count_frames(&ctx, &data.image[inID], &frame_count);
+
+    /***** Write output stream *****/
+
+    // Calibration may be done by the fused pipeline instead (KalAO_BMC fused)
+    if (ctx.fps->parray[fpi_calibration].fpflag & FPFLAG_ONOFF) {
+        int bias_mode = NUVU_BIAS_STATIC;
+
+        if (ctx.fps->parray[fpi_dynamic_bias].fpflag & FPFLAG_ONOFF) {
+            bias_mode = *ctx.dynamic_bias_algorithm == 0 ? NUVU_BIAS_DYNAMIC_MEAN : NUVU_BIAS_DYNAMIC_BILINEAR;
         }
 
-        if (*dynamic_bias_algorithm == 0) {
-            // Subtract mean
-            float bias_mean = (bias[0] + bias[1] + bias[2] + bias[3]) / 4;
+        // Without co-adding, frames are calibrated directly in the output stream
+        float *frame = data.image[outID].array.F;
+        int publish = 1;
 
-            for (ii = 0; ii < width; ii++) {
-                for (jj = 0; jj < height; jj++) {
-                    data.image[outID].array.F[jj * width + ii] = (data.image[inID].array.UI16[RAW_PX_INDEX(ii, jj)] - bias_mean) * data.image[flatID].array.F[jj * width + ii];
-                    data.image[dynamicBiasID].array.F[jj * width + ii] = bias_mean;
-                }
+        if (*ctx.coadd > 1) {
+            frame = coadd_frame;
+        } else {
+            data.image[outID].md->write = 1;
+        }
+
+        data.image[dynamicBiasID].md->write = 1;
+
+        // Dynamic bias is estimated on each sub-frame
+        nuvu_calibrate(data.image[inID].array.UI16, data.image[biasID].array.F, data.image[flatID].array.F, bias_mode, frame, data.image[dynamicBiasID].array.F);
+
+        // Photon events of this frame only, NULL without photon counting
+        uint8_t *events = NULL;
+
+        if (ctx.fps->parray[fpi_photon_counting].fpflag & FPFLAG_ONOFF) {
+            // Frame still in cache, start a new window after a change
+            if (*ctx.photon_counting_window != pc_window) {
+                pc_window = *ctx.photon_counting_window;
+                pc_slot = 0;
+
+                memset(pc_events, 0, NUVU_PC_MAXWINDOW * WIDTH * HEIGHT * sizeof(uint8_t));
+                memset(pc_counts, 0, WIDTH * HEIGHT * sizeof(int32_t));
             }
+
+            events = &pc_events[pc_slot * WIDTH * HEIGHT];
+
+            nuvu_photon_count(frame, data.image[thresholdID].array.F, events, pc_counts);
+
+            pc_slot = (pc_slot + 1) % pc_window;
         } else {
-            // Subtract bilinear fit
-            float x1 = (DYNAMIC_BIAS_SIZE - 1) / 2;
-            float y1 = (DYNAMIC_BIAS_SIZE - 1) / 2;
-            float x2 = (width - 1) - (DYNAMIC_BIAS_SIZE - 1) / 2;
-            float y2 = (height - 1) - (DYNAMIC_BIAS_SIZE - 1) / 2;
-
-            float C = 1 / ((x2 - x1) * (y2 - y1));
-
-            float a00 = C * (x2 * y2 * bias[0] - x2 * y1 * bias[1] - x1 * y2 * bias[2] + x1 * y1 * bias[3]);
-            float a10 = C * (-y2 * bias[0] + y1 * bias[1] + y2 * bias[2] - y1 * bias[3]);
-            float a01 = C * (-x2 * bias[0] + x2 * bias[1] + x1 * bias[2] - x1 * bias[3]);
-            float a11 = C * (bias[0] - bias[1] - bias[2] + bias[3]);
-
-            float bias_bilinear;
-            for (ii = 0; ii < width; ii++) {
-                for (jj = 0; jj < height; jj++) {
-                    bias_bilinear = a00 + a10 * jj + a01 * ii + a11 * jj * ii;
-                    data.image[outID].array.F[jj * width + ii] = (data.image[inID].array.UI16[RAW_PX_INDEX(ii, jj)] - bias_bilinear) * data.image[flatID].array.F[jj * width + ii];
-                    data.image[dynamicBiasID].array.F[jj * width + ii] = bias_bilinear;
+            pc_window = 0;
+        }
+
+        if (*ctx.coadd > 1) {
+            // The sum replaces the window: each photon event is counted once
+            if (events != NULL) {
+                nuvu_coadd_events(coadd_sum, events);
+            } else {
+                nuvu_coadd(coadd_sum, frame);
+            }
+            coadd_count++;
+
+            // Publish every coadd frames, or earlier when coadd is lowered
+            if (coadd_count >= *ctx.coadd) {
+                data.image[outID].md->write = 1;
+
+                for (int i = 0; i < WIDTH * HEIGHT; i++) {
+                    data.image[outID].array.F[i] = coadd_sum[i];
+                    coadd_sum[i] = 0;
                 }
+
+                coadd_count = 0;
+            } else {
+                publish = 0;
             }
+        } else if (coadd_count != 0) {
+            // Co-adding stopped, drop the partial sum
+            memset(coadd_sum, 0, WIDTH * HEIGHT * sizeof(float));
+            coadd_count = 0;
         }
 
-    } else {
-        for (ii = 0; ii < width; ii++) {
-            for (jj = 0; jj < height; jj++) {
-                data.image[outID].array.F[jj * width + ii] = (data.image[inID].array.UI16[RAW_PX_INDEX(ii, jj)] - data.image[biasID].array.F[jj * width + ii]) * data.image[flatID].array.F[jj * width + ii];
-                data.image[dynamicBiasID].array.F[jj * width + ii] = 0;
+        if (publish) {
+            if (trace_kw != -1) {
+                kalao_trace_from_raw(&data.image[inID], &trace);
+                trace.fields[KALAO_TRACE_T_CAL] = kalao_trace_now();
+                kalao_trace_write(&data.image[outID], trace_kw, &trace);
             }
+
+            processinfo_update_output_stream(processinfo, outID);
         }
+
+        processinfo_update_output_stream(processinfo, dynamicBiasID);
     }
 
-    processinfo_update_output_stream(processinfo, outID);
-    processinfo_update_output_stream(processinfo, dynamicBiasID);
+    /***** Frame statistics *****/
+
+    nuvu_frame_stats(data.image[inID].array.UI16, histogram, &frame_stats);
+
+    *ctx.frame_max = frame_stats.max;
+    *ctx.frame_p999 = frame_stats.p999;
+    *ctx.frame_p99 = frame_stats.p99;
+    *ctx.frame_saturated = frame_stats.saturated;
+
+    ctx.fps->parray[fpi_frame_max].cnt0++;
+    ctx.fps->parray[fpi_frame_p999].cnt0++;
+    ctx.fps->parray[fpi_frame_p99].cnt0++;
+    ctx.fps->parray[fpi_frame_saturated].cnt0++;
+
+    if (*ctx.autogain_statistic == AUTOGAIN_STATISTIC_MAX) {
+        frame_flux = frame_stats.max;
+    } else if (*ctx.autogain_statistic == AUTOGAIN_STATISTIC_P999) {
+        frame_flux = frame_stats.p999;
+    } else {
+        frame_flux = frame_stats.p99;
+    }
+
+    frame_cnt0 = frame_count.index;
+
+    KALAO_SECTION_LAP(timers, SECTION_CALIBRATION);
 
     /***** Autogain *****/
 
-    if (data.fpsptr->parray[fpi_autogain].fpflag & FPFLAG_ONOFF) {
-        autogain_wait_frame = *autogain_wait;
-        if (*exposuretime < READOUT_TIME) {
+    if (ctx.fps->parray[fpi_autogain].fpflag & FPFLAG_ONOFF) {
+        autogain_wait_frame = *ctx.autogain_wait;
+        if (*ctx.exposuretime < READOUT_TIME) {
             autogain_wait_frame /= READOUT_TIME;
         } else {
-            autogain_wait_frame /= *exposuretime;
+            autogain_wait_frame /= *ctx.exposuretime;
         }
 
-        avg_samples = autogain_wait_frame;
-        flux_avg = (flux_avg * (avg_samples - 1) + *flux) / avg_samples;
+        // cnt0 of the flux only tells that there is a new value
+        if (*flux_cnt0_ptr != flux_cnt0) {
+            flux_cnt0 = *flux_cnt0_ptr;
+
+            float flux_frame = *flux;
+            avg_samples = autogain_wait_frame;
+
+            // External flux is measured on nuvu_stream: sums of coadd frames, published every coadd frames
+            if (shwfs_fps_connected && (ctx.fps->parray[fpi_calibration].fpflag & FPFLAG_ONOFF) && *ctx.coadd > 1) {
+                flux_frame /= *ctx.coadd;
+                avg_samples /= *ctx.coadd;
+            }
 
-        if (data.fpsptr->parray[fpi_autogain].cnt0 != autogain_cnt0) {
+            if (avg_samples < 1) {
+                avg_samples = 1;
+            }
+
+            flux_avg = (flux_avg * (avg_samples - 1) + flux_frame) / avg_samples;
+        }
+
+        if (ctx.fps->parray[fpi_autogain].cnt0 != autogain_cnt0) {
             // Autogain was enabled
-            autogain_cnt0 = data.fpsptr->parray[fpi_autogain].cnt0;
-            update_exposure_parameters(autogain_params);
-            flux_cnt0 = *flux_cnt0_ptr;
-        } else if (*flux_cnt0_ptr < flux_cnt0) {
-            // Wrap-around or restart
-            flux_cnt0 = *flux_cnt0_ptr;
-        } else if (*flux_cnt0_ptr > flux_cnt0 + autogain_wait_frame) {
-            // Enough frames passed
-            if (*emgain == max_gain && fabs(*exposuretime - min_exposuretime) < EPSILON) {
+            autogain_cnt0 = ctx.fps->parray[fpi_autogain].cnt0;
+            update_exposure_parameters(&ctx, autogain_params);
+            change_index = frame_count.index;
+        } else if (frame_count.index > change_index + (int64_t)autogain_wait_frame) {
+            // Enough camera frames passed, dropped ones included
+            if (*ctx.emgain == max_gain && fabs(*ctx.exposuretime - min_exposuretime) < EPSILON) {
                 // We are in the intermediate gain regime
-                if (flux_avg > *autogain_lowgain_upper) {
-                    decrease_autogain(NBautogain_params);
-                    flux_cnt0 = *flux_cnt0_ptr;
-                } else if (flux_avg < *autogain_highgain_lower) {
-                    increase_autogain(NBautogain_params);
-                    flux_cnt0 = *flux_cnt0_ptr;
+                if (flux_avg > *lowgain_upper) {
+                    decrease_autogain(&ctx, NBautogain_params);
+                    change_index = frame_count.index;
+                } else if (flux_avg < *highgain_lower) {
+                    increase_autogain(&ctx, NBautogain_params);
+                    change_index = frame_count.index;
                 }
-            } else if (*emgain < max_gain) {
+            } else if (*ctx.emgain < max_gain) {
                 // We are in the low gain regime
-                if (flux_avg > *autogain_lowgain_upper) {
-                    decrease_autogain(NBautogain_params);
-                    flux_cnt0 = *flux_cnt0_ptr;
-                } else if (flux_avg < *autogain_lowgain_lower) {
-                    increase_autogain(NBautogain_params);
-                    flux_cnt0 = *flux_cnt0_ptr;
+                if (flux_avg > *lowgain_upper) {
+                    decrease_autogain(&ctx, NBautogain_params);
+                    change_index = frame_count.index;
+                } else if (flux_avg < *lowgain_lower) {
+                    increase_autogain(&ctx, NBautogain_params);
+                    change_index = frame_count.index;
                 }
             } else {
                 // We are in the high gain regime
-                if (flux_avg > *autogain_highgain_upper) {
-                    decrease_autogain(NBautogain_params);
-                    flux_cnt0 = *flux_cnt0_ptr;
-                } else if (flux_avg < *autogain_highgain_lower) {
-                    increase_autogain(NBautogain_params);
-                    flux_cnt0 = *flux_cnt0_ptr;
+                if (flux_avg > *highgain_upper) {
+                    decrease_autogain(&ctx, NBautogain_params);
+                    change_index = frame_count.index;
+                } else if (flux_avg < *highgain_lower) {
+                    increase_autogain(&ctx, NBautogain_params);
+                    change_index = frame_count.index;
                 }
             }
         }
     }
 
+    KALAO_SECTION_LAP(timers, SECTION_AUTOGAIN);
+
     INSERT_STD_PROCINFO_COMPUTEFUNC_END
 
-    function_parameter_struct_disconnect(&shwfs_fps);
+    if (shwfs_fps_connected) {
+        function_parameter_struct_disconnect(&shwfs_fps);
+    }
 
     free(autogain_params);
+    free(histogram);
+    free(pc_events);
+    free(pc_counts);
+    free(coadd_frame);
+    free(coadd_sum);
 
     DEBUG_TRACE_FEXIT();
 
@@ -0,0 +1,228 @@
+#ifndef _MILK_KALAO_NUVU_CALIBRATION_H
+#define _MILK_KALAO_NUVU_CALIBRATION_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Calibration of the raw Nuvu frames: bias subtraction (static map or
+ * dynamic estimate from the corners) and flat-field correction, and
+ * statistics of the raw pixels used by autogain.
+ *
+ * Kernels only work on arrays, so that they can be shared by acquire and the
+ * fused pipeline (KalAO_BMC/fused.c).
+ */
+
+#define WIDTH_IN 520
+#define HEIGHT_IN 70
+
+#define WIDTH 64
+#define HEIGHT 64
+
+// Size of the corner regions used to estimate the dynamic bias
+#define DYNAMIC_BIAS_SIZE 8
+
+// With parenthesis around the arguments and the expression to avoid operator precedence issues
+#define RAW_PX_INDEX(i, j) (((j) + 4) * WIDTH_IN + 8 * (WIDTH - (i)))
+
+#define NUVU_BIAS_STATIC 0
+#define NUVU_BIAS_DYNAMIC_MEAN 1
+#define NUVU_BIAS_DYNAMIC_BILINEAR 2
+
+// Raw value of a saturated pixel
+#define NUVU_SATURATION 65535
+
+// Histogram of the raw pixels, in bins of 2^NUVU_HIST_SHIFT ADU
+#define NUVU_HIST_SHIFT 6
+#define NUVU_HIST_NBINS (65536 >> NUVU_HIST_SHIFT)
+
+// Sub-histograms filled in turn, so that neighbouring pixels in the same bin
+// do not wait on each other's increment
+#define NUVU_HIST_NBSUB 4
+
+// Longest window of photon-counting frames summed
+#define NUVU_PC_MAXWINDOW 64
+
+typedef struct
+{
+    uint16_t bins[NUVU_HIST_NBSUB][NUVU_HIST_NBINS];
+
+} NUVU_HISTOGRAM;
+
+// Pixel statistics of a frame, above the mean bias of the corners [ADU]
+typedef struct
+{
+    float bias;
+    float max;
+    float p999;
+    float p99;
+    int64_t saturated;
+
+} NUVU_FRAME_STATS;
+
+// Mean of the four corners: bottom-left, bottom-right, top-left, top-right
+static inline void nuvu_corner_bias(const uint16_t *raw, float bias[4]) {
+    int ii_0[] = {0, WIDTH - DYNAMIC_BIAS_SIZE};
+    int jj_0[] = {0, HEIGHT - DYNAMIC_BIAS_SIZE};
+
+    for (int k = 0; k < 2; k++) {
+        for (int l = 0; l < 2; l++) {
+            bias[l * 2 + k] = 0;
+
+            for (int ii = 0; ii < DYNAMIC_BIAS_SIZE; ii++)
+                for (int jj = 0; jj < DYNAMIC_BIAS_SIZE; jj++)
+                    bias[l * 2 + k] += raw[RAW_PX_INDEX(ii_0[k] + ii, jj_0[l] + jj)];
+
+            bias[l * 2 + k] /= DYNAMIC_BIAS_SIZE * DYNAMIC_BIAS_SIZE;
+        }
+    }
+}
+
+/*
+ * Calibrate a raw frame in out (WIDTH x HEIGHT). bias is only used in
+ * NUVU_BIAS_STATIC mode. The bias actually subtracted is written in
+ * bias_out (0 in static mode).
+ */
+static inline void nuvu_calibrate(
+    const uint16_t *restrict raw,
+    const float *restrict bias,
+    const float *restrict flat,
+    int mode,
+    float *restrict out,
+    float *restrict bias_out) {
+    int ii, jj;
+
+    if (mode == NUVU_BIAS_DYNAMIC_MEAN) {
+        // Subtract mean
+        float corners[4];
+        nuvu_corner_bias(raw, corners);
+
+        float bias_mean = (corners[0] + corners[1] + corners[2] + corners[3]) / 4;
+
+        for (jj = 0; jj < HEIGHT; jj++) {
+            for (ii = 0; ii < WIDTH; ii++) {
+                out[jj * WIDTH + ii] = (raw[RAW_PX_INDEX(ii, jj)] - bias_mean) * flat[jj * WIDTH + ii];
+                bias_out[jj * WIDTH + ii] = bias_mean;
+            }
+        }
+    } else if (mode == NUVU_BIAS_DYNAMIC_BILINEAR) {
+        // Subtract bilinear fit
+        float corners[4];
+        nuvu_corner_bias(raw, corners);
+
+        float x1 = (DYNAMIC_BIAS_SIZE - 1) / 2;
+        float y1 = (DYNAMIC_BIAS_SIZE - 1) / 2;
+        float x2 = (WIDTH - 1) - (DYNAMIC_BIAS_SIZE - 1) / 2;
+        float y2 = (HEIGHT - 1) - (DYNAMIC_BIAS_SIZE - 1) / 2;
+
+        float C = 1 / ((x2 - x1) * (y2 - y1));
+
+        float a00 = C * (x2 * y2 * corners[0] - x2 * y1 * corners[1] - x1 * y2 * corners[2] + x1 * y1 * corners[3]);
+        float a10 = C * (-y2 * corners[0] + y1 * corners[1] + y2 * corners[2] - y1 * corners[3]);
+        float a01 = C * (-x2 * corners[0] + x2 * corners[1] + x1 * corners[2] - x1 * corners[3]);
+        float a11 = C * (corners[0] - corners[1] - corners[2] + corners[3]);
+
+        for (jj = 0; jj < HEIGHT; jj++) {
+            for (ii = 0; ii < WIDTH; ii++) {
+                float bias_bilinear = a00 + a10 * jj + a01 * ii + a11 * jj * ii;
+
+                out[jj * WIDTH + ii] = (raw[RAW_PX_INDEX(ii, jj)] - bias_bilinear) * flat[jj * WIDTH + ii];
+                bias_out[jj * WIDTH + ii] = bias_bilinear;
+            }
+        }
+    } else {
+        for (jj = 0; jj < HEIGHT; jj++) {
+            for (ii = 0; ii < WIDTH; ii++) {
+                out[jj * WIDTH + ii] = (raw[RAW_PX_INDEX(ii, jj)] - bias[jj * WIDTH + ii]) * flat[jj * WIDTH + ii];
+                bias_out[jj * WIDTH + ii] = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Photon counting on a calibrated frame (WIDTH x HEIGHT), in place: a pixel
+ * above its threshold is one photon event. events holds the events of the
+ * frame leaving the window and is overwritten by the new ones, counts holds
+ * the sum of the events in the window and is copied into frame. Comparisons
+ * give 0/1 directly, there is no branch in the loop.
+ */
+static inline void nuvu_photon_count(
+    float *restrict frame,
+    const float *restrict threshold,
+    uint8_t *restrict events,
+    int32_t *restrict counts) {
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        int32_t event = frame[i] > threshold[i];
+
+        counts[i] += event - events[i];
+        events[i] = event;
+        frame[i] = counts[i];
+    }
+}
+
+// Add a calibrated frame (WIDTH x HEIGHT) to a sum of frames
+static inline void nuvu_coadd(float *restrict sum, const float *restrict frame) {
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        sum[i] += frame[i];
+}
+
+// Add the photon events of a frame (WIDTH x HEIGHT) to a sum of frames
+static inline void nuvu_coadd_events(float *restrict sum, const uint8_t *restrict events) {
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        sum[i] += events[i];
+}
+
+/*
+ * Lower edge of the bin holding the given fraction (percentile) of the
+ * pixels, clipped to max. The scan starts at the bin of max, the high percentiles
+ * are found after a few bins.
+ */
+static inline float nuvu_histogram_percentile(const NUVU_HISTOGRAM *hist, float fraction, uint16_t max) {
+    int above = (1 - fraction) * WIDTH * HEIGHT;
+    int count = 0;
+
+    for (int b = max >> NUVU_HIST_SHIFT; b >= 0; b--) {
+        for (int s = 0; s < NUVU_HIST_NBSUB; s++)
+            count += hist->bins[s][b];
+
+        if (count > above) {
+            int value = b << NUVU_HIST_SHIFT;
+
+            return value < max ? value : max;
+        }
+    }
+
+    return 0;
+}
+
+// Histogram, maximum and saturated pixels of a raw frame (WIDTH x HEIGHT)
+static inline void nuvu_frame_stats(const uint16_t *restrict raw, NUVU_HISTOGRAM *restrict hist, NUVU_FRAME_STATS *stats) {
+    uint16_t max = 0;
+    int64_t saturated = 0;
+
+    memset(hist, 0, sizeof(NUVU_HISTOGRAM));
+
+    for (int jj = 0; jj < HEIGHT; jj++) {
+        for (int ii = 0; ii < WIDTH; ii += NUVU_HIST_NBSUB) {
+            for (int s = 0; s < NUVU_HIST_NBSUB; s++) {
+                uint16_t value = raw[RAW_PX_INDEX(ii + s, jj)];
+
+                hist->bins[s][value >> NUVU_HIST_SHIFT]++;
+                max = value > max ? value : max;
+                saturated += value >= NUVU_SATURATION;
+            }
+        }
+    }
+
+    float corners[4];
+    nuvu_corner_bias(raw, corners);
+
+    stats->bias = (corners[0] + corners[1] + corners[2] + corners[3]) / 4;
+    stats->max = max - stats->bias;
+    stats->p999 = nuvu_histogram_percentile(hist, 0.999, max) - stats->bias;
+    stats->p99 = nuvu_histogram_percentile(hist, 0.99, max) - stats->bias;
+    stats->saturated = saturated;
+}
+
+#endif
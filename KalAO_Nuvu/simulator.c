@@ -0,0 +1,726 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "COREMOD_iofits/file_exists.h"
+#include "COREMOD_iofits/is_fits_file.h"
+#include "COREMOD_iofits/loadfits.h"
+
+#include "KalAO_BMC/actuators.h"
+#include "KalAO_SHWFS/centroid.h"
+
+#include "calibration.h"
+
+#include <math.h>
+#include <time.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+/*
+ * Closed-loop simulator: replaces the camera by raw frames (WIDTH_IN x
+ * HEIGHT_IN, UI16, Nuvu layout) computed from the commands sent to the DM,
+ * so that acquire -> process -> display (with .simulated ON) run closed-loop
+ * without the bench.
+ *
+ * Spot displacements are given by a linear interaction model applied to the
+ * commands echoed in bmc_commands_dm and bmc_commands_ttm (relative to the
+ * middle of the driver range), plus optional turbulence (sequence of DM maps
+ * played one per frame) and vibration lines on the tip-tilt. Frames are
+ * published .delay frames after the commands they were computed from, to
+ * emulate the readout.
+ *
+ * The simulator runs free: set .procinfo.triggermode to 4 (delay) and
+ * .procinfo.triggerdelay to the frame period.
+ */
+
+static char *spotcoords_fname;
+static long fpi_spotcoords_fname;
+
+static char *DM_streamname;
+static long fpi_DM_streamname;
+
+static char *TTM_streamname;
+static long fpi_TTM_streamname;
+
+static char *out_streamname;
+static long fpi_out_streamname;
+
+static char *IM_fname;
+static long fpi_IM_fname;
+
+static int64_t *delay;
+static long fpi_delay;
+
+static float *flux;
+static long fpi_flux;
+
+static float *fwhm;
+static long fpi_fwhm;
+
+static float *bias;
+static long fpi_bias;
+
+static float *noise;
+static long fpi_noise;
+
+static uint64_t *turbulence;
+static long fpi_turbulence;
+
+static char *turbulence_fname;
+static long fpi_turbulence_fname;
+
+static float *turbulence_gain;
+static long fpi_turbulence_gain;
+
+static char *vibrations;
+static long fpi_vibrations;
+
+static int64_t *frames;
+static long fpi_frames;
+
+static CLICMDARGDEF farg[] =
+    {
+        {
+            CLIARG_FILENAME,
+            ".spotcoords",
+            "SH spot coordinates",
+            "spots.txt",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&spotcoords_fname,
+            &fpi_spotcoords_fname,
+        },
+        {
+            CLIARG_STR,
+            ".DM",
+            "Commands sent to DM",
+            "bmc_commands_dm",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&DM_streamname,
+            &fpi_DM_streamname,
+        },
+        {
+            CLIARG_STR,
+            ".TTM",
+            "Commands sent to Tip-Tilt",
+            "bmc_commands_ttm",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&TTM_streamname,
+            &fpi_TTM_streamname,
+        },
+        {
+            CLIARG_STR,
+            ".out",
+            "Simulated raw camera stream",
+            "nuvu_raw",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&out_streamname,
+            &fpi_out_streamname,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".IM",
+            "Interaction matrix (142 x NBslopes, spot displacement [px] per command)",
+            "simulator_im.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&IM_fname,
+            &fpi_IM_fname,
+        },
+        {
+            CLIARG_INT64,
+            ".delay",
+            "Delay between commands and frames [frames]",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&delay,
+            &fpi_delay,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".flux",
+            "Flux per spot [ADU]",
+            "20000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&flux,
+            &fpi_flux,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".fwhm",
+            "Spot FWHM [px]",
+            "1.5",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&fwhm,
+            &fpi_fwhm,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".bias",
+            "Bias level [ADU]",
+            "1000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&bias,
+            &fpi_bias,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".noise",
+            "Read noise [ADU rms]",
+            "10",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&noise,
+            &fpi_noise,
+        },
+        {
+            CLIARG_ONOFF,
+            ".turbulence_on",
+            "Turbulence ON/OFF",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&turbulence,
+            &fpi_turbulence,
+        },
+        {
+            CLIARG_FITSFILENAME,
+            ".turbulence",
+            "Turbulence screens as DM commands (12 x 12 x NBframes)",
+            "simulator_turbulence.fits",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&turbulence_fname,
+            &fpi_turbulence_fname,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".turbulence_gain",
+            "Turbulence scaling factor",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&turbulence_gain,
+            &fpi_turbulence_gain,
+        },
+        {
+            CLIARG_STR,
+            ".vibrations",
+            "Tip-Tilt vibration lines (comma separated freq[Hz]:tip:tilt)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&vibrations,
+            &fpi_vibrations,
+        },
+        {
+            CLIARG_INT64,
+            ".frames",
+            "Number of simulated frames",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frames,
+            &fpi_frames,
+        },
+};
+
+static CLICMDDATA CLIcmddata =
+    {
+        "simulator",
+        "Simulate camera frames from DM commands (closed-loop without bench)",
+        CLICMD_FIELDS_DEFAULTS,
+};
+
+// Commands of the model: 140 actuators + 2 tip-tilt
+#define NB_COMMANDS (NB_ACTUATORS + NB_TTM_CHANNELS)
+
+#define SIM_MAXDELAY 16
+#define SIM_MAXNB_VIBRATIONS 8
+
+// Size of the subapertures, see KalAO_SHWFS/centroid.h
+#define SUBAP_SIZE 4
+
+typedef struct
+{
+    int NBslopes;
+
+    // slope-major, each row is NB_COMMANDS floats
+    float *matrix;
+
+} SIM_INTERACTION_MATRIX;
+
+typedef struct
+{
+    int NBscreens;
+
+    // screen-major, each screen is NB_COMMANDS floats (tip-tilt zero)
+    float *screens;
+
+} SIM_TURBULENCE;
+
+typedef struct
+{
+    int NBlines;
+    float freq[SIM_MAXNB_VIBRATIONS];
+    float amp[SIM_MAXNB_VIBRATIONS][NB_TTM_CHANNELS];
+
+} SIM_VIBRATIONS;
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static errno_t help_function() {
+    return RETURN_SUCCESS;
+}
+
+static errno_t customCONFsetup() {
+    if (data.fpsptr != NULL) {
+        data.fpsptr->parray[fpi_IM_fname].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_delay].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_delay].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_delay].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_delay].val.i64[1] = 0;            // min
+        data.fpsptr->parray[fpi_delay].val.i64[2] = SIM_MAXDELAY; // max
+
+        data.fpsptr->parray[fpi_flux].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_flux].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_flux].val.f32[1] = 0; // min
+
+        data.fpsptr->parray[fpi_fwhm].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_fwhm].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_fwhm].val.f32[1] = 0.1; // min
+
+        data.fpsptr->parray[fpi_bias].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_noise].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_noise].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_noise].val.f32[1] = 0; // min
+
+        data.fpsptr->parray[fpi_turbulence].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_turbulence_fname].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_turbulence_gain].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_vibrations].fpflag |= FPFLAG_WRITERUN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static int load_interaction_matrix(SIM_INTERACTION_MATRIX *IM) {
+    imageID IMtmpID = -1;
+
+    if (!file_exists(IM_fname)) {
+        printf("Interaction matrix file %s not found\n", IM_fname);
+    } else if (!is_fits_file(IM_fname)) {
+        printf("Interaction matrix file %s is not a valid FITS file\n", IM_fname);
+    } else {
+        load_fits(IM_fname, "simulator_im_tmp", 1, &IMtmpID);
+
+        if (data.image[IMtmpID].md->datatype != _DATATYPE_FLOAT) {
+            printf("Wrong data type for interaction matrix file %s\n", IM_fname);
+            IMtmpID = -1;
+        } else if (data.image[IMtmpID].md->nelement != (uint64_t)IM->NBslopes * NB_COMMANDS) {
+            printf("Wrong size for interaction matrix file %s\n", IM_fname);
+            IMtmpID = -1;
+        }
+    }
+
+    // Without a valid matrix, commands do not move the spots
+    for (int k = 0; k < IM->NBslopes * NB_COMMANDS; k++)
+        IM->matrix[k] = 0;
+
+    if (IMtmpID == -1) {
+        return RETURN_FAILURE;
+    }
+
+    for (int k = 0; k < IM->NBslopes * NB_COMMANDS; k++)
+        IM->matrix[k] = data.image[IMtmpID].array.F[k];
+
+    printf("Loaded interaction matrix %d x %d\n", NB_COMMANDS, IM->NBslopes);
+
+    return RETURN_SUCCESS;
+}
+
+static int load_turbulence(SIM_TURBULENCE *turb) {
+    imageID turbtmpID = -1;
+
+    if (!file_exists(turbulence_fname)) {
+        printf("Turbulence file %s not found\n", turbulence_fname);
+    } else if (!is_fits_file(turbulence_fname)) {
+        printf("Turbulence file %s is not a valid FITS file\n", turbulence_fname);
+    } else {
+        load_fits(turbulence_fname, "simulator_turbulence_tmp", 1, &turbtmpID);
+
+        if (data.image[turbtmpID].md->datatype != _DATATYPE_FLOAT) {
+            printf("Wrong data type for turbulence file %s\n", turbulence_fname);
+            turbtmpID = -1;
+        } else if (data.image[turbtmpID].md->size[0] != DM_SIZE || data.image[turbtmpID].md->size[1] != DM_SIZE) {
+            printf("Wrong size for turbulence file %s\n", turbulence_fname);
+            turbtmpID = -1;
+        }
+    }
+
+    free(turb->screens);
+
+    turb->NBscreens = 0;
+    turb->screens = NULL;
+
+    if (turbtmpID == -1) {
+        return RETURN_FAILURE;
+    }
+
+    int NBscreens = data.image[turbtmpID].md->nelement / (DM_SIZE * DM_SIZE);
+
+    turb->screens = (float *)malloc(sizeof(float) * NB_COMMANDS * NBscreens);
+
+    for (int n = 0; n < NBscreens; n++) {
+        float *map = &data.image[turbtmpID].array.F[n * DM_SIZE * DM_SIZE];
+        float *screen = &turb->screens[n * NB_COMMANDS];
+
+        for (int ii = 0; ii < NB_ACTUATORS; ii++)
+            screen[ii] = map[actuator_pixel(ii)];
+
+        for (int ii = NB_ACTUATORS; ii < NB_COMMANDS; ii++)
+            screen[ii] = 0;
+    }
+
+    turb->NBscreens = NBscreens;
+
+    printf("Loaded %d turbulence screens\n", NBscreens);
+
+    return RETURN_SUCCESS;
+}
+
+static void parse_vibrations(SIM_VIBRATIONS *vib) {
+    char vibrations_tmp[512];
+    char *saveptr;
+
+    vib->NBlines = 0;
+
+    strncpy(vibrations_tmp, vibrations, sizeof(vibrations_tmp) - 1);
+    vibrations_tmp[sizeof(vibrations_tmp) - 1] = '\0';
+
+    for (char *line = strtok_r(vibrations_tmp, ", ", &saveptr); line != NULL; line = strtok_r(NULL, ", ", &saveptr)) {
+        float freq, tip, tilt;
+
+        if (sscanf(line, "%f:%f:%f", &freq, &tip, &tilt) != 3) {
+            printf("Wrong vibration line %s, ignoring\n", line);
+            continue;
+        }
+
+        if (vib->NBlines == SIM_MAXNB_VIBRATIONS) {
+            printf("Too many vibration lines, ignoring %s\n", line);
+            continue;
+        }
+
+        vib->freq[vib->NBlines] = freq;
+        vib->amp[vib->NBlines][0] = tip;
+        vib->amp[vib->NBlines][1] = tilt;
+        vib->NBlines++;
+    }
+
+    printf("Using %d vibration lines\n", vib->NBlines);
+}
+
+// xorshift64*, only used for the read noise
+static inline uint64_t sim_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Approximately normal, sum of four uniforms (Irwin-Hall) scaled to unit variance
+static inline float sim_gaussian(uint64_t *state) {
+    uint64_t r = sim_random(state);
+
+    float sum = (float)(r & 0xFFFF) + (float)((r >> 16) & 0xFFFF) + (float)((r >> 32) & 0xFFFF) + (float)(r >> 48);
+
+    return (sum / 65536 - 2) * 1.7320508f;
+}
+
+/*
+ * Flux of a gaussian spot centered on c (pixel coordinates, pixel k spans
+ * [k - 0.5, k + 0.5]) integrated over the SUBAP_SIZE pixels of one axis.
+ */
+static void spot_profile(float c, float sigma, float *profile) {
+    float norm = 1 / (sqrtf(2) * sigma);
+    float edge = erff((-0.5f - c) * norm);
+
+    for (int k = 0; k < SUBAP_SIZE; k++) {
+        float next = erff((k + 0.5f - c) * norm);
+
+        profile[k] = (next - edge) / 2;
+        edge = next;
+    }
+}
+
+static void render_frame(
+    const SHWFS_SPOTS *spotcoord,
+    int NBspot,
+    const float *displacement,
+    float *image) {
+    float sigma = *fwhm / 2.3548f;
+    float px[SUBAP_SIZE];
+    float py[SUBAP_SIZE];
+
+    for (int k = 0; k < WIDTH * HEIGHT; k++)
+        image[k] = 0;
+
+    for (int spot = 0; spot < NBspot; spot++) {
+        // Centered spot lies between the two middle pixels of the subaperture
+        float cx = (SUBAP_SIZE - 1) / 2.0f + displacement[spotcoord[spot].XYout_dx];
+        float cy = (SUBAP_SIZE - 1) / 2.0f + displacement[spotcoord[spot].XYout_dy];
+
+        spot_profile(cx, sigma, px);
+        spot_profile(cy, sigma, py);
+
+        for (int jj = 0; jj < SUBAP_SIZE; jj++) {
+            float *row = &image[(spotcoord[spot].Yraw + jj) * WIDTH + spotcoord[spot].Xraw];
+
+            for (int ii = 0; ii < SUBAP_SIZE; ii++)
+                row[ii] += *flux * py[jj] * px[ii];
+        }
+    }
+}
+
+static void write_raw(const float *image, uint64_t *state, uint16_t *raw) {
+    float level;
+
+    // Bias and noise everywhere, including the regions not read by acquire
+    for (int k = 0; k < WIDTH_IN * HEIGHT_IN; k++) {
+        level = *bias + *noise * sim_gaussian(state);
+        raw[k] = level < 0 ? 0 : level > 65535 ? 65535 : (uint16_t)(level + 0.5f);
+    }
+
+    for (int jj = 0; jj < HEIGHT; jj++) {
+        for (int ii = 0; ii < WIDTH; ii++) {
+            level = raw[RAW_PX_INDEX(ii, jj)] + image[jj * WIDTH + ii];
+            raw[RAW_PX_INDEX(ii, jj)] = level > 65535 ? 65535 : (uint16_t)(level + 0.5f);
+        }
+    }
+}
+
+static errno_t compute_function() {
+    DEBUG_TRACE_FSTART();
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+
+    int k;
+
+    /********** Load spots coordinates **********/
+
+    SHWFS_SPOTS *spotcoord = (SHWFS_SPOTS *)malloc(sizeof(SHWFS_SPOTS) * MAXNB_SPOT);
+
+    char msgstring[200];
+    sprintf(msgstring, "Loading spot <- %s", spotcoords_fname);
+    processinfo_WriteMessage(processinfo, msgstring);
+
+    int NBspot = shwfs_read_spots(spotcoords_fname, spotcoord);
+
+    uint32_t sizeoutX;
+    uint32_t sizeoutY;
+
+    shwfs_spots_layout(spotcoord, NBspot, &sizeoutX, &sizeoutY);
+
+    int NBslopes = 2 * sizeoutX * sizeoutY;
+
+    /********** Allocate streams **********/
+
+    processinfo_WriteMessage(processinfo, "Allocating streams");
+
+    imageID outID = image_ID(out_streamname);
+    {
+        uint32_t *imsize = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+
+        imsize[0] = WIDTH_IN;
+        imsize[1] = HEIGHT_IN;
+        create_image_ID(out_streamname, 2, imsize, _DATATYPE_UINT16, 1, 10, 0, &outID);
+
+        free(imsize);
+    }
+
+    /********** Load models **********/
+
+    processinfo_WriteMessage(processinfo, "Loading interaction matrix");
+
+    SIM_INTERACTION_MATRIX IM;
+
+    IM.NBslopes = NBslopes;
+    IM.matrix = (float *)malloc(sizeof(float) * NBslopes * NB_COMMANDS);
+
+    load_interaction_matrix(&IM);
+    long IM_cnt0 = data.fpsptr->parray[fpi_IM_fname].cnt0;
+
+    // Screens are loaded when turbulence is first enabled
+    SIM_TURBULENCE turb = {0, NULL};
+    int turbulence_loaded = 0;
+    long turbulence_cnt0 = data.fpsptr->parray[fpi_turbulence_fname].cnt0;
+
+    SIM_VIBRATIONS vib;
+
+    parse_vibrations(&vib);
+    long vibrations_cnt0 = data.fpsptr->parray[fpi_vibrations].cnt0;
+
+    /********** Buffers **********/
+
+    float commands[NB_COMMANDS];
+
+    // Displacements of the last SIM_MAXDELAY + 1 frames, in the slopes layout
+    float *displacements = (float *)malloc(sizeof(float) * (SIM_MAXDELAY + 1) * NBslopes);
+
+    for (k = 0; k < (SIM_MAXDELAY + 1) * NBslopes; k++)
+        displacements[k] = 0;
+
+    float *image = (float *)malloc(sizeof(float) * WIDTH * HEIGHT);
+
+    uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+    struct timespec t_start, t_now;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    /********** Loop **********/
+
+    imageID DMID = -1;
+    imageID TTMID = -1;
+    int64_t frame = 0;
+    int ii, s;
+
+    processinfo_WriteMessage(processinfo, "Looping");
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    if (data.fpsptr->parray[fpi_IM_fname].cnt0 != IM_cnt0) {
+        IM_cnt0 = data.fpsptr->parray[fpi_IM_fname].cnt0;
+
+        load_interaction_matrix(&IM);
+    }
+
+    int turbulence_on = data.fpsptr->parray[fpi_turbulence].fpflag & FPFLAG_ONOFF;
+
+    if (turbulence_on && (!turbulence_loaded || data.fpsptr->parray[fpi_turbulence_fname].cnt0 != turbulence_cnt0)) {
+        turbulence_cnt0 = data.fpsptr->parray[fpi_turbulence_fname].cnt0;
+
+        processinfo_WriteMessage(processinfo, "Loading turbulence");
+
+        load_turbulence(&turb);
+        turbulence_loaded = 1;
+
+        processinfo_WriteMessage(processinfo, "Looping");
+    }
+
+    if (data.fpsptr->parray[fpi_vibrations].cnt0 != vibrations_cnt0) {
+        vibrations_cnt0 = data.fpsptr->parray[fpi_vibrations].cnt0;
+
+        parse_vibrations(&vib);
+    }
+
+    // The DM may be started after the simulator
+    if (DMID == -1)
+        DMID = image_ID(DM_streamname);
+
+    if (TTMID == -1)
+        TTMID = image_ID(TTM_streamname);
+
+    /***** Commands seen by the WFS *****/
+
+    for (ii = 0; ii < NB_COMMANDS; ii++)
+        commands[ii] = 0;
+
+    // Commands are in the driver range [0, 1], relative to its middle
+    if (DMID != -1 && data.image[DMID].md->nelement == DM_SIZE * DM_SIZE) {
+        for (ii = 0; ii < NB_ACTUATORS; ii++)
+            commands[ii] = data.image[DMID].array.F[actuator_pixel(ii)] - 0.5f;
+    }
+
+    if (TTMID != -1 && data.image[TTMID].md->nelement == NB_TTM_CHANNELS) {
+        for (ii = 0; ii < NB_TTM_CHANNELS; ii++)
+            commands[NB_ACTUATORS + ii] = data.image[TTMID].array.F[ii] - 0.5f;
+    }
+
+    if (turbulence_on && turb.NBscreens > 0) {
+        const float *screen = &turb.screens[(frame % turb.NBscreens) * NB_COMMANDS];
+
+        for (ii = 0; ii < NB_COMMANDS; ii++)
+            commands[ii] += *turbulence_gain * screen[ii];
+    }
+
+    if (vib.NBlines > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &t_now);
+
+        double t = (t_now.tv_sec - t_start.tv_sec) + (t_now.tv_nsec - t_start.tv_nsec) / 1e9;
+
+        for (int line = 0; line < vib.NBlines; line++) {
+            float phase = sinf(2 * M_PI * fmod(vib.freq[line] * t, 1));
+
+            commands[NB_ACTUATORS + 0] += vib.amp[line][0] * phase;
+            commands[NB_ACTUATORS + 1] += vib.amp[line][1] * phase;
+        }
+    }
+
+    /***** Spot displacements *****/
+
+    float *current = &displacements[(frame % (SIM_MAXDELAY + 1)) * NBslopes];
+
+    for (s = 0; s < NBslopes; s++) {
+        const float *row = &IM.matrix[s * NB_COMMANDS];
+        float sum = 0;
+
+        for (ii = 0; ii < NB_COMMANDS; ii++)
+            sum += row[ii] * commands[ii];
+
+        current[s] = sum;
+    }
+
+    // Frame read out .delay frames after the commands it was exposed with
+    int64_t delayed = frame - *delay;
+    if (delayed < 0)
+        delayed = 0;
+
+    render_frame(spotcoord, NBspot, &displacements[(delayed % (SIM_MAXDELAY + 1)) * NBslopes], image);
+
+    /***** Write output stream *****/
+
+    data.image[outID].md->write = 1;
+
+    write_raw(image, &random_state, data.image[outID].array.UI16);
+
+    processinfo_update_output_stream(processinfo, outID);
+
+    frame++;
+
+    *frames = frame;
+    data.fpsptr->parray[fpi_frames].cnt0++;
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    free(spotcoord);
+    free(IM.matrix);
+    free(turb.screens);
+    free(displacements);
+    free(image);
+
+    DEBUG_TRACE_FEXIT();
+
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_KalAO_Nuvu__simulator() {
+    CLIcmddata.FPS_customCONFsetup = customCONFsetup;
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef _MILK_KALAO_NUVU_SIMULATOR_H
+#define _MILK_KALAO_NUVU_SIMULATOR_H
+
+errno_t CLIADDCMD_KalAO_Nuvu__simulator();
+
+#endif
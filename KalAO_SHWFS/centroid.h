@@ -0,0 +1,259 @@
+#ifndef _MILK_KALAO_SHWFS_CENTROID_H
+#define _MILK_KALAO_SHWFS_CENTROID_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shack-Hartmann centroiding on 4x4 pixel subapertures.
+ *
+ * Kernels only work on arrays, so that they can be shared by process and the
+ * fused pipeline (KalAO_BMC/fused.c).
+ */
+
+#define MAXNB_SPOT 1000
+
+#define SHWFS_ALGORITHM_QUADCELL 0
+#define SHWFS_ALGORITHM_COM 1
+
+typedef struct
+{
+    // lower index pixel coords in input raw image
+    uint32_t Xraw;
+    uint32_t Yraw;
+
+    // output 2D coordinates
+    uint32_t Xout;
+    uint32_t Yout;
+
+    // precomputed indices for speed
+    uint64_t XYout_dx;
+    uint64_t XYout_dy;
+    uint64_t fluxout;
+
+    // signal
+    float dx;
+    float dy;
+    float flux;
+
+} SHWFS_SPOTS;
+
+typedef struct
+{
+    float flux_max;
+    float flux_avg;
+    float residual_rms;
+    float slope_x_avg;
+    float slope_y_avg;
+    int valid_spots;
+
+} SHWFS_CENTROID_STATS;
+
+static inline int shwfs_read_spots(const char *fname, SHWFS_SPOTS *spotcoord) {
+    int NBspot = 0;
+
+    FILE *fp;
+
+    fp = fopen(fname, "r");
+    if (fp == NULL) {
+        perror("Unable to open file!");
+        exit(1);
+    }
+
+    int xin, yin, xout, yout;
+
+    char keyw[16];
+
+    int loopOK = 1;
+    while (loopOK == 1) {
+        int ret = fscanf(fp, "%15s %d %d %d %d", keyw, &xin, &yin, &xout, &yout);
+        if (ret == EOF) {
+            loopOK = 0;
+        } else {
+            if ((ret == 5) && (strcmp(keyw, "SPOT") == 0) && NBspot < MAXNB_SPOT) {
+                printf("Found SPOT %5d %5d   %5d %5d\n", xin, yin, xout, yout);
+                spotcoord[NBspot].Xraw = xin;
+                spotcoord[NBspot].Yraw = yin;
+                spotcoord[NBspot].Xout = xout;
+                spotcoord[NBspot].Yout = yout;
+                NBspot++;
+            }
+        }
+    }
+    printf("Loaded %d spots\n", NBspot);
+
+    fclose(fp);
+
+    return NBspot;
+}
+
+/*
+ * Size of the output 2D representation and indices of the spots in it:
+ * slopes are (2 * sizeoutX) x sizeoutY with dx on the left and dy on the
+ * right half, flux is sizeoutX x sizeoutY.
+ */
+static inline void shwfs_spots_layout(SHWFS_SPOTS *spotcoord, int NBspot, uint32_t *sizeoutX, uint32_t *sizeoutY) {
+    *sizeoutX = 0;
+    *sizeoutY = 0;
+
+    for (int spot = 0; spot < NBspot; spot++) {
+        if (spotcoord[spot].Xout + 1 > *sizeoutX) {
+            *sizeoutX = spotcoord[spot].Xout + 1;
+        }
+        if (spotcoord[spot].Yout + 1 > *sizeoutY) {
+            *sizeoutY = spotcoord[spot].Yout + 1;
+        }
+    }
+
+    for (int spot = 0; spot < NBspot; spot++) {
+        spotcoord[spot].XYout_dx = spotcoord[spot].Yout * (2 * *sizeoutX) + spotcoord[spot].Xout;
+        spotcoord[spot].XYout_dy = spotcoord[spot].Yout * (2 * *sizeoutX) + spotcoord[spot].Xout + *sizeoutX;
+        spotcoord[spot].fluxout = spotcoord[spot].Yout * (*sizeoutX) + spotcoord[spot].Xout;
+    }
+}
+
+static inline float shwfs_slope_max(int algorithm) {
+    return algorithm == SHWFS_ALGORITHM_QUADCELL ? 1 : 2;
+}
+
+/*
+ * Measure the spots of a calibrated frame (sizeinX pixels wide). Slopes and
+ * flux are stored in the spots, slopes are clipped to shwfs_slope_max() and
+ * set to 0 for spots below the flux threshold. Statistics are computed on
+ * the residual slopes (slopes - wfsref, wfsref in the slopes layout).
+ *
+ * If residual is not NULL, residual slopes are also written in it (slopes
+ * layout, 0 for invalid spots).
+ */
+static inline void shwfs_centroid(
+    const float *restrict frame,
+    uint32_t sizeinX,
+    SHWFS_SPOTS *restrict spotcoord,
+    int NBspot,
+    int algorithm,
+    float flux_threshold,
+    const float *restrict wfsref,
+    float *restrict residual,
+    SHWFS_CENTROID_STATS *stats) {
+    float slope_max = shwfs_slope_max(algorithm);
+
+    float new_flux_max = 0;
+    float new_flux_avg = 0;
+    float new_residual_rms = 0;
+    float new_slope_x_avg = 0;
+    float new_slope_y_avg = 0;
+    int valid_spots = 0;
+
+    float dx;
+    float dy;
+    float flux;
+
+    for (int spot = 0; spot < NBspot; spot++) {
+        const float *r0 = &frame[spotcoord[spot].Yraw * sizeinX + spotcoord[spot].Xraw];
+        const float *r1 = r0 + sizeinX;
+        const float *r2 = r1 + sizeinX;
+        const float *r3 = r2 + sizeinX;
+
+        /***** Quad-cell *****/
+
+        if (algorithm == SHWFS_ALGORITHM_QUADCELL) {
+            float f00 = r0[0] + r0[1] + r1[0] + r1[1];
+            float f01 = r0[2] + r0[3] + r1[2] + r1[3];
+            float f10 = r2[0] + r2[1] + r3[0] + r3[1];
+            float f11 = r2[2] + r2[3] + r3[2] + r3[3];
+
+            flux = f00 + f01 + f10 + f11;
+            dx = (f01 + f11) - (f00 + f10);
+            dy = (f10 + f11) - (f00 + f01);
+        }
+
+        /***** Center of mass *****/
+
+        else {
+            // clang-format off
+            dx = - 1.5 * r0[0] - 1.5 * r1[0] - 1.5 * r2[0] - 1.5 * r3[0]
+                 - 0.5 * r0[1] - 0.5 * r1[1] - 0.5 * r2[1] - 0.5 * r3[1]
+                 + 0.5 * r0[2] + 0.5 * r1[2] + 0.5 * r2[2] + 0.5 * r3[2]
+                 + 1.5 * r0[3] + 1.5 * r1[3] + 1.5 * r2[3] + 1.5 * r3[3];
+
+            dy = - 1.5 * r0[0] - 1.5 * r0[1] - 1.5 * r0[2] - 1.5 * r0[3]
+                 - 0.5 * r1[0] - 0.5 * r1[1] - 0.5 * r1[2] - 0.5 * r1[3]
+                 + 0.5 * r2[0] + 0.5 * r2[1] + 0.5 * r2[2] + 0.5 * r2[3]
+                 + 1.5 * r3[0] + 1.5 * r3[1] + 1.5 * r3[2] + 1.5 * r3[3];
+
+            flux = r0[0] + r0[1] + r0[2] + r0[3]
+                 + r1[0] + r1[1] + r1[2] + r1[3]
+                 + r2[0] + r2[1] + r2[2] + r2[3]
+                 + r3[0] + r3[1] + r3[2] + r3[3];
+            // clang-format on
+        }
+
+        /***** Common part *****/
+
+        if (flux > new_flux_max) {
+            new_flux_max = flux;
+        }
+
+        if (flux >= flux_threshold) {
+            dx /= flux;
+            dy /= flux;
+
+            if (dx > slope_max) {
+                dx = slope_max;
+            } else if (dx < -slope_max) {
+                dx = -slope_max;
+            }
+
+            if (dy > slope_max) {
+                dy = slope_max;
+            } else if (dy < -slope_max) {
+                dy = -slope_max;
+            }
+
+            spotcoord[spot].dx = dx;
+            spotcoord[spot].dy = dy;
+            spotcoord[spot].flux = flux;
+
+            dx -= wfsref[spotcoord[spot].XYout_dx];
+            dy -= wfsref[spotcoord[spot].XYout_dy];
+
+            new_flux_avg += flux;
+            new_residual_rms += dx * dx + dy * dy;
+            new_slope_x_avg += dx;
+            new_slope_y_avg += dy;
+            valid_spots += 1;
+        } else {
+            dx = 0;
+            dy = 0;
+
+            spotcoord[spot].dx = dx;
+            spotcoord[spot].dy = dy;
+            spotcoord[spot].flux = flux;
+        }
+
+        if (residual != NULL) {
+            residual[spotcoord[spot].XYout_dx] = dx;
+            residual[spotcoord[spot].XYout_dy] = dy;
+        }
+    }
+
+    stats->flux_max = new_flux_max;
+    stats->valid_spots = valid_spots;
+
+    if (valid_spots > 0) {
+        stats->flux_avg = new_flux_avg / valid_spots;
+        stats->residual_rms = sqrt(new_residual_rms / valid_spots);
+        stats->slope_x_avg = new_slope_x_avg / valid_spots;
+        stats->slope_y_avg = new_slope_y_avg / valid_spots;
+    } else {
+        stats->flux_avg = 0;
+        stats->residual_rms = 0;
+        stats->slope_x_avg = 0;
+        stats->slope_y_avg = 0;
+    }
+}
+
+#endif
@@ -7,6 +7,13 @@
 #define _GNU_SOURCE
 #include "CommandLineInterface/CLIcore.h"
 
+#include "KalAO_Telemetry/instance.h"
+#include "KalAO_Telemetry/section_timers.h"
+#include "KalAO_Telemetry/trace.h"
+
+#include "centroid.h"
+#include "stats.h"
+
 #include <math.h>
 
 /* ================================================================== */
@@ -15,29 +22,12 @@
 /* ================================================================== */
 /* ================================================================== */
 
-typedef struct
-{
-    // lower index pixel coords in input raw image
-    uint32_t Xraw;
-    uint32_t Yraw;
-
-    // output 2D coordinates
-    uint32_t Xout;
-    uint32_t Yout;
-
-    // precomputed indices for speed
-    uint64_t XYout_dx;
-    uint64_t XYout_dy;
-    uint64_t fluxout;
-
-    // signal
-    float dx;
-    float dy;
-    float flux;
-
-} SHWFS_SPOTS;
-
-#define MAXNB_SPOT 1000
+// Sections of the loop, see KalAO_Telemetry/section_timers.h
+enum {
+    SECTION_CENTROID,
+    SECTION_PUBLICATION,
+    SECTION_STATS
+};
 
 static char *spotcoords_fname;
 static long fpi_spotcoords_fname;
@@ -66,6 +56,9 @@ static long fpi_slope_y_avg;
 static char *wfsref_streamname;
 static long fpi_wfsref_streamname;
 
+static char *instance;
+static long fpi_instance;
+
 static CLICMDARGDEF farg[] =
     {
         {
@@ -149,6 +142,15 @@ static CLICMDARGDEF farg[] =
             (void **)&slope_y_avg,
             &fpi_slope_y_avg,
         },
+        {
+            CLIARG_STR,
+            ".instance",
+            "Instance name, suffix of the output streams (empty for the main pipeline)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&instance,
+            &fpi_instance,
+        },
 };
 
 static CLICMDDATA CLIcmddata =
@@ -158,6 +160,34 @@ static CLICMDDATA CLIcmddata =
         CLICMD_FIELDS_DEFAULTS,
 };
 
+/*
+ * State of one instance: parameters point into the FPS of the instance and
+ * output streams get its .instance suffix (see KalAO_Telemetry/instance.h).
+ * Instances run side by side as separate processes, the milk process loop
+ * is bound to data.fpsptr.
+ */
+typedef struct
+{
+    FUNCTION_PARAMETER_STRUCT *fps;
+    char *instance;
+
+    char *spotcoords_fname;
+    int64_t *flux_threshold;
+    int64_t *algorithm;
+    float *flux_max;
+    float *flux_avg;
+    float *residual_rms;
+    float *slope_x_avg;
+    float *slope_y_avg;
+    char *wfsref_streamname;
+
+    char slopes_streamname[KALAO_STREAMNAME_LEN];
+    char flux_streamname[KALAO_STREAMNAME_LEN];
+    char stats_streamname[KALAO_STREAMNAME_LEN];
+    char timers_streamname[KALAO_STREAMNAME_LEN];
+
+} SHWFS_PROCESS_CONTEXT;
+
 /* ================================================================== */
 /* ================================================================== */
 /*  FUNCTIONS                                                         */
@@ -185,47 +215,32 @@ static errno_t customCONFsetup() {
     return RETURN_SUCCESS;
 }
 
-static int read_spots_coords(SHWFS_SPOTS *spotcoord) {
-    int NBspot = 0;
-
-    FILE *fp;
-
-    fp = fopen(spotcoords_fname, "r");
-    if (fp == NULL) {
-        perror("Unable to open file!");
-        exit(1);
-    }
-
-    int xin, yin, xout, yout;
-
-    char keyw[16];
-
-    int loopOK = 1;
-    while (loopOK == 1) {
-        int ret = fscanf(fp, "%s %d %d %d %d", keyw, &xin, &yin, &xout, &yout);
-        if (ret == EOF) {
-            loopOK = 0;
-        } else {
-            if ((ret == 5) && (strcmp(keyw, "SPOT") == 0)) {
-                printf("Found SPOT %5d %5d   %5d %5d\n", xin, yin, xout, yout);
-                spotcoord[NBspot].Xraw = xin;
-                spotcoord[NBspot].Yraw = yin;
-                spotcoord[NBspot].Xout = xout;
-                spotcoord[NBspot].Yout = yout;
-                NBspot++;
-            }
-        }
-    }
-    printf("Loaded %d spots\n", NBspot);
-
-    fclose(fp);
-
-    return NBspot;
+static void context_init(SHWFS_PROCESS_CONTEXT *ctx, FUNCTION_PARAMETER_STRUCT *fps) {
+    ctx->fps = fps;
+    ctx->instance = fps->parray[fpi_instance].val.string[0];
+
+    ctx->spotcoords_fname = fps->parray[fpi_spotcoords_fname].val.string[0];
+    ctx->flux_threshold = &fps->parray[fpi_flux_threshold].val.i64[0];
+    ctx->algorithm = &fps->parray[fpi_algorithm].val.i64[0];
+    ctx->flux_max = &fps->parray[fpi_flux_max].val.f32[0];
+    ctx->flux_avg = &fps->parray[fpi_flux_avg].val.f32[0];
+    ctx->residual_rms = &fps->parray[fpi_residual_rms].val.f32[0];
+    ctx->slope_x_avg = &fps->parray[fpi_slope_x_avg].val.f32[0];
+    ctx->slope_y_avg = &fps->parray[fpi_slope_y_avg].val.f32[0];
+    ctx->wfsref_streamname = fps->parray[fpi_wfsref_streamname].val.string[0];
+
+    kalao_instance_name(ctx->slopes_streamname, ctx->instance, "shwfs_slopes");
+    kalao_instance_name(ctx->flux_streamname, ctx->instance, "shwfs_flux");
+    kalao_instance_name(ctx->stats_streamname, ctx->instance, "shwfs_stats");
+    kalao_instance_name(ctx->timers_streamname, ctx->instance, "shwfs_process_timers");
 }
 
 static errno_t compute_function() {
     DEBUG_TRACE_FSTART();
 
+    SHWFS_PROCESS_CONTEXT ctx;
+    context_init(&ctx, data.fpsptr);
+
     INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
 
     /********** Load spots coordinates **********/
@@ -236,32 +251,19 @@ static errno_t compute_function() {
     SHWFS_SPOTS *spotcoord = (SHWFS_SPOTS *)malloc(sizeof(SHWFS_SPOTS) * MAXNB_SPOT);
 
     char msgstring[200];
-    sprintf(msgstring, "Loading spot <- %s", spotcoords_fname);
+    sprintf(msgstring, "Loading spot <- %s", ctx.spotcoords_fname);
     processinfo_WriteMessage(processinfo, msgstring);
 
-    int NBspot = read_spots_coords(spotcoord);
+    int NBspot = shwfs_read_spots(ctx.spotcoords_fname, spotcoord);
 
     // size of output 2D representation
     imageID inID = processinfo->triggerstreamID;
     uint32_t sizeinX = data.image[inID].md->size[0];
     uint32_t sizeinY = data.image[inID].md->size[1];
-    uint32_t sizeoutX = 0;
-    uint32_t sizeoutY = 0;
-
-    for (int spot = 0; spot < NBspot; spot++) {
-        if (spotcoord[spot].Xout + 1 > sizeoutX) {
-            sizeoutX = spotcoord[spot].Xout + 1;
-        }
-        if (spotcoord[spot].Yout + 1 > sizeoutY) {
-            sizeoutY = spotcoord[spot].Yout + 1;
-        }
-    }
+    uint32_t sizeoutX;
+    uint32_t sizeoutY;
 
-    for (int spot = 0; spot < NBspot; spot++) {
-        spotcoord[spot].XYout_dx = spotcoord[spot].Yout * (2 * sizeoutX) + spotcoord[spot].Xout;
-        spotcoord[spot].XYout_dy = spotcoord[spot].Yout * (2 * sizeoutX) + spotcoord[spot].Xout + sizeoutX;
-        spotcoord[spot].fluxout = spotcoord[spot].Yout * (sizeoutX) + spotcoord[spot].Xout;
-    }
+    shwfs_spots_layout(spotcoord, NBspot, &sizeoutX, &sizeoutY);
 
     printf("Output 2D representation: %d x %d\n", sizeoutX, sizeoutY);
 
@@ -269,200 +271,69 @@ static errno_t compute_function() {
 
     processinfo_WriteMessage(processinfo, "Connecting to streams");
 
-    imageID wfsrefID = image_ID(wfsref_streamname);
+    imageID wfsrefID = image_ID(ctx.wfsref_streamname);
 
     /********** Allocate streams **********/
 
     processinfo_WriteMessage(processinfo, "Allocating streams");
 
     // Identifiers for output streams
-    imageID slopesID = image_ID("shwfs_slopes");
-    imageID fluxID = image_ID("shwfs_flux");
+    imageID slopesID = image_ID(ctx.slopes_streamname);
+    imageID fluxID = image_ID(ctx.flux_streamname);
+    imageID statsID = image_ID(ctx.stats_streamname);
 
     uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
     {
         // slopes
         imsizearray[0] = sizeoutX * 2;
         imsizearray[1] = sizeoutY;
-        create_image_ID("shwfs_slopes", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &slopesID);
+        create_image_ID(ctx.slopes_streamname, 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &slopesID);
 
         // flux
         imsizearray[0] = sizeoutX;
         imsizearray[1] = sizeoutY;
-        create_image_ID("shwfs_flux", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &fluxID);
+        create_image_ID(ctx.flux_streamname, 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &fluxID);
+
+        // per-frame statistics, see stats.h
+        imsizearray[0] = SHWFS_STATS_NBFIELDS;
+        imsizearray[1] = SHWFS_STATS_RING;
+        create_image_ID(ctx.stats_streamname, 2, imsizearray, _DATATYPE_DOUBLE, 1, 10, 0, &statsID);
 
         free(imsizearray);
     }
 
-    /********** Loop **********/
+    for (uint64_t i = 0; i < data.image[statsID].md->nelement; i++) {
+        data.image[statsID].array.D[i] = 0;
+    }
 
-    float new_flux_max;
-    float new_flux_avg;
-    float new_residual_rms;
-    float new_slope_x_avg;
-    float new_slope_y_avg;
-    int valid_spots;
+    strcpy(data.image[statsID].kw[0].name, SHWFS_STATS_KW_RECORDS);
+    data.image[statsID].kw[0].type = 'L';
+    data.image[statsID].kw[0].value.numl = 0;
+    strcpy(data.image[statsID].kw[0].comment, "Number of complete records");
 
-    float dx;
-    float dy;
-    float flux;
+    int stats_kw = 0;
+    uint64_t stats_records = 0;
 
-    float slope_max;
+    // Frame trace, see KalAO_Telemetry/trace.h
+    int trace_in_kw = kalao_trace_find(&data.image[inID]);
+    int trace_kw = kalao_trace_init(&data.image[slopesID]);
+    KALAO_TRACE trace;
 
-    if (*algorithm == 0) {
-        slope_max = 1;
-    } else {
-        slope_max = 2;
-    }
+    /********** Loop **********/
+
+    SHWFS_CENTROID_STATS centroid_stats;
+
+    KALAO_SECTIONS(timers, ctx.timers_streamname, "centroid", "publication", "stats");
 
     processinfo_WriteMessage(processinfo, "Looping");
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
 
-    new_flux_max = 0;
-    new_flux_avg = 0;
-    new_residual_rms = 0;
-    new_slope_x_avg = 0;
-    new_slope_y_avg = 0;
-    valid_spots = 0;
+    KALAO_SECTION_START(timers);
 
-    for (int spot = 0; spot < NBspot; spot++) {
-        dx = 0;
-        dy = 0;
-        flux = 0;
-
-        /***** Quad-cell *****/
-
-        if (*algorithm == 0) {
-            // clang-format off
-            float f00 = data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw    ]
-                      + data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 1]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw    ]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 1];
-
-            float f01 = data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 2]
-                      + data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 3]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 2]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 3];
-
-            float f10 = data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw    ]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 1]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw    ]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 1];
-
-            float f11 = data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 2]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 3]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 2]
-                      + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 3];
-            // clang-format on
-
-            flux = f00 + f01 + f10 + f11;
-            dx = (f01 + f11) - (f00 + f10);
-            dy = (f10 + f11) - (f00 + f01);
-        }
-
-        /***** Center of mass *****/
-
-        else {
-            // clang-format off
-            dx =
-               - 1.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw    ]
-               - 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw    ]
-               - 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw    ]
-               - 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw    ]
-               - 0.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 1]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 1]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 1]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 1]
-               + 0.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 2]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 2]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 2]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 2]
-               + 1.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 3]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 3]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 3]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 3];
-
-            dy =
-               - 1.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw    ]
-               - 1.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 1]
-               - 1.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 2]
-               - 1.5 * data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 3]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw    ]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 1]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 2]
-               - 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 3]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw    ]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 1]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 2]
-               + 0.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 3]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw    ]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 1]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 2]
-               + 1.5 * data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 3];
-
-            flux = data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw    ]
-                 + data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 1]
-                 + data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 2]
-                 + data.image[inID].array.F[ spotcoord[spot].Yraw      * sizeinX + spotcoord[spot].Xraw + 3]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw    ]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 1]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 2]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 1) * sizeinX + spotcoord[spot].Xraw + 3]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw    ]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 1]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 2]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 2) * sizeinX + spotcoord[spot].Xraw + 3]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw    ]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 1]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 2]
-                 + data.image[inID].array.F[(spotcoord[spot].Yraw + 3) * sizeinX + spotcoord[spot].Xraw + 3];
-            // clang-format on
-        }
-
-        /***** Common part *****/
-
-        if (flux > new_flux_max) {
-            new_flux_max = flux;
-        }
-
-        if (flux >= *flux_threshold) {
-            dx /= flux;
-            dy /= flux;
-
-            if (dx > slope_max) {
-                dx = slope_max;
-            } else if (dx < -slope_max) {
-                dx = -slope_max;
-            }
-
-            if (dy > slope_max) {
-                dy = slope_max;
-            } else if (dy < -slope_max) {
-                dy = -slope_max;
-            }
-
-            spotcoord[spot].dx = dx;
-            spotcoord[spot].dy = dy;
-            spotcoord[spot].flux = flux;
-
-            dx -= data.image[wfsrefID].array.F[spotcoord[spot].XYout_dx];
-            dy -= data.image[wfsrefID].array.F[spotcoord[spot].XYout_dy];
-
-            new_flux_avg += flux;
-            new_residual_rms += dx * dx + dy * dy;
-            new_slope_x_avg += dx;
-            new_slope_y_avg += dy;
-            valid_spots += 1;
-        } else {
-            dx = 0;
-            dy = 0;
-
-            spotcoord[spot].dx = dx;
-            spotcoord[spot].dy = dy;
-            spotcoord[spot].flux = flux;
-        }
-    }
+    shwfs_centroid(data.image[inID].array.F, sizeinX, spotcoord, NBspot, *ctx.algorithm, *ctx.flux_threshold, data.image[wfsrefID].array.F, NULL, &centroid_stats);
+
+    KALAO_SECTION_LAP(timers, SECTION_CENTROID);
 
     /***** Write slopes *****/
 
@@ -473,6 +344,16 @@ static errno_t compute_function() {
         data.image[slopesID].array.F[spotcoord[spot].XYout_dy] = spotcoord[spot].dy;
     }
 
+    if (trace_in_kw == -1) {
+        trace_in_kw = kalao_trace_find(&data.image[inID]);
+    }
+
+    if (trace_in_kw != -1 && trace_kw != -1) {
+        kalao_trace_read(&data.image[inID], trace_in_kw, &trace);
+        trace.fields[KALAO_TRACE_T_SLP] = kalao_trace_now();
+        kalao_trace_write(&data.image[slopesID], trace_kw, &trace);
+    }
+
     processinfo_update_output_stream(processinfo, slopesID);
 
     /***** Write flux stream *****/
@@ -485,28 +366,51 @@ static errno_t compute_function() {
 
     /***** Update stats *****/
 
-    *flux_max = new_flux_max;
-
-    if (valid_spots > 0) {
-        *flux_avg = new_flux_avg / valid_spots;
-        *residual_rms = sqrt(new_residual_rms / valid_spots);
-        *slope_x_avg = new_slope_x_avg / valid_spots;
-        *slope_y_avg = new_slope_y_avg / valid_spots;
-    } else {
-        *flux_avg = 0;
-        *residual_rms = 0;
-        *slope_x_avg = 0;
-        *slope_y_avg = 0;
-    }
+    *ctx.flux_max = centroid_stats.flux_max;
+    *ctx.flux_avg = centroid_stats.flux_avg;
+    *ctx.residual_rms = centroid_stats.residual_rms;
+    *ctx.slope_x_avg = centroid_stats.slope_x_avg;
+    *ctx.slope_y_avg = centroid_stats.slope_y_avg;
 
-    data.fpsptr->parray[fpi_flux_max].cnt0++;
-    data.fpsptr->parray[fpi_flux_avg].cnt0++;
-    data.fpsptr->parray[fpi_residual_rms].cnt0++;
-    data.fpsptr->parray[fpi_slope_x_avg].cnt0++;
-    data.fpsptr->parray[fpi_slope_y_avg].cnt0++;
+    ctx.fps->parray[fpi_flux_max].cnt0++;
+    ctx.fps->parray[fpi_flux_avg].cnt0++;
+    ctx.fps->parray[fpi_residual_rms].cnt0++;
+    ctx.fps->parray[fpi_slope_x_avg].cnt0++;
+    ctx.fps->parray[fpi_slope_y_avg].cnt0++;
 
+    // Posted after the stats, so that readers woken by it see those of this frame
     processinfo_update_output_stream(processinfo, fluxID);
 
+    KALAO_SECTION_LAP(timers, SECTION_PUBLICATION);
+
+    /***** Write stats record *****/
+
+    data.image[statsID].md->write = 1;
+
+    {
+        double *record = &data.image[statsID].array.D[(stats_records % SHWFS_STATS_RING) * SHWFS_STATS_NBFIELDS];
+
+        shwfs_stats_write_begin(&data.image[statsID], stats_records);
+
+        record[SHWFS_STATS_CNT0] = data.image[inID].md->cnt0;
+        record[SHWFS_STATS_TIME] = data.image[inID].md->writetime.tv_sec + 1e-9 * data.image[inID].md->writetime.tv_nsec;
+        record[SHWFS_STATS_FLUX_AVG] = *ctx.flux_avg;
+        record[SHWFS_STATS_FLUX_MAX] = *ctx.flux_max;
+        record[SHWFS_STATS_RESIDUAL_RMS] = *ctx.residual_rms;
+        record[SHWFS_STATS_SLOPE_X_AVG] = *ctx.slope_x_avg;
+        record[SHWFS_STATS_SLOPE_Y_AVG] = *ctx.slope_y_avg;
+        record[SHWFS_STATS_VALID_SPOTS] = centroid_stats.valid_spots;
+
+        shwfs_stats_write_end(&data.image[statsID], stats_kw, stats_records);
+    }
+
+    data.image[statsID].md->cnt1 = stats_records % SHWFS_STATS_RING;
+    stats_records++;
+
+    processinfo_update_output_stream(processinfo, statsID);
+
+    KALAO_SECTION_LAP(timers, SECTION_STATS);
+
     INSERT_STD_PROCINFO_COMPUTEFUNC_END
 
     free(spotcoord);
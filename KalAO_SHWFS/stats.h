@@ -0,0 +1,114 @@
+#ifndef _MILK_KALAO_SHWFS_STATS_H
+#define _MILK_KALAO_SHWFS_STATS_H
+
+#include "ImageStreamIO/ImageStruct.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Per-frame SHWFS statistics, published by process in the shwfs_stats
+ * stream: a ring of SHWFS_STATS_RING records of SHWFS_STATS_NBFIELDS doubles.
+ *
+ * Record n (n-th processed frame) is stored at index n % SHWFS_STATS_RING.
+ * Each record is protected by a sequence number (seqlock): it is odd while
+ * the record is being written and equal to 2 * n + 2 once record n is
+ * complete. The RECORDS keyword holds the number of complete records.
+ */
+
+#define SHWFS_STATS_RING 1024
+#define SHWFS_STATS_KW_RECORDS "RECORDS"
+
+enum {
+    SHWFS_STATS_SEQ,
+    SHWFS_STATS_CNT0,
+    SHWFS_STATS_TIME,
+    SHWFS_STATS_FLUX_AVG,
+    SHWFS_STATS_FLUX_MAX,
+    SHWFS_STATS_RESIDUAL_RMS,
+    SHWFS_STATS_SLOPE_X_AVG,
+    SHWFS_STATS_SLOPE_Y_AVG,
+    SHWFS_STATS_VALID_SPOTS,
+    SHWFS_STATS_NBFIELDS
+};
+
+static const char *shwfs_stats_fields[SHWFS_STATS_NBFIELDS] = {
+    "seq",
+    "cnt0",
+    "time",
+    "flux_avg",
+    "flux_max",
+    "residual_rms",
+    "slope_x_avg",
+    "slope_y_avg",
+    "valid_spots",
+};
+
+static inline int shwfs_stats_field(const char *name) {
+    for (int f = 0; f < SHWFS_STATS_NBFIELDS; f++) {
+        if (strcmp(name, shwfs_stats_fields[f]) == 0) {
+            return f;
+        }
+    }
+
+    return -1;
+}
+
+static inline int shwfs_stats_kw(IMAGE *image) {
+    for (int k = 0; k < image->md->NBkw; k++) {
+        if (strcmp(image->kw[k].name, SHWFS_STATS_KW_RECORDS) == 0) {
+            return k;
+        }
+    }
+
+    return -1;
+}
+
+static inline uint64_t shwfs_stats_records(IMAGE *image, int kw) {
+    return __atomic_load_n(&image->kw[kw].value.numl, __ATOMIC_ACQUIRE);
+}
+
+static inline void shwfs_stats_write_begin(IMAGE *image, uint64_t n) {
+    double *record = &image->array.D[(n % SHWFS_STATS_RING) * SHWFS_STATS_NBFIELDS];
+    double seq = 2 * n + 1;
+
+    __atomic_store(&record[SHWFS_STATS_SEQ], &seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void shwfs_stats_write_end(IMAGE *image, int kw, uint64_t n) {
+    double *record = &image->array.D[(n % SHWFS_STATS_RING) * SHWFS_STATS_NBFIELDS];
+    double seq = 2 * n + 2;
+
+    __atomic_store(&record[SHWFS_STATS_SEQ], &seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&image->kw[kw].value.numl, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy record n in out. Returns 0 on success, -1 if the record is not written
+ * yet, -2 if it has already been overwritten.
+ */
+static inline int shwfs_stats_read(IMAGE *image, uint64_t n, double *out) {
+    double *record = &image->array.D[(n % SHWFS_STATS_RING) * SHWFS_STATS_NBFIELDS];
+    double expected = 2 * n + 2;
+    double seq0, seq1;
+
+    __atomic_load(&record[SHWFS_STATS_SEQ], &seq0, __ATOMIC_ACQUIRE);
+
+    if (seq0 < expected) {
+        return -1;
+    } else if (seq0 > expected) {
+        return -2;
+    }
+
+    for (int f = 0; f < SHWFS_STATS_NBFIELDS; f++) {
+        out[f] = record[f];
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    __atomic_load(&record[SHWFS_STATS_SEQ], &seq1, __ATOMIC_RELAXED);
+
+    return seq1 == expected ? 0 : -2;
+}
+
+#endif
@@ -28,6 +28,8 @@
 // If functions are in separate .c files, include here the corresponding .h files
 //
 #include "gather.h"
+#include "latency.h"
+#include "recorder.h"
 
 /* ================================================================== */
 /* ================================================================== */
@@ -49,6 +51,8 @@ INIT_MODULE_LIB(KalAO_Telemetry)
  */
 static errno_t init_module_CLI() {
     CLIADDCMD_KalAO_Telemetry__gather();
+    CLIADDCMD_KalAO_Telemetry__latency();
+    CLIADDCMD_KalAO_Telemetry__recorder();
 
     return RETURN_SUCCESS;
 }
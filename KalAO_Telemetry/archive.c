@@ -0,0 +1,438 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+
+#include "archive.h"
+#include "reader.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <zstd.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+#define ARCHIVE_POLL_PERIOD_NS 100000000 // 100 ms
+#define ARCHIVE_ZSTD_LEVEL 3
+
+typedef struct
+{
+    FILE *fp_data;
+    FILE *fp_index;
+    long hour;
+
+    uint32_t NBrows;
+    uint32_t capacity;
+
+    // current chunk, sample-major as returned by the reader
+    float *samples;
+    uint32_t NBsamples;
+    uint64_t counter_first;
+
+    // compression buffers, compressed holds all the columns of a chunk
+    uint32_t *column;
+    void *compressed;
+    size_t compressed_capacity;
+
+} ARCHIVE_WRITER;
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static double sample_time(float *sample) {
+    return (double)sample[0] + (double)sample[1];
+}
+
+static long time_hour(double t) {
+    return (long)floor(t / 3600);
+}
+
+static void archive_filename(char *fname, size_t size, const char *dir, long hour, const char *ext) {
+    time_t t = hour * 3600;
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+
+    snprintf(fname, size, "%s/kalao_telemetry_%04d%02d%02d_%02d.%s", dir, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, ext);
+}
+
+static void writer_close_files(ARCHIVE_WRITER *writer) {
+    if (writer->fp_data != NULL) {
+        fclose(writer->fp_data);
+        fclose(writer->fp_index);
+    }
+
+    writer->fp_data = NULL;
+    writer->fp_index = NULL;
+    writer->hour = -1;
+}
+
+static int writer_open_files(ARCHIVE_WRITER *writer, const char *dir, long hour) {
+    char fname[1024];
+
+    writer_close_files(writer);
+
+    archive_filename(fname, sizeof(fname), dir, hour, "tlm");
+    writer->fp_data = fopen(fname, "ab");
+
+    archive_filename(fname, sizeof(fname), dir, hour, "idx");
+    writer->fp_index = fopen(fname, "ab");
+
+    if (writer->fp_data == NULL || writer->fp_index == NULL) {
+        perror("Unable to open telemetry archive");
+
+        if (writer->fp_data != NULL)
+            fclose(writer->fp_data);
+        if (writer->fp_index != NULL)
+            fclose(writer->fp_index);
+
+        writer->fp_data = NULL;
+        writer->fp_index = NULL;
+
+        return -1;
+    }
+
+    writer->hour = hour;
+
+    return 0;
+}
+
+static void writer_flush(ARCHIVE_WRITER *writer, const char *dir) {
+    uint32_t NBrows = writer->NBrows;
+    uint32_t NBsamples = writer->NBsamples;
+
+    if (NBsamples == 0) {
+        return;
+    }
+
+    writer->NBsamples = 0;
+
+    double t_first = sample_time(&writer->samples[0]);
+    double t_last = sample_time(&writer->samples[(NBsamples - 1) * NBrows]);
+
+    if (time_hour(t_first) != writer->hour && writer_open_files(writer, dir, time_hour(t_first)) != 0) {
+        return;
+    }
+
+    // Append mode does not define the position before the first write
+    fseek(writer->fp_data, 0, SEEK_END);
+
+    TELEMETRY_ARCHIVE_CHUNK chunk = {TELEMETRY_ARCHIVE_MAGIC, NBrows, NBsamples, 0, writer->counter_first, t_first, t_last};
+    TELEMETRY_ARCHIVE_INDEX index = {t_first, t_last, (uint64_t)ftell(writer->fp_data), NBrows, NBsamples};
+
+    uint32_t *csizes = (uint32_t *)malloc(sizeof(uint32_t) * NBrows);
+    size_t column_capacity = writer->compressed_capacity / NBrows;
+    size_t total = 0;
+
+    // Columns are compressed first, the header holds their sizes
+    for (uint32_t r = 0; r < NBrows; r++) {
+        uint32_t previous = 0;
+
+        // XOR-delta of the bit patterns: slowly varying values give mostly zero bits
+        for (uint32_t s = 0; s < NBsamples; s++) {
+            uint32_t bits;
+            memcpy(&bits, &writer->samples[s * NBrows + r], sizeof(bits));
+
+            writer->column[s] = bits ^ previous;
+            previous = bits;
+        }
+
+        size_t csize = ZSTD_compress((char *)writer->compressed + total, column_capacity, writer->column, sizeof(uint32_t) * NBsamples, ARCHIVE_ZSTD_LEVEL);
+
+        if (ZSTD_isError(csize)) {
+            printf("Telemetry archive compression failed: %s\n", ZSTD_getErrorName(csize));
+            csize = 0;
+        }
+
+        csizes[r] = csize;
+        total += csize;
+    }
+
+    fwrite(&chunk, sizeof(chunk), 1, writer->fp_data);
+    fwrite(csizes, sizeof(uint32_t), NBrows, writer->fp_data);
+    fwrite(writer->compressed, 1, total, writer->fp_data);
+    fflush(writer->fp_data);
+
+    // Index entry is written last, so that readers only see complete chunks
+    fwrite(&index, sizeof(index), 1, writer->fp_index);
+    fflush(writer->fp_index);
+
+    free(csizes);
+}
+
+static void *archiver_thread(void *ptr) {
+    TELEMETRY_ARCHIVER *archiver = (TELEMETRY_ARCHIVER *)ptr;
+
+    TELEMETRY_READER reader;
+
+    if (telemetry_reader_init(&reader, archiver->image) != 0) {
+        printf("Telemetry stream has no write cursor, archiver not started\n");
+        return NULL;
+    }
+
+    ARCHIVE_WRITER writer;
+
+    writer.fp_data = NULL;
+    writer.fp_index = NULL;
+    writer.hour = -1;
+    writer.NBrows = reader.NBrows;
+    writer.capacity = archiver->chunk_size;
+    writer.samples = (float *)malloc(sizeof(float) * writer.NBrows * writer.capacity);
+    writer.NBsamples = 0;
+    writer.counter_first = 0;
+    writer.column = (uint32_t *)malloc(sizeof(uint32_t) * writer.capacity);
+    // Room for all the columns of a chunk
+    writer.compressed_capacity = writer.NBrows * ZSTD_compressBound(sizeof(uint32_t) * writer.capacity);
+    writer.compressed = malloc(writer.compressed_capacity);
+
+    mkdir(archiver->dir, 0755);
+
+    // Only archive samples written from now on
+    uint64_t counter = telemetry_reader_counter(&reader);
+    int overrun;
+
+    struct timespec poll_period = {0, ARCHIVE_POLL_PERIOD_NS};
+
+    while (!__atomic_load_n(&archiver->stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&poll_period, NULL);
+
+        if (!(*archiver->onoff_flag & archiver->onoff_mask)) {
+            writer_flush(&writer, archiver->dir);
+            counter = telemetry_reader_counter(&reader);
+            continue;
+        }
+
+        while (1) {
+            uint32_t room = writer.capacity - writer.NBsamples;
+            float *buffer = &writer.samples[writer.NBsamples * writer.NBrows];
+            uint64_t since = counter;
+
+            uint64_t n = telemetry_read_since(&reader, since, buffer, room, &counter, &overrun);
+
+            if (overrun) {
+                uint64_t start = counter - n;
+
+                if (start > since) {
+                    __atomic_store_n(&archiver->lost, archiver->lost + (start - since), __ATOMIC_RELAXED);
+                } else if (start < since) {
+                    // Writer restarted: only the samples of the new run before start are known to be lost
+                    __atomic_store_n(&archiver->restarts, archiver->restarts + 1, __ATOMIC_RELAXED);
+                    __atomic_store_n(&archiver->lost, archiver->lost + start, __ATOMIC_RELAXED);
+                }
+
+                // Chunks hold consecutive samples only: close the current one
+                // (flush only uses the samples before buffer)
+                if (writer.NBsamples > 0) {
+                    writer_flush(&writer, archiver->dir);
+
+                    memmove(writer.samples, buffer, sizeof(float) * n * writer.NBrows);
+                    buffer = writer.samples;
+                }
+            }
+
+            if (n == 0) {
+                break;
+            }
+
+            if (writer.NBsamples == 0) {
+                writer.counter_first = counter - n;
+            }
+
+            // Hourly rotation: a chunk never spans two files
+            uint32_t s = 0;
+            for (; s < n; s++) {
+                if (time_hour(sample_time(&buffer[s * writer.NBrows])) != time_hour(sample_time(writer.samples))) {
+                    break;
+                }
+            }
+
+            if (s < n) {
+                writer.NBsamples += s;
+                writer_flush(&writer, archiver->dir);
+
+                memmove(writer.samples, &buffer[s * writer.NBrows], sizeof(float) * (n - s) * writer.NBrows);
+                writer.NBsamples = n - s;
+                writer.counter_first = counter - (n - s);
+            } else {
+                writer.NBsamples += n;
+            }
+
+            __atomic_store_n(&archiver->archived, archiver->archived + n, __ATOMIC_RELAXED);
+
+            if (writer.NBsamples == writer.capacity) {
+                writer_flush(&writer, archiver->dir);
+            }
+        }
+    }
+
+    writer_flush(&writer, archiver->dir);
+    writer_close_files(&writer);
+
+    free(writer.samples);
+    free(writer.column);
+    free(writer.compressed);
+
+    return NULL;
+}
+
+int telemetry_archiver_start(
+    TELEMETRY_ARCHIVER *archiver,
+    IMAGE *image,
+    const char *dir,
+    uint32_t chunk_size,
+    uint64_t *onoff_flag,
+    uint64_t onoff_mask) {
+    archiver->image = image;
+    strncpy(archiver->dir, dir, sizeof(archiver->dir) - 1);
+    archiver->dir[sizeof(archiver->dir) - 1] = '\0';
+    archiver->chunk_size = chunk_size;
+    archiver->onoff_flag = onoff_flag;
+    archiver->onoff_mask = onoff_mask;
+    archiver->stop = 0;
+    archiver->archived = 0;
+    archiver->lost = 0;
+    archiver->restarts = 0;
+
+    return pthread_create(&archiver->thread, NULL, archiver_thread, archiver);
+}
+
+void telemetry_archiver_stop(TELEMETRY_ARCHIVER *archiver) {
+    __atomic_store_n(&archiver->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(archiver->thread, NULL);
+}
+
+static int read_column(FILE *fp, long offset, uint32_t csize, uint32_t NBsamples, uint32_t *column, void *compressed) {
+    fseek(fp, offset, SEEK_SET);
+
+    if (fread(compressed, 1, csize, fp) != csize) {
+        return -1;
+    }
+
+    size_t size = ZSTD_decompress(column, sizeof(uint32_t) * NBsamples, compressed, csize);
+
+    if (ZSTD_isError(size) || size != sizeof(uint32_t) * NBsamples) {
+        return -1;
+    }
+
+    // Undo XOR-delta
+    for (uint32_t s = 1; s < NBsamples; s++) {
+        column[s] ^= column[s - 1];
+    }
+
+    return 0;
+}
+
+long telemetry_archive_read(
+    const char *dir,
+    double t_start,
+    double t_end,
+    uint32_t row,
+    double *times,
+    float *values,
+    long maxsamples) {
+    long count = 0;
+
+    for (long hour = time_hour(t_start); hour <= time_hour(t_end) && count < maxsamples; hour++) {
+        char fname[1024];
+
+        archive_filename(fname, sizeof(fname), dir, hour, "idx");
+        FILE *fp_index = fopen(fname, "rb");
+
+        if (fp_index == NULL) {
+            continue;
+        }
+
+        archive_filename(fname, sizeof(fname), dir, hour, "tlm");
+        FILE *fp_data = fopen(fname, "rb");
+
+        if (fp_data == NULL) {
+            fclose(fp_index);
+            continue;
+        }
+
+        TELEMETRY_ARCHIVE_INDEX index;
+
+        while (fread(&index, sizeof(index), 1, fp_index) == 1 && count < maxsamples) {
+            if (index.t_last < t_start || index.t_first > t_end || row >= index.NBrows) {
+                continue;
+            }
+
+            uint32_t NBsamples = index.NBsamples;
+            uint32_t *csizes = (uint32_t *)malloc(sizeof(uint32_t) * index.NBrows);
+            long *offsets = (long *)malloc(sizeof(long) * index.NBrows);
+
+            fseek(fp_data, index.offset + sizeof(TELEMETRY_ARCHIVE_CHUNK), SEEK_SET);
+
+            if (fread(csizes, sizeof(uint32_t), index.NBrows, fp_data) != index.NBrows) {
+                free(csizes);
+                free(offsets);
+                break;
+            }
+
+            uint32_t cmax = 0;
+            offsets[0] = index.offset + sizeof(TELEMETRY_ARCHIVE_CHUNK) + sizeof(uint32_t) * index.NBrows;
+
+            for (uint32_t r = 0; r < index.NBrows; r++) {
+                if (r > 0) {
+                    offsets[r] = offsets[r - 1] + csizes[r - 1];
+                }
+                if (csizes[r] > cmax) {
+                    cmax = csizes[r];
+                }
+            }
+
+            uint32_t *t_offset = (uint32_t *)malloc(sizeof(uint32_t) * NBsamples);
+            uint32_t *t_rel = (uint32_t *)malloc(sizeof(uint32_t) * NBsamples);
+            uint32_t *column = (uint32_t *)malloc(sizeof(uint32_t) * NBsamples);
+            void *compressed = malloc(cmax);
+
+            if (read_column(fp_data, offsets[0], csizes[0], NBsamples, t_offset, compressed) == 0 &&
+                read_column(fp_data, offsets[1], csizes[1], NBsamples, t_rel, compressed) == 0 &&
+                read_column(fp_data, offsets[row], csizes[row], NBsamples, column, compressed) == 0) {
+                for (uint32_t s = 0; s < NBsamples && count < maxsamples; s++) {
+                    float f_offset, f_rel, value;
+
+                    memcpy(&f_offset, &t_offset[s], sizeof(float));
+                    memcpy(&f_rel, &t_rel[s], sizeof(float));
+                    memcpy(&value, &column[s], sizeof(float));
+
+                    double t = (double)f_offset + (double)f_rel;
+
+                    if (t >= t_start && t <= t_end) {
+                        times[count] = t;
+                        values[count] = value;
+                        count++;
+                    }
+                }
+            }
+
+            free(csizes);
+            free(offsets);
+            free(t_offset);
+            free(t_rel);
+            free(column);
+            free(compressed);
+        }
+
+        fclose(fp_index);
+        fclose(fp_data);
+    }
+
+    return count;
+}
@@ -0,0 +1,94 @@
+#ifndef _MILK_KALAO_TELEMETRY_ARCHIVE_H
+#define _MILK_KALAO_TELEMETRY_ARCHIVE_H
+
+#include "ImageStreamIO/ImageStruct.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Telemetry archive.
+ *
+ * A writer thread drains new samples from kalao_telemetry (see reader.h)
+ * into chunks of samples, stored column by column. Each column is XOR-delta
+ * encoded (successive float bit patterns) and compressed with zstd. Files
+ * are rotated every hour (UTC):
+ *
+ *   <dir>/kalao_telemetry_YYYYMMDD_HH.tlm : chunks
+ *   <dir>/kalao_telemetry_YYYYMMDD_HH.idx : one TELEMETRY_ARCHIVE_INDEX per chunk
+ *
+ * Rows 0 and 1 of the telemetry stream hold the timestamp (offset + relative)
+ * and are used to locate samples in time.
+ */
+
+#define TELEMETRY_ARCHIVE_MAGIC 0x434c544b // "KTLC"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t NBrows;
+    uint32_t NBsamples;
+    uint32_t reserved;
+    uint64_t counter_first;
+    double t_first;
+    double t_last;
+
+    // followed by NBrows uint32_t compressed column sizes, then the columns
+
+} TELEMETRY_ARCHIVE_CHUNK;
+
+typedef struct
+{
+    double t_first;
+    double t_last;
+    uint64_t offset;
+    uint32_t NBrows;
+    uint32_t NBsamples;
+
+} TELEMETRY_ARCHIVE_INDEX;
+
+typedef struct
+{
+    IMAGE *image;
+    char dir[512];
+    uint32_t chunk_size;
+    uint64_t *onoff_flag;
+    uint64_t onoff_mask;
+
+    pthread_t thread;
+    int stop;
+
+    // statistics, written by the archiver thread
+    uint64_t archived;
+    uint64_t lost;
+    uint64_t restarts;
+
+} TELEMETRY_ARCHIVER;
+
+int telemetry_archiver_start(
+    TELEMETRY_ARCHIVER *archiver,
+    IMAGE *image,
+    const char *dir,
+    uint32_t chunk_size,
+    uint64_t *onoff_flag,
+    uint64_t onoff_mask);
+
+void telemetry_archiver_stop(TELEMETRY_ARCHIVER *archiver);
+
+/*
+ * Read one row of the archive between t_start and t_end (unix time [s]).
+ * Only the chunks overlapping the time range are read, and only the time rows
+ * and the requested row are decompressed.
+ *
+ * Returns the number of samples written in times and values, or -1 on error.
+ */
+long telemetry_archive_read(
+    const char *dir,
+    double t_start,
+    double t_end,
+    uint32_t row,
+    double *times,
+    float *values,
+    long maxsamples);
+
+#endif
@@ -0,0 +1,335 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+#include "CommandLineInterface/fps/fps_GetParamIndex.h"
+
+#include "channels.h"
+
+#include <math.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+// Unresolved channels point here, so that the layout does not depend on
+// which sources are available
+static const float channel_nan = NAN;
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+int telemetry_registry_init(TELEMETRY_REGISTRY *registry) {
+    registry->NBchannels = 0;
+    registry->NBfps = 0;
+    registry->fps = malloc(sizeof(FUNCTION_PARAMETER_STRUCT) * TELEMETRY_MAXNB_FPS);
+
+    registry->statsID = -1;
+    registry->stats_kw = -1;
+    registry->stats_next = 0;
+
+    for (int f = 0; f < SHWFS_STATS_NBFIELDS; f++) {
+        registry->stats_record[f] = NAN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static FUNCTION_PARAMETER_STRUCT *registry_fps(TELEMETRY_REGISTRY *registry, const char *fpsname) {
+    FUNCTION_PARAMETER_STRUCT *fps = (FUNCTION_PARAMETER_STRUCT *)registry->fps;
+
+    for (int k = 0; k < registry->NBfps; k++) {
+        if (strcmp(fps[k].md->name, fpsname) == 0) {
+            return &fps[k];
+        }
+    }
+
+    if (registry->NBfps == TELEMETRY_MAXNB_FPS) {
+        printf("Too many FPS in telemetry channels, cannot connect to %s\n", fpsname);
+        return NULL;
+    }
+
+    if (function_parameter_struct_connect(fpsname, &fps[registry->NBfps], FPSCONNECT_SIMPLE) == -1) {
+        printf("Cannot connect to FPS %s\n", fpsname);
+        return NULL;
+    }
+
+    return &fps[registry->NBfps++];
+}
+
+static void resolve_fps(TELEMETRY_REGISTRY *registry, TELEMETRY_CHANNEL *channel, const char *fpsname, const char *param) {
+    FUNCTION_PARAMETER_STRUCT *fps = registry_fps(registry, fpsname);
+
+    if (fps == NULL) {
+        return;
+    }
+
+    long index = functionparameter_GetParamIndex(fps, param);
+
+    if (index < 0) {
+        printf("Parameter %s not found in FPS %s\n", param, fpsname);
+        return;
+    }
+
+    switch (fps->parray[index].type) {
+    case FPTYPE_INT64:
+        channel->type = TELEMETRY_CHANNEL_INT64;
+        channel->ptr = &fps->parray[index].val.i64[0];
+        break;
+    case FPTYPE_UINT64:
+        channel->type = TELEMETRY_CHANNEL_UINT64;
+        channel->ptr = &fps->parray[index].val.ui64[0];
+        break;
+    case FPTYPE_FLOAT32:
+        channel->type = TELEMETRY_CHANNEL_FLOAT;
+        channel->ptr = &fps->parray[index].val.f32[0];
+        break;
+    case FPTYPE_FLOAT64:
+        channel->type = TELEMETRY_CHANNEL_DOUBLE;
+        channel->ptr = &fps->parray[index].val.f64[0];
+        break;
+    default:
+        printf("Unsupported type for parameter %s in FPS %s\n", param, fpsname);
+        break;
+    }
+}
+
+static void resolve_element(TELEMETRY_CHANNEL *channel, const char *streamname, uint64_t index) {
+    imageID ID = image_ID(streamname);
+
+    if (ID == -1) {
+        printf("Stream %s not found\n", streamname);
+        return;
+    }
+
+    if (index >= data.image[ID].md->nelement) {
+        printf("Index %lu out of range for stream %s\n", index, streamname);
+        return;
+    }
+
+    switch (data.image[ID].md->datatype) {
+    case _DATATYPE_FLOAT:
+        channel->type = TELEMETRY_CHANNEL_FLOAT;
+        channel->ptr = &data.image[ID].array.F[index];
+        break;
+    case _DATATYPE_DOUBLE:
+        channel->type = TELEMETRY_CHANNEL_DOUBLE;
+        channel->ptr = &data.image[ID].array.D[index];
+        break;
+    case _DATATYPE_INT64:
+        channel->type = TELEMETRY_CHANNEL_INT64;
+        channel->ptr = &data.image[ID].array.SI64[index];
+        break;
+    case _DATATYPE_INT32:
+        channel->type = TELEMETRY_CHANNEL_INT32;
+        channel->ptr = &data.image[ID].array.SI32[index];
+        break;
+    case _DATATYPE_UINT16:
+        channel->type = TELEMETRY_CHANNEL_UINT16;
+        channel->ptr = &data.image[ID].array.UI16[index];
+        break;
+    case _DATATYPE_INT16:
+        channel->type = TELEMETRY_CHANNEL_INT16;
+        channel->ptr = &data.image[ID].array.SI16[index];
+        break;
+    default:
+        printf("Unsupported data type for stream %s\n", streamname);
+        break;
+    }
+}
+
+static void resolve_region(TELEMETRY_CHANNEL *channel, TELEMETRY_CHANNEL_TYPE type, const char *streamname, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    imageID ID = image_ID(streamname);
+
+    if (ID == -1) {
+        printf("Stream %s not found\n", streamname);
+        return;
+    }
+
+    uint32_t sizeX = data.image[ID].md->size[0];
+    uint32_t sizeY = data.image[ID].md->naxis > 1 ? data.image[ID].md->size[1] : 1;
+
+    if (data.image[ID].md->datatype != _DATATYPE_FLOAT) {
+        printf("Reductions are only supported on float streams (%s)\n", streamname);
+        return;
+    }
+
+    if (x0 > x1 || y0 > y1 || x1 >= sizeX || y1 >= sizeY) {
+        printf("Region out of range for stream %s\n", streamname);
+        return;
+    }
+
+    channel->type = type;
+    channel->ptr = data.image[ID].array.F;
+    channel->stride = sizeX;
+    channel->x0 = x0;
+    channel->y0 = y0;
+    channel->x1 = x1;
+    channel->y1 = y1;
+}
+
+static void resolve_stats(TELEMETRY_REGISTRY *registry, TELEMETRY_CHANNEL *channel, const char *streamname, const char *fieldname) {
+    imageID ID = image_ID(streamname);
+
+    if (ID == -1) {
+        printf("Stream %s not found\n", streamname);
+        return;
+    }
+
+    int field = shwfs_stats_field(fieldname);
+    int kw = shwfs_stats_kw(&data.image[ID]);
+
+    if (field == -1) {
+        printf("Unknown statistics field %s\n", fieldname);
+        return;
+    }
+
+    if (kw == -1 || data.image[ID].md->datatype != _DATATYPE_DOUBLE) {
+        printf("Stream %s is not a statistics stream\n", streamname);
+        return;
+    }
+
+    if (registry->statsID != -1 && registry->statsID != ID) {
+        printf("Only one statistics stream is supported, ignoring %s\n", streamname);
+        return;
+    }
+
+    if (registry->statsID == -1) {
+        registry->statsID = ID;
+        registry->stats_kw = kw;
+
+        // Start with the next record
+        registry->stats_next = shwfs_stats_records(&data.image[ID], kw);
+    }
+
+    channel->type = TELEMETRY_CHANNEL_DOUBLE;
+    channel->ptr = &registry->stats_record[field];
+}
+
+int telemetry_registry_add(TELEMETRY_REGISTRY *registry, const char *line) {
+    char keyw[16];
+    char name[TELEMETRY_CHANNEL_NAME_LEN];
+    char source[200];
+    char param[200];
+    unsigned int x0, y0, x1, y1;
+    unsigned long index;
+
+    if (sscanf(line, "%15s", keyw) != 1 || keyw[0] == '#') {
+        // Empty line or comment
+        return RETURN_SUCCESS;
+    }
+
+    if (registry->NBchannels == TELEMETRY_MAXNB_CHANNELS) {
+        printf("Too many telemetry channels, ignoring: %s\n", line);
+        return RETURN_FAILURE;
+    }
+
+    TELEMETRY_CHANNEL *channel = &registry->channels[registry->NBchannels];
+
+    channel->type = TELEMETRY_CHANNEL_FLOAT;
+    channel->ptr = &channel_nan;
+
+    if (strcmp(keyw, "FPS") == 0 && sscanf(line, "%*s %15s %199s %199s", name, source, param) == 3) {
+        resolve_fps(registry, channel, source, param);
+        snprintf(channel->source, sizeof(channel->source), "%s.%s", source, param);
+    } else if (strcmp(keyw, "STREAM") == 0 && sscanf(line, "%*s %15s %199s %lu", name, source, &index) == 3) {
+        resolve_element(channel, source, index);
+        snprintf(channel->source, sizeof(channel->source), "%s[%lu]", source, index);
+    } else if (strcmp(keyw, "STATS") == 0 && sscanf(line, "%*s %15s %199s %199s", name, source, param) == 3) {
+        resolve_stats(registry, channel, source, param);
+        snprintf(channel->source, sizeof(channel->source), "%s.%s", source, param);
+    } else if (sscanf(line, "%*s %15s %199s %u %u %u %u", name, source, &x0, &y0, &x1, &y1) == 6) {
+        TELEMETRY_CHANNEL_TYPE type;
+
+        if (strcmp(keyw, "MEAN") == 0) {
+            type = TELEMETRY_CHANNEL_MEAN;
+        } else if (strcmp(keyw, "SUM") == 0) {
+            type = TELEMETRY_CHANNEL_SUM;
+        } else if (strcmp(keyw, "MIN") == 0) {
+            type = TELEMETRY_CHANNEL_MIN;
+        } else if (strcmp(keyw, "MAX") == 0) {
+            type = TELEMETRY_CHANNEL_MAX;
+        } else {
+            printf("Unknown telemetry channel: %s\n", line);
+            return RETURN_FAILURE;
+        }
+
+        resolve_region(channel, type, source, x0, y0, x1, y1);
+        snprintf(channel->source, sizeof(channel->source), "%s %s[%u:%u,%u:%u]", keyw, source, x0, x1, y0, y1);
+    } else {
+        printf("Invalid telemetry channel: %s\n", line);
+        return RETURN_FAILURE;
+    }
+
+    strcpy(channel->name, name);
+
+    printf("Found channel %-16s %s\n", channel->name, channel->source);
+
+    registry->NBchannels++;
+
+    return RETURN_SUCCESS;
+}
+
+int telemetry_registry_load(TELEMETRY_REGISTRY *registry, const char *fname) {
+    FILE *fp;
+
+    fp = fopen(fname, "r");
+    if (fp == NULL) {
+        perror("Unable to open file!");
+        return RETURN_FAILURE;
+    }
+
+    char line[512];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        telemetry_registry_add(registry, line);
+    }
+
+    printf("Loaded %d telemetry channels\n", registry->NBchannels);
+
+    fclose(fp);
+
+    return RETURN_SUCCESS;
+}
+
+uint64_t telemetry_registry_pending_stats(TELEMETRY_REGISTRY *registry) {
+    uint64_t records = shwfs_stats_records(&data.image[registry->statsID], registry->stats_kw);
+
+    if (records < registry->stats_next) {
+        // Writer restarted
+        registry->stats_next = records;
+    }
+
+    return records - registry->stats_next;
+}
+
+// Returns 0 if the next record was read, -1 if it was lost
+int telemetry_registry_read_stats(TELEMETRY_REGISTRY *registry) {
+    int ret = shwfs_stats_read(&data.image[registry->statsID], registry->stats_next, registry->stats_record);
+
+    registry->stats_next++;
+
+    return ret == 0 ? 0 : -1;
+}
+
+void telemetry_registry_close(TELEMETRY_REGISTRY *registry) {
+    FUNCTION_PARAMETER_STRUCT *fps = (FUNCTION_PARAMETER_STRUCT *)registry->fps;
+
+    for (int k = 0; k < registry->NBfps; k++) {
+        function_parameter_struct_disconnect(&fps[k]);
+    }
+
+    free(registry->fps);
+
+    registry->NBfps = 0;
+    registry->NBchannels = 0;
+}
@@ -0,0 +1,162 @@
+#ifndef _MILK_KALAO_TELEMETRY_CHANNELS_H
+#define _MILK_KALAO_TELEMETRY_CHANNELS_H
+
+#include "KalAO_SHWFS/stats.h"
+
+#include <stdint.h>
+
+/*
+ * Telemetry channel registry.
+ *
+ * Channels are listed in a text file, one per line:
+ *
+ *   FPS    <name> <fps> <param>                 FPS parameter (int64, uint64, float32, float64)
+ *   STREAM <name> <stream> <index>              stream element
+ *   MEAN   <name> <stream> <x0> <y0> <x1> <y1>  reduction over a stream region
+ *   SUM    <name> <stream> <x0> <y0> <x1> <y1>  (bounds inclusive, float streams)
+ *   MIN    <name> <stream> <x0> <y0> <x1> <y1>
+ *   MAX    <name> <stream> <x0> <y0> <x1> <y1>
+ *   STATS  <name> <stream> <field>              field of the per-frame SHWFS statistics (see stats.h)
+ *
+ * They are resolved once at startup into typed pointers, so that taking a
+ * snapshot is a single pass over a flat array.
+ *
+ * STATS channels point to a copy of the current statistics record: when
+ * present, gather consumes every record and writes one sample per WFS frame.
+ */
+
+#define TELEMETRY_MAXNB_CHANNELS 64
+#define TELEMETRY_MAXNB_FPS 8
+#define TELEMETRY_CHANNEL_NAME_LEN 16
+
+typedef enum {
+    TELEMETRY_CHANNEL_FLOAT,
+    TELEMETRY_CHANNEL_DOUBLE,
+    TELEMETRY_CHANNEL_INT64,
+    TELEMETRY_CHANNEL_UINT64,
+    TELEMETRY_CHANNEL_INT32,
+    TELEMETRY_CHANNEL_UINT16,
+    TELEMETRY_CHANNEL_INT16,
+    TELEMETRY_CHANNEL_MEAN,
+    TELEMETRY_CHANNEL_SUM,
+    TELEMETRY_CHANNEL_MIN,
+    TELEMETRY_CHANNEL_MAX,
+} TELEMETRY_CHANNEL_TYPE;
+
+typedef struct
+{
+    TELEMETRY_CHANNEL_TYPE type;
+    const void *ptr;
+
+    // reductions: row stride and region of a float stream
+    uint32_t stride;
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t x1;
+    uint32_t y1;
+
+    char name[TELEMETRY_CHANNEL_NAME_LEN];
+    char source[80];
+
+} TELEMETRY_CHANNEL;
+
+typedef struct
+{
+    int NBchannels;
+    TELEMETRY_CHANNEL channels[TELEMETRY_MAXNB_CHANNELS];
+
+    // connected FPS (FUNCTION_PARAMETER_STRUCT, opaque here)
+    int NBfps;
+    void *fps;
+
+    // per-frame SHWFS statistics (single stats stream)
+    long statsID;
+    int stats_kw;
+    uint64_t stats_next;
+    double stats_record[SHWFS_STATS_NBFIELDS];
+
+} TELEMETRY_REGISTRY;
+
+int telemetry_registry_init(TELEMETRY_REGISTRY *registry);
+
+int telemetry_registry_add(TELEMETRY_REGISTRY *registry, const char *line);
+
+int telemetry_registry_load(TELEMETRY_REGISTRY *registry, const char *fname);
+
+uint64_t telemetry_registry_pending_stats(TELEMETRY_REGISTRY *registry);
+
+int telemetry_registry_read_stats(TELEMETRY_REGISTRY *registry);
+
+void telemetry_registry_close(TELEMETRY_REGISTRY *registry);
+
+static inline float telemetry_channel_reduce(const TELEMETRY_CHANNEL *channel) {
+    const float *array = (const float *)channel->ptr;
+    float acc = channel->type == TELEMETRY_CHANNEL_MIN ? array[channel->y0 * channel->stride + channel->x0] : 0;
+
+    if (channel->type == TELEMETRY_CHANNEL_MAX) {
+        acc = array[channel->y0 * channel->stride + channel->x0];
+    }
+
+    for (uint32_t y = channel->y0; y <= channel->y1; y++) {
+        const float *row = &array[y * channel->stride];
+
+        switch (channel->type) {
+        case TELEMETRY_CHANNEL_MIN:
+            for (uint32_t x = channel->x0; x <= channel->x1; x++)
+                acc = row[x] < acc ? row[x] : acc;
+            break;
+        case TELEMETRY_CHANNEL_MAX:
+            for (uint32_t x = channel->x0; x <= channel->x1; x++)
+                acc = row[x] > acc ? row[x] : acc;
+            break;
+        default:
+            for (uint32_t x = channel->x0; x <= channel->x1; x++)
+                acc += row[x];
+            break;
+        }
+    }
+
+    if (channel->type == TELEMETRY_CHANNEL_MEAN) {
+        acc /= (channel->x1 - channel->x0 + 1) * (channel->y1 - channel->y0 + 1);
+    }
+
+    return acc;
+}
+
+static inline void telemetry_channels_snapshot(
+    const TELEMETRY_CHANNEL *channels,
+    int NBchannels,
+    float *values) {
+    for (int ch = 0; ch < NBchannels; ch++) {
+        const TELEMETRY_CHANNEL *channel = &channels[ch];
+
+        switch (channel->type) {
+        case TELEMETRY_CHANNEL_FLOAT:
+            values[ch] = *(const volatile float *)channel->ptr;
+            break;
+        case TELEMETRY_CHANNEL_DOUBLE:
+            values[ch] = *(const volatile double *)channel->ptr;
+            break;
+        case TELEMETRY_CHANNEL_INT64:
+            values[ch] = *(const volatile int64_t *)channel->ptr;
+            break;
+        case TELEMETRY_CHANNEL_UINT64:
+            values[ch] = *(const volatile uint64_t *)channel->ptr;
+            break;
+        case TELEMETRY_CHANNEL_INT32:
+            values[ch] = *(const volatile int32_t *)channel->ptr;
+            break;
+        case TELEMETRY_CHANNEL_UINT16:
+            values[ch] = *(const volatile uint16_t *)channel->ptr;
+            break;
+        case TELEMETRY_CHANNEL_INT16:
+            values[ch] = *(const volatile int16_t *)channel->ptr;
+            break;
+        default:
+            values[ch] = telemetry_channel_reduce(channel);
+            break;
+        }
+    }
+}
+
+#endif
@@ -7,8 +7,19 @@
 #define _GNU_SOURCE
 #include "CommandLineInterface/CLIcore.h"
 
+#include "archive.h"
+#include "channels.h"
+#include "instance.h"
+#include "psd.h"
+#include "quantiles.h"
+#include "reader.h"
+#include "rings.h"
+#include "section_timers.h"
+
 #include <math.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 
 /* ================================================================== */
 /* ================================================================== */
@@ -18,9 +29,62 @@
 
 #define DATAPOINTS 1800 * 3
 
+#define NB_RINGS 3
+
+// Number of keywords before the row header
+#define NB_CURSOR_KW 2
+
+// Sections of the loop, see section_timers.h
+enum {
+    SECTION_SNAPSHOT,
+    SECTION_PUBLICATION
+};
+
 static char *TTMin_streamname;
 static long fpi_TTMin_streamname;
 
+static char *channels_fname;
+static long fpi_channels_fname;
+
+static uint64_t *archive;
+static long fpi_archive;
+
+static char *archive_dir;
+static long fpi_archive_dir;
+
+static int64_t *archive_chunk;
+static long fpi_archive_chunk;
+
+static uint64_t *psd;
+static long fpi_psd;
+
+static char *psd_channels;
+static long fpi_psd_channels;
+
+static int64_t *psd_nfft;
+static long fpi_psd_nfft;
+
+static int64_t *psd_segments;
+static long fpi_psd_segments;
+
+static float *psd_period;
+static long fpi_psd_period;
+
+static char *quantiles;
+static long fpi_quantiles;
+
+static float *quantiles_window;
+static long fpi_quantiles_window;
+
+static uint64_t *quantiles_reset;
+static long fpi_quantiles_reset;
+
+static float *sampling_rate;
+static long fpi_sampling_rate;
+
+static char *instance;
+static long fpi_instance;
+
 static CLICMDARGDEF farg[] =
     {
         {
@@ -32,6 +96,132 @@ static CLICMDARGDEF farg[] =
             (void **)&TTMin_streamname,
             &fpi_TTMin_streamname,
         },
+        {
+            CLIARG_STR,
+            ".channels",
+            "Telemetry channels file (default channels if empty)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&channels_fname,
+            &fpi_channels_fname,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".sampling_rate",
+            "Fixed sampling rate [Hz] (0: one sample per trigger)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&sampling_rate,
+            &fpi_sampling_rate,
+        },
+        {
+            CLIARG_ONOFF,
+            ".archive_on",
+            "Archive telemetry on disk ON/OFF",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&archive,
+            &fpi_archive,
+        },
+        {
+            CLIARG_STR,
+            ".archive_dir",
+            "Telemetry archive directory",
+            "telemetry_archive",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&archive_dir,
+            &fpi_archive_dir,
+        },
+        {
+            CLIARG_INT64,
+            ".archive_chunk",
+            "Number of samples per archive chunk",
+            "1000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&archive_chunk,
+            &fpi_archive_chunk,
+        },
+        {
+            CLIARG_ONOFF,
+            ".psd_on",
+            "Power spectral densities ON/OFF",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&psd,
+            &fpi_psd,
+        },
+        {
+            CLIARG_STR,
+            ".psd_channels",
+            "Channels to compute the PSD of (comma separated)",
+            "ttm_x,ttm_y,residual_rms",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&psd_channels,
+            &fpi_psd_channels,
+        },
+        {
+            CLIARG_INT64,
+            ".psd_nfft",
+            "Number of samples per PSD segment",
+            "512",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&psd_nfft,
+            &fpi_psd_nfft,
+        },
+        {
+            CLIARG_INT64,
+            ".psd_segments",
+            "Number of averaged PSD segments (50% overlap)",
+            "8",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&psd_segments,
+            &fpi_psd_segments,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".psd_period",
+            "PSD update period [s]",
+            "1.0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&psd_period,
+            &fpi_psd_period,
+        },
+        {
+            CLIARG_STR,
+            ".quantiles",
+            "Quantiles to publish (comma separated)",
+            "0.5,0.95,0.99",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&quantiles,
+            &fpi_quantiles,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".quantiles_window",
+            "Quantiles window [s]",
+            "60",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&quantiles_window,
+            &fpi_quantiles_window,
+        },
+        {
+            CLIARG_ONOFF,
+            ".quantiles_reset",
+            "Reset quantiles since start",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&quantiles_reset,
+            &fpi_quantiles_reset,
+        },
+        {
+            CLIARG_STR,
+            ".instance",
+            "Instance name, suffix of the output streams (empty for the main pipeline)",
+            "",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&instance,
+            &fpi_instance,
+        },
 };
 
 static CLICMDDATA CLIcmddata =
@@ -41,6 +231,43 @@ static CLICMDDATA CLIcmddata =
         CLICMD_FIELDS_DEFAULTS,
 };
 
+/*
+ * State of one instance: parameters point into the FPS of the instance and
+ * streams get its .instance suffix (see instance.h).
+ * Instances run side by side as separate processes, the milk process loop
+ * is bound to data.fpsptr.
+ */
+typedef struct
+{
+    FUNCTION_PARAMETER_STRUCT *fps;
+    char *instance;
+
+    char *TTMin_streamname;
+    char *channels_fname;
+    char *archive_dir;
+    int64_t *archive_chunk;
+    char *psd_channels;
+    int64_t *psd_nfft;
+    int64_t *psd_segments;
+    float *psd_period;
+    char *quantiles;
+    float *quantiles_window;
+    float *sampling_rate;
+
+    char telemetry_streamname[KALAO_STREAMNAME_LEN];
+    char ns_streamname[KALAO_STREAMNAME_LEN];
+    char x10_streamname[KALAO_STREAMNAME_LEN];
+    char x100_streamname[KALAO_STREAMNAME_LEN];
+    char s1_streamname[KALAO_STREAMNAME_LEN];
+    char quantiles_streamname[KALAO_STREAMNAME_LEN];
+    char psd_streamname[KALAO_STREAMNAME_LEN];
+    char timers_streamname[KALAO_STREAMNAME_LEN];
+
+    // statistics of the SHWFS instance with the same .instance, for the default channels
+    char stats_streamname[KALAO_STREAMNAME_LEN];
+
+} TELEMETRY_GATHER_CONTEXT;
+
 /* ================================================================== */
 /* ================================================================== */
 /*  FUNCTIONS                                                         */
@@ -53,100 +280,395 @@ static errno_t help_function() {
 
 static errno_t customCONFsetup() {
     if (data.fpsptr != NULL) {
-        // Nothing
+        data.fpsptr->parray[fpi_sampling_rate].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_sampling_rate].val.f32[1] = 0;
+
+        data.fpsptr->parray[fpi_archive].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_archive_chunk].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_archive_chunk].val.i64[1] = 1;
+
+        data.fpsptr->parray[fpi_psd].fpflag |= FPFLAG_WRITERUN;
+
+        data.fpsptr->parray[fpi_psd_nfft].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_psd_nfft].fpflag |= FPFLAG_MAXLIMIT;
+        data.fpsptr->parray[fpi_psd_nfft].val.i64[1] = 16;
+        data.fpsptr->parray[fpi_psd_nfft].val.i64[2] = DATAPOINTS / 2;
+
+        data.fpsptr->parray[fpi_psd_segments].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_psd_segments].val.i64[1] = 1;
+
+        data.fpsptr->parray[fpi_psd_period].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_psd_period].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_psd_period].val.f32[1] = 0.1;
+
+        data.fpsptr->parray[fpi_quantiles_window].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_quantiles_window].val.f32[1] = 1;
+
+        data.fpsptr->parray[fpi_quantiles_reset].fpflag |= FPFLAG_WRITERUN;
     }
 
     return RETURN_SUCCESS;
 }
 
+static void load_default_channels(TELEMETRY_GATHER_CONTEXT *ctx, TELEMETRY_REGISTRY *registry) {
+    char line[512];
+
+    sprintf(line, "STREAM ttm_x %s 0", ctx->TTMin_streamname);
+    telemetry_registry_add(registry, line);
+
+    sprintf(line, "STREAM ttm_y %s 1", ctx->TTMin_streamname);
+    telemetry_registry_add(registry, line);
+
+    const char *stats_fields[] = {"flux_avg", "flux_max", "residual_rms", "slope_x_avg", "slope_y_avg"};
+
+    for (int f = 0; f < (int)(sizeof(stats_fields) / sizeof(stats_fields[0])); f++) {
+        sprintf(line, "STATS %s %s %s", stats_fields[f], ctx->stats_streamname, stats_fields[f]);
+        telemetry_registry_add(registry, line);
+    }
+}
+
+static void write_row_header(IMAGE *image, int row, const char *name, const char *source) {
+    IMAGE_KEYWORD *kw = &image->kw[NB_CURSOR_KW + row];
+
+    sprintf(kw->name, "ROW%02d", row);
+    kw->type = 'S';
+    strncpy(kw->value.valstr, name, sizeof(kw->value.valstr) - 1);
+    kw->value.valstr[sizeof(kw->value.valstr) - 1] = '\0';
+    strncpy(kw->comment, source, sizeof(kw->comment) - 1);
+    kw->comment[sizeof(kw->comment) - 1] = '\0';
+}
+
+static int start_sampling_timer(double rate) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+
+    if (fd == -1) {
+        perror("Unable to create sampling timer");
+        return -1;
+    }
+
+    int64_t period_ns = llround(1e9 / rate);
+    struct itimerspec spec;
+
+    // Absolute deadlines: ticks do not drift with the loop execution time
+    clock_gettime(CLOCK_MONOTONIC, &spec.it_value);
+    spec.it_value.tv_sec += 1;
+    spec.it_value.tv_nsec = 0;
+    spec.it_interval.tv_sec = period_ns / 1000000000;
+    spec.it_interval.tv_nsec = period_ns % 1000000000;
+
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        perror("Unable to start sampling timer");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void context_init(TELEMETRY_GATHER_CONTEXT *ctx, FUNCTION_PARAMETER_STRUCT *fps) {
+    ctx->fps = fps;
+    ctx->instance = fps->parray[fpi_instance].val.string[0];
+
+    ctx->TTMin_streamname = fps->parray[fpi_TTMin_streamname].val.string[0];
+    ctx->channels_fname = fps->parray[fpi_channels_fname].val.string[0];
+    ctx->archive_dir = fps->parray[fpi_archive_dir].val.string[0];
+    ctx->archive_chunk = &fps->parray[fpi_archive_chunk].val.i64[0];
+    ctx->psd_channels = fps->parray[fpi_psd_channels].val.string[0];
+    ctx->psd_nfft = &fps->parray[fpi_psd_nfft].val.i64[0];
+    ctx->psd_segments = &fps->parray[fpi_psd_segments].val.i64[0];
+    ctx->psd_period = &fps->parray[fpi_psd_period].val.f32[0];
+    ctx->quantiles = fps->parray[fpi_quantiles].val.string[0];
+    ctx->quantiles_window = &fps->parray[fpi_quantiles_window].val.f32[0];
+    ctx->sampling_rate = &fps->parray[fpi_sampling_rate].val.f32[0];
+
+    kalao_instance_name(ctx->telemetry_streamname, ctx->instance, "kalao_telemetry");
+    kalao_instance_name(ctx->ns_streamname, ctx->instance, "kalao_telemetry_ns");
+    kalao_instance_name(ctx->x10_streamname, ctx->instance, "kalao_telemetry_x10");
+    kalao_instance_name(ctx->x100_streamname, ctx->instance, "kalao_telemetry_x100");
+    kalao_instance_name(ctx->s1_streamname, ctx->instance, "kalao_telemetry_1s");
+    kalao_instance_name(ctx->quantiles_streamname, ctx->instance, "kalao_telemetry_quantiles");
+    kalao_instance_name(ctx->psd_streamname, ctx->instance, "kalao_telemetry_psd");
+    kalao_instance_name(ctx->timers_streamname, ctx->instance, "kalao_telemetry_timers");
+    kalao_instance_name(ctx->stats_streamname, ctx->instance, "shwfs_stats");
+}
+
 static errno_t compute_function() {
     DEBUG_TRACE_FSTART();
 
+    TELEMETRY_GATHER_CONTEXT ctx;
+    context_init(&ctx, data.fpsptr);
+
     INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
 
-    /********** Open fps **********/
+    /********** Resolve channels **********/
 
-    FUNCTION_PARAMETER_STRUCT shwfs_fps;
+    processinfo_WriteMessage(processinfo, "Resolving channels");
 
-    function_parameter_struct_connect("shwfs_process-1", &shwfs_fps, FPSCONNECT_SIMPLE);
+    TELEMETRY_REGISTRY registry;
 
-    float *flux_avg = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, "flux_avg");
-    float *flux_max = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, "flux_max");
-    float *residual_rms = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, "residual_rms");
-    float *slope_x_avg = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, "slope_x_avg");
-    float *slope_y_avg = functionparameter_GetParamPtr_FLOAT32(&shwfs_fps, "slope_y_avg");
+    telemetry_registry_init(&registry);
 
-    /********** Open streams **********/
+    if (strlen(ctx.channels_fname) > 0) {
+        telemetry_registry_load(&registry, ctx.channels_fname);
+    } else {
+        load_default_channels(&ctx, &registry);
+    }
 
-    processinfo_WriteMessage(processinfo, "Connecting to streams");
+    int NBchannels = registry.NBchannels;
 
-    imageID TTMinID = image_ID(TTMin_streamname);
+    // Two timestamp rows followed by the channels
+    int NBrows = 2 + NBchannels;
 
     /********** Allocate streams **********/
 
     processinfo_WriteMessage(processinfo, "Allocating streams");
 
     // Identifiers for output streams
-    imageID outID = image_ID("kalao_telemetry");
+    imageID outID = image_ID(ctx.telemetry_streamname);
 
     uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
     {
         // slopes
         imsizearray[0] = DATAPOINTS;
-        imsizearray[1] = 9;
-        create_image_ID("kalao_telemetry", 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &outID);
+        imsizearray[1] = NBrows;
+        create_image_ID(ctx.telemetry_streamname, 2, imsizearray, _DATATYPE_FLOAT, 1, NB_CURSOR_KW + NBrows, 0, &outID);
 
         free(imsizearray);
     }
 
-    for (int i = 0; i < 9 * DATAPOINTS; i++) {
+    for (int i = 0; i < NBrows * DATAPOINTS; i++) {
         data.image[outID].array.F[i] = 0;
     }
 
+    // Sample times [ns since epoch], same index as kalao_telemetry
+    imageID nsID = image_ID(ctx.ns_streamname);
+
+    imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+    {
+        imsizearray[0] = DATAPOINTS;
+        imsizearray[1] = 1;
+        create_image_ID(ctx.ns_streamname, 2, imsizearray, _DATATYPE_INT64, 1, 0, 0, &nsID);
+
+        free(imsizearray);
+    }
+
+    for (int i = 0; i < DATAPOINTS; i++) {
+        data.image[nsID].array.SI64[i] = 0;
+    }
+
+    // Write cursor, see reader.h
+    IMAGE_KEYWORD *kw_samples = &data.image[outID].kw[0];
+    IMAGE_KEYWORD *kw_writepos = &data.image[outID].kw[1];
+
+    strcpy(kw_samples->name, TELEMETRY_KW_SAMPLES);
+    kw_samples->type = 'L';
+    kw_samples->value.numl = 0;
+    strcpy(kw_samples->comment, "Number of samples written");
+
+    strcpy(kw_writepos->name, TELEMETRY_KW_WRITEPOS);
+    kw_writepos->type = 'L';
+    kw_writepos->value.numl = -1;
+    strcpy(kw_writepos->comment, "Index of last written sample");
+
+    // Row header, so that consumers can discover the layout
+    write_row_header(&data.image[outID], 0, "timestamp_off", "Timestamp offset [s]");
+    write_row_header(&data.image[outID], 1, "timestamp", "Timestamp relative to offset [s]");
+
+    for (int ch = 0; ch < NBchannels; ch++) {
+        write_row_header(&data.image[outID], 2 + ch, registry.channels[ch].name, registry.channels[ch].source);
+    }
+
+    // Reduced resolution rings: every 10 samples, every 100 samples, every second
+    TELEMETRY_RING rings[NB_RINGS];
+
+    telemetry_ring_create(&rings[0], ctx.x10_streamname, NBchannels, DATAPOINTS, 10, 0);
+    telemetry_ring_create(&rings[1], ctx.x100_streamname, NBchannels, DATAPOINTS, 100, 0);
+    telemetry_ring_create(&rings[2], ctx.s1_streamname, NBchannels, DATAPOINTS, 0, 1.0);
+
+    // Percentiles over a sliding window and since start, published every second
+    TELEMETRY_QUANTILES tq;
+
+    telemetry_quantiles_create(&tq, ctx.quantiles_streamname, registry.channels, NBchannels, ctx.quantiles, *ctx.quantiles_window, 1.0);
+
+    // Archiving runs in its own thread and only reads the stream
+    TELEMETRY_ARCHIVER archiver;
+
+    telemetry_archiver_start(&archiver, &data.image[outID], ctx.archive_dir, *ctx.archive_chunk, &ctx.fps->parray[fpi_archive].fpflag, FPFLAG_ONOFF);
+
+    // Spectra are computed in a low priority thread from the stream
+    TELEMETRY_PSD spectra;
+
+    telemetry_psd_start(&spectra, &data.image[outID], ctx.psd_streamname, ctx.psd_channels, *ctx.psd_nfft, *ctx.psd_segments, ctx.psd_period, &ctx.fps->parray[fpi_psd].fpflag, FPFLAG_ONOFF);
+
     /********** Loop **********/
 
     struct timespec ts;
     double timestamp;
+    int64_t timestamp_ns;
+    float *values = (float *)malloc(sizeof(float) * NBchannels);
     int i = 0;
+    uint64_t samples = 0;
+    uint64_t lost_records = 0;
 
     timespec_get(&ts, TIME_UTC);
 
     float timestamp_offset_float = (float)ts.tv_sec;
+    int64_t timestamp_offset_ns = (int64_t)timestamp_offset_float * 1000000000;
+
+    // Fixed rate sampling, independent of the loop rate
+    int timerfd = -1;
+    uint64_t missed_ticks = 0;
+
+    if (*ctx.sampling_rate > 0) {
+        timerfd = start_sampling_timer(*ctx.sampling_rate);
+    }
+
+    if (timerfd != -1) {
+        processinfo->triggermode = PROCESSINFO_TRIGGERMODE_IMMEDIATE;
+    }
+
+    KALAO_SECTIONS(timers, ctx.timers_streamname, "snapshot", "publication");
 
     processinfo_WriteMessage(processinfo, "Looping");
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
 
-    /***** Write flux stream *****/
+    if (ctx.fps->parray[fpi_quantiles_reset].fpflag & FPFLAG_ONOFF) {
+        telemetry_quantiles_reset(&tq);
 
-    data.image[outID].md->write = 1;
+        ctx.fps->parray[fpi_quantiles_reset].fpflag &= ~FPFLAG_ONOFF;
+        ctx.fps->parray[fpi_quantiles_reset].cnt0++;
+    }
 
-    timespec_get(&ts, TIME_UTC);
+    /***** Wait for next tick *****/
+
+    if (timerfd != -1) {
+        uint64_t expirations;
+
+        if (read(timerfd, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations > 1) {
+            missed_ticks += expirations - 1;
+        }
+    }
+
+    KALAO_SECTION_START(timers);
+
+    /***** Collect statistics records *****/
+
+    // One sample per WFS frame if statistics records are used, one per trigger or tick otherwise
+    int per_record = registry.statsID != -1 && timerfd == -1;
+    uint64_t NBsamples = 1;
+
+    if (per_record) {
+        NBsamples = telemetry_registry_pending_stats(&registry);
+    } else if (registry.statsID != -1) {
+        // Statistics channels hold the latest record
+        for (uint64_t pending = telemetry_registry_pending_stats(&registry); pending > 0; pending--) {
+            if (telemetry_registry_read_stats(&registry) != 0) {
+                lost_records++;
+            }
+        }
+    }
+
+    for (uint64_t sample = 0; sample < NBsamples; sample++) {
+        /***** Write telemetry stream *****/
+
+        if (per_record) {
+            if (telemetry_registry_read_stats(&registry) != 0) {
+                lost_records++;
+                continue;
+            }
+
+            // Sample time is the WFS frame time
+            timestamp_ns = llround(registry.stats_record[SHWFS_STATS_TIME] * 1e9);
+        } else {
+            clock_gettime(CLOCK_REALTIME, &ts);
+
+            timestamp_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+
+        // Note: splitting timestamp in a big integer part representable by a float32
+        // and a small non-integer part also representable by a float32
+        timestamp = 1e-9 * (timestamp_ns - timestamp_offset_ns);
+
+        data.image[outID].md->write = 1;
+        data.image[nsID].md->write = 1;
+
+        telemetry_channels_snapshot(registry.channels, NBchannels, values);
+
+        KALAO_SECTION_LAP(timers, SECTION_SNAPSHOT);
+
+        // clang-format off
+        data.image[outID].array.F[                 i] = timestamp_offset_float;
+        data.image[outID].array.F[    DATAPOINTS + i] = (float) timestamp;
+        // clang-format on
+
+        for (int ch = 0; ch < NBchannels; ch++) {
+            data.image[outID].array.F[(2 + ch) * DATAPOINTS + i] = values[ch];
+        }
+
+        data.image[nsID].array.SI64[i] = timestamp_ns;
+
+        // Published after the data so that readers never see an unwritten sample
+        samples += 1;
 
-    // Note: splitting timestamp in a big integer part representable by a float32
-    // and a small non-integer part also representable by a float32
-    timestamp = 1.0 * ts.tv_sec + 0.000000001 * ts.tv_nsec - timestamp_offset_float;
+        data.image[outID].md->cnt1 = i;
+        __atomic_store_n(&kw_writepos->value.numl, i, __ATOMIC_RELEASE);
+        __atomic_store_n(&kw_samples->value.numl, samples, __ATOMIC_RELEASE);
 
-    // clang-format off
-    data.image[outID].array.F[                 i] = timestamp_offset_float;
-    data.image[outID].array.F[    DATAPOINTS + i] = (float) timestamp;
-    data.image[outID].array.F[2 * DATAPOINTS + i] = data.image[TTMinID].array.F[0];
-    data.image[outID].array.F[3 * DATAPOINTS + i] = data.image[TTMinID].array.F[1];
-    data.image[outID].array.F[4 * DATAPOINTS + i] = *flux_avg;
-    data.image[outID].array.F[5 * DATAPOINTS + i] = *flux_max;
-    data.image[outID].array.F[6 * DATAPOINTS + i] = *residual_rms;
-    data.image[outID].array.F[7 * DATAPOINTS + i] = *slope_x_avg;
-    data.image[outID].array.F[8 * DATAPOINTS + i] = *slope_y_avg;
-    // clang-format on
+        data.image[nsID].md->cnt1 = i;
+        processinfo_update_output_stream(processinfo, nsID);
 
-    processinfo_update_output_stream(processinfo, outID);
+        processinfo_update_output_stream(processinfo, outID);
 
-    i += 1;
-    i %= DATAPOINTS;
+        /***** Reduced resolution rings *****/
+
+        for (int r = 0; r < NB_RINGS; r++) {
+            telemetry_ring_add(processinfo, &rings[r], timestamp_offset_float, timestamp, values);
+        }
+
+        telemetry_quantiles_add(processinfo, &tq, timestamp, values);
+
+        i += 1;
+        i %= DATAPOINTS;
+
+        KALAO_SECTION_LAP(timers, SECTION_PUBLICATION);
+    }
 
     INSERT_STD_PROCINFO_COMPUTEFUNC_END
 
-    function_parameter_struct_disconnect(&shwfs_fps);
+    telemetry_archiver_stop(&archiver);
+    telemetry_psd_stop(&spectra);
+
+    if (archiver.lost > 0) {
+        printf("%lu samples not archived\n", archiver.lost);
+    }
+
+    if (archiver.restarts > 0) {
+        printf("%lu telemetry restarts while archiving\n", archiver.restarts);
+    }
+
+    if (timerfd != -1) {
+        close(timerfd);
+    }
+
+    if (missed_ticks > 0) {
+        printf("%lu sampling ticks missed\n", missed_ticks);
+    }
+
+    if (lost_records > 0) {
+        printf("%lu statistics records lost\n", lost_records);
+    }
+
+    telemetry_registry_close(&registry);
+
+    free(values);
+
+    for (int r = 0; r < NB_RINGS; r++) {
+        telemetry_ring_free(&rings[r]);
+    }
+
+    telemetry_quantiles_free(&tq);
 
     DEBUG_TRACE_FEXIT();
 
@@ -0,0 +1,107 @@
+#ifndef _MILK_KALAO_TELEMETRY_HISTOGRAM_H
+#define _MILK_KALAO_TELEMETRY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Log-linear histogram of durations in nanoseconds.
+ *
+ * Values below KALAO_HISTOGRAM_SUB are stored exactly, above that each power
+ * of two is split in KALAO_HISTOGRAM_SUB bins (12.5% relative resolution).
+ * Recording is O(1) and there is a single writer, so no lock is needed:
+ * fields are written with atomic stores so that readers (possibly in another
+ * process through shared memory) never see torn values.
+ */
+
+#define KALAO_HISTOGRAM_SUBBITS 3
+#define KALAO_HISTOGRAM_SUB (1 << KALAO_HISTOGRAM_SUBBITS)
+#define KALAO_HISTOGRAM_NBBINS (64 * KALAO_HISTOGRAM_SUB)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t bins[KALAO_HISTOGRAM_NBBINS];
+
+} KALAO_HISTOGRAM;
+
+static inline int kalao_histogram_bin(uint64_t value) {
+    if (value < KALAO_HISTOGRAM_SUB) {
+        return (int)value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - KALAO_HISTOGRAM_SUBBITS;
+
+    return ((shift + 1) << KALAO_HISTOGRAM_SUBBITS) + (int)((value >> shift) & (KALAO_HISTOGRAM_SUB - 1));
+}
+
+// Upper (exclusive) bound of the values stored in a bin
+static inline uint64_t kalao_histogram_bin_upper(int bin) {
+    if (bin < 2 * KALAO_HISTOGRAM_SUB) {
+        return (uint64_t)bin + 1;
+    }
+
+    int shift = (bin >> KALAO_HISTOGRAM_SUBBITS) - 1;
+
+    return (uint64_t)(KALAO_HISTOGRAM_SUB + (bin & (KALAO_HISTOGRAM_SUB - 1)) + 1) << shift;
+}
+
+static inline void kalao_histogram_reset(KALAO_HISTOGRAM *hist) {
+    // Note: DO NOT use memset() as the histogram may live in shared memory
+    for (int bin = 0; bin < KALAO_HISTOGRAM_NBBINS; bin++)
+        __atomic_store_n(&hist->bins[bin], 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, 0, __ATOMIC_RELEASE);
+}
+
+static inline void kalao_histogram_record(KALAO_HISTOGRAM *hist, uint64_t value) {
+    int bin = kalao_histogram_bin(value);
+
+    __atomic_store_n(&hist->bins[bin], hist->bins[bin] + 1, __ATOMIC_RELAXED);
+
+    if (value > hist->max) {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+// Value below which a fraction q of the samples lie (upper bound of the bin)
+static inline uint64_t kalao_histogram_percentile(KALAO_HISTOGRAM *hist, double q) {
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(q * count);
+    if (target < 1) {
+        target = 1;
+    }
+
+    uint64_t cumsum = 0;
+
+    for (int bin = 0; bin < KALAO_HISTOGRAM_NBBINS; bin++) {
+        cumsum += __atomic_load_n(&hist->bins[bin], __ATOMIC_RELAXED);
+
+        if (cumsum >= target) {
+            uint64_t upper = kalao_histogram_bin_upper(bin);
+            return upper < max ? upper : max;
+        }
+    }
+
+    return max;
+}
+
+static inline uint64_t kalao_timespec_diff_ns(struct timespec *t0, struct timespec *t1) {
+    int64_t dt = (int64_t)(t1->tv_sec - t0->tv_sec) * 1000000000 + (t1->tv_nsec - t0->tv_nsec);
+
+    return dt > 0 ? (uint64_t)dt : 0;
+}
+
+#endif
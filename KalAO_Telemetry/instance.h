@@ -0,0 +1,28 @@
+#ifndef _MILK_KALAO_TELEMETRY_INSTANCE_H
+#define _MILK_KALAO_TELEMETRY_INSTANCE_H
+
+#include <stdio.h>
+
+/*
+ * Names of the streams of a command instance.
+ *
+ * Instances of a command are told apart by their .instance parameter, and
+ * their output streams get it as suffix: shwfs_slopes -> shwfs_slopes_truth
+ * for instance "truth". The parameter is empty by default, so the main
+ * pipeline keeps the plain names whatever its FPS is called. Temporary
+ * streams used to load files get the suffix too, so that instances running
+ * at the same time do not load into the same stream.
+ */
+
+// Same size as the stream names in ImageStreamIO
+#define KALAO_STREAMNAME_LEN 80
+
+static inline void kalao_instance_name(char *name, const char *instance, const char *base) {
+    if (instance[0] == '\0') {
+        snprintf(name, KALAO_STREAMNAME_LEN, "%s", base);
+    } else {
+        snprintf(name, KALAO_STREAMNAME_LEN, "%s_%s", base, instance);
+    }
+}
+
+#endif
@@ -0,0 +1,506 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+/*
+ * Microbenchmarks of the loop kernels on synthetic data, without CLIcore,
+ * FPS or streams.
+ *
+ *   kalao_bench [-r reps] [-n iterations] [-p cpu] [-o baseline] [-c baseline] [-t tolerance] [kernel...]
+ *
+ * Each kernel runs reps x iterations times, the median over the reps is
+ * reported. -o saves the results as a baseline, -c compares with a saved
+ * baseline and exits with status 1 if a kernel is slower by more than the
+ * tolerance (in %, default 5).
+ */
+
+#define _GNU_SOURCE
+
+#include "KalAO_BMC/command.h"
+#include "KalAO_Nuvu/calibration.h"
+#include "KalAO_SHWFS/centroid.h"
+#include "channels.h"
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+#define MAXNB_REPS 1000
+#define MAXNB_BASELINE 64
+
+// Spots on a regular grid of 4x4 subapertures
+#define BENCH_SPOTS_NX 11
+#define BENCH_SPOTS_PITCH 5
+#define BENCH_SPOTS_OFFSET 4
+
+#define BENCH_NB_CHANNELS 16
+#define BENCH_NB_REDUCTIONS 4
+
+typedef struct
+{
+    // synthetic inputs
+    uint16_t *raw;
+    float *bias;
+    float *flat;
+    float *frame;
+    float *bias_out;
+    NUVU_HISTOGRAM *histogram;
+
+    SHWFS_SPOTS *spots;
+    int NBspot;
+    float *wfsref;
+
+    float dm_input[NB_ACTUATORS];
+    float ttm_input[NB_TTM_CHANNELS];
+    double dm_array[BMC_ARRAY_SIZE];
+
+    float slopes[2 * BENCH_SPOTS_NX * BENCH_SPOTS_NX];
+    TELEMETRY_CHANNEL channels[BENCH_NB_CHANNELS + BENCH_NB_REDUCTIONS];
+    float values[BENCH_NB_CHANNELS + BENCH_NB_REDUCTIONS];
+
+    // keeps the results alive
+    volatile float sink;
+
+} BENCH_DATA;
+
+typedef struct
+{
+    const char *name;
+    void (*run)(BENCH_DATA *bench);
+
+    // elements processed per frame (pixels, actuators, channels)
+    int (*elements)(BENCH_DATA *bench);
+    const char *unit;
+
+} BENCH_KERNEL;
+
+typedef struct
+{
+    char name[64];
+    double ns;
+
+} BENCH_BASELINE;
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static inline uint64_t bench_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline int64_t bench_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void bench_init(BENCH_DATA *bench, unsigned int seed) {
+    srand(seed);
+
+    bench->raw = (uint16_t *)aligned_alloc(64, sizeof(uint16_t) * WIDTH_IN * HEIGHT_IN);
+    bench->bias = (float *)aligned_alloc(64, sizeof(float) * WIDTH * HEIGHT);
+    bench->flat = (float *)aligned_alloc(64, sizeof(float) * WIDTH * HEIGHT);
+    bench->frame = (float *)aligned_alloc(64, sizeof(float) * WIDTH * HEIGHT);
+    bench->bias_out = (float *)aligned_alloc(64, sizeof(float) * WIDTH * HEIGHT);
+    bench->histogram = (NUVU_HISTOGRAM *)aligned_alloc(64, sizeof(NUVU_HISTOGRAM));
+
+    for (int i = 0; i < WIDTH_IN * HEIGHT_IN; i++)
+        bench->raw[i] = 1000 + rand() % 4000;
+
+    for (int i = 0; i < WIDTH * HEIGHT; i++) {
+        bench->bias[i] = 1000 + rand() % 10;
+        bench->flat[i] = 0.9 + 0.2 * rand() / RAND_MAX;
+    }
+
+    nuvu_calibrate(bench->raw, bench->bias, bench->flat, NUVU_BIAS_STATIC, bench->frame, bench->bias_out);
+
+    // Spots
+    bench->spots = (SHWFS_SPOTS *)malloc(sizeof(SHWFS_SPOTS) * MAXNB_SPOT);
+    bench->NBspot = 0;
+
+    for (int y = 0; y < BENCH_SPOTS_NX; y++) {
+        for (int x = 0; x < BENCH_SPOTS_NX; x++) {
+            SHWFS_SPOTS *spot = &bench->spots[bench->NBspot++];
+
+            spot->Xraw = BENCH_SPOTS_OFFSET + x * BENCH_SPOTS_PITCH;
+            spot->Yraw = BENCH_SPOTS_OFFSET + y * BENCH_SPOTS_PITCH;
+            spot->Xout = x;
+            spot->Yout = y;
+        }
+    }
+
+    uint32_t sizeoutX, sizeoutY;
+    shwfs_spots_layout(bench->spots, bench->NBspot, &sizeoutX, &sizeoutY);
+
+    bench->wfsref = (float *)calloc(2 * sizeoutX * sizeoutY, sizeof(float));
+
+    // DM
+    for (int ii = 0; ii < NB_ACTUATORS; ii++)
+        bench->dm_input[ii] = 0.5 * rand() / RAND_MAX - 0.25;
+
+    bench->ttm_input[0] = 0.1;
+    bench->ttm_input[1] = -0.1;
+
+    for (int ii = 0; ii < BMC_ARRAY_SIZE; ii++)
+        bench->dm_array[ii] = 0;
+
+    // Telemetry: scalar channels and reductions over the slopes
+    for (int i = 0; i < 2 * BENCH_SPOTS_NX * BENCH_SPOTS_NX; i++)
+        bench->slopes[i] = (float)rand() / RAND_MAX - 0.5;
+
+    for (int ch = 0; ch < BENCH_NB_CHANNELS; ch++) {
+        TELEMETRY_CHANNEL *channel = &bench->channels[ch];
+
+        memset(channel, 0, sizeof(TELEMETRY_CHANNEL));
+        channel->type = TELEMETRY_CHANNEL_FLOAT;
+        channel->ptr = &bench->slopes[ch];
+    }
+
+    TELEMETRY_CHANNEL_TYPE reductions[BENCH_NB_REDUCTIONS] = {TELEMETRY_CHANNEL_MEAN, TELEMETRY_CHANNEL_SUM, TELEMETRY_CHANNEL_MIN, TELEMETRY_CHANNEL_MAX};
+
+    for (int r = 0; r < BENCH_NB_REDUCTIONS; r++) {
+        TELEMETRY_CHANNEL *channel = &bench->channels[BENCH_NB_CHANNELS + r];
+
+        memset(channel, 0, sizeof(TELEMETRY_CHANNEL));
+        channel->type = reductions[r];
+        channel->ptr = bench->slopes;
+        channel->stride = 2 * BENCH_SPOTS_NX;
+        channel->x0 = 0;
+        channel->y0 = 0;
+        channel->x1 = 2 * BENCH_SPOTS_NX - 1;
+        channel->y1 = BENCH_SPOTS_NX - 1;
+    }
+}
+
+static void bench_free(BENCH_DATA *bench) {
+    free(bench->raw);
+    free(bench->bias);
+    free(bench->flat);
+    free(bench->frame);
+    free(bench->bias_out);
+    free(bench->histogram);
+    free(bench->spots);
+    free(bench->wfsref);
+}
+
+/***** Kernels *****/
+
+static void run_nuvu_static(BENCH_DATA *bench) {
+    nuvu_calibrate(bench->raw, bench->bias, bench->flat, NUVU_BIAS_STATIC, bench->frame, bench->bias_out);
+    bench->sink = bench->frame[0];
+}
+
+static void run_nuvu_dynamic_mean(BENCH_DATA *bench) {
+    nuvu_calibrate(bench->raw, bench->bias, bench->flat, NUVU_BIAS_DYNAMIC_MEAN, bench->frame, bench->bias_out);
+    bench->sink = bench->frame[0];
+}
+
+static void run_nuvu_dynamic_bilinear(BENCH_DATA *bench) {
+    nuvu_calibrate(bench->raw, bench->bias, bench->flat, NUVU_BIAS_DYNAMIC_BILINEAR, bench->frame, bench->bias_out);
+    bench->sink = bench->frame[0];
+}
+
+static void run_nuvu_frame_stats(BENCH_DATA *bench) {
+    NUVU_FRAME_STATS stats;
+
+    nuvu_frame_stats(bench->raw, bench->histogram, &stats);
+    bench->sink = stats.p999;
+}
+
+static void run_shwfs_quadcell(BENCH_DATA *bench) {
+    SHWFS_CENTROID_STATS stats;
+
+    shwfs_centroid(bench->frame, WIDTH, bench->spots, bench->NBspot, SHWFS_ALGORITHM_QUADCELL, 300, bench->wfsref, NULL, &stats);
+    bench->sink = stats.residual_rms;
+}
+
+static void run_shwfs_com(BENCH_DATA *bench) {
+    SHWFS_CENTROID_STATS stats;
+
+    shwfs_centroid(bench->frame, WIDTH, bench->spots, bench->NBspot, SHWFS_ALGORITHM_COM, 300, bench->wfsref, NULL, &stats);
+    bench->sink = stats.residual_rms;
+}
+
+static void run_bmc_command(BENCH_DATA *bench) {
+    bmc_build_command(bench->dm_input, bench->ttm_input, 0.9, 1, 0.2, bench->dm_array);
+    bench->sink = bench->dm_array[0];
+}
+
+static void run_telemetry_snapshot(BENCH_DATA *bench) {
+    telemetry_channels_snapshot(bench->channels, BENCH_NB_CHANNELS + BENCH_NB_REDUCTIONS, bench->values);
+    bench->sink = bench->values[0];
+}
+
+static int elements_frame(BENCH_DATA *bench) {
+    return WIDTH * HEIGHT;
+}
+
+static int elements_spots(BENCH_DATA *bench) {
+    return bench->NBspot * 16;
+}
+
+static int elements_actuators(BENCH_DATA *bench) {
+    return NB_ACTUATORS + NB_TTM_CHANNELS;
+}
+
+static int elements_channels(BENCH_DATA *bench) {
+    return BENCH_NB_CHANNELS + BENCH_NB_REDUCTIONS;
+}
+
+static BENCH_KERNEL kernels[] = {
+    {"nuvu_static", run_nuvu_static, elements_frame, "px"},
+    {"nuvu_dynamic_mean", run_nuvu_dynamic_mean, elements_frame, "px"},
+    {"nuvu_dynamic_bilinear", run_nuvu_dynamic_bilinear, elements_frame, "px"},
+    {"nuvu_frame_stats", run_nuvu_frame_stats, elements_frame, "px"},
+    {"shwfs_quadcell", run_shwfs_quadcell, elements_spots, "px"},
+    {"shwfs_com", run_shwfs_com, elements_spots, "px"},
+    {"bmc_command", run_bmc_command, elements_actuators, "act"},
+    {"telemetry_snapshot", run_telemetry_snapshot, elements_channels, "ch"},
+};
+
+#define NB_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+/***** Measurement *****/
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+// Median over the reps of the time per frame [ns], cycles per frame in *cycles
+static double bench_kernel(BENCH_KERNEL *kernel, BENCH_DATA *bench, int reps, int iterations, double *cycles) {
+    double ns_reps[MAXNB_REPS];
+    double cycles_reps[MAXNB_REPS];
+
+    // Warm up caches and branch predictors
+    for (int it = 0; it < iterations; it++)
+        kernel->run(bench);
+
+    for (int rep = 0; rep < reps; rep++) {
+        int64_t t0 = bench_ns();
+        uint64_t c0 = bench_cycles();
+
+        for (int it = 0; it < iterations; it++)
+            kernel->run(bench);
+
+        uint64_t c1 = bench_cycles();
+        int64_t t1 = bench_ns();
+
+        ns_reps[rep] = (double)(t1 - t0) / iterations;
+        cycles_reps[rep] = (double)(c1 - c0) / iterations;
+    }
+
+    qsort(ns_reps, reps, sizeof(double), compare_double);
+    qsort(cycles_reps, reps, sizeof(double), compare_double);
+
+    *cycles = cycles_reps[reps / 2];
+
+    return ns_reps[reps / 2];
+}
+
+static int load_baseline(const char *fname, BENCH_BASELINE *baseline) {
+    FILE *fp = fopen(fname, "r");
+    if (fp == NULL) {
+        perror("Unable to open baseline");
+        return -1;
+    }
+
+    int NBbaseline = 0;
+    char line[256];
+
+    while (fgets(line, sizeof(line), fp) != NULL && NBbaseline < MAXNB_BASELINE) {
+        if (line[0] == '#') {
+            continue;
+        }
+
+        if (sscanf(line, "%63s %lf", baseline[NBbaseline].name, &baseline[NBbaseline].ns) == 2) {
+            NBbaseline++;
+        }
+    }
+
+    fclose(fp);
+
+    return NBbaseline;
+}
+
+static void usage(const char *progname) {
+    printf("Usage: %s [-r reps] [-n iterations] [-p cpu] [-o baseline] [-c baseline] [-t tolerance] [kernel...]\n", progname);
+    printf("Kernels:");
+
+    for (int k = 0; k < NB_KERNELS; k++)
+        printf(" %s", kernels[k].name);
+
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    int reps = 21;
+    int iterations = 10000;
+    int cpu = -1;
+    const char *save_fname = NULL;
+    const char *compare_fname = NULL;
+    double tolerance = 5;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:p:o:c:t:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'p':
+            cpu = atoi(optarg);
+            break;
+        case 'o':
+            save_fname = optarg;
+            break;
+        case 'c':
+            compare_fname = optarg;
+            break;
+        case 't':
+            tolerance = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (reps < 1 || reps > MAXNB_REPS || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+            perror("Unable to pin to CPU");
+        }
+    }
+
+    BENCH_BASELINE baseline[MAXNB_BASELINE];
+    int NBbaseline = 0;
+
+    if (compare_fname != NULL) {
+        NBbaseline = load_baseline(compare_fname, baseline);
+
+        if (NBbaseline < 0) {
+            return 1;
+        }
+    }
+
+    FILE *save_fp = NULL;
+
+    if (save_fname != NULL) {
+        save_fp = fopen(save_fname, "w");
+
+        if (save_fp == NULL) {
+            perror("Unable to open baseline");
+            return 1;
+        }
+
+        fprintf(save_fp, "# kernel ns/frame (%d reps x %d iterations)\n", reps, iterations);
+    }
+
+    BENCH_DATA *bench = (BENCH_DATA *)aligned_alloc(64, (sizeof(BENCH_DATA) + 63) & ~(size_t)63);
+    bench_init(bench, 42);
+
+    int regressions = 0;
+
+    printf("%-24s %12s %12s %14s %16s", "kernel", "ns/frame", "cycles/frame", "cycles/elem", "Melem/s");
+    if (NBbaseline > 0) {
+        printf(" %12s %8s", "baseline", "change");
+    }
+    printf("\n");
+
+    for (int k = 0; k < NB_KERNELS; k++) {
+        BENCH_KERNEL *kernel = &kernels[k];
+
+        if (optind < argc) {
+            int selected = 0;
+
+            for (int a = optind; a < argc; a++) {
+                if (strcmp(argv[a], kernel->name) == 0) {
+                    selected = 1;
+                }
+            }
+
+            if (!selected) {
+                continue;
+            }
+        }
+
+        double cycles;
+        double ns = bench_kernel(kernel, bench, reps, iterations, &cycles);
+        int elements = kernel->elements(bench);
+
+        char unit[32];
+        sprintf(unit, "M%s/s", kernel->unit);
+
+        printf("%-24s %12.1f %12.0f %10.2f/%-3s %11.1f %-4s", kernel->name, ns, cycles, cycles / elements, kernel->unit, elements / ns * 1e3, unit);
+
+        for (int b = 0; b < NBbaseline; b++) {
+            if (strcmp(baseline[b].name, kernel->name) == 0) {
+                double change = 100 * (ns - baseline[b].ns) / baseline[b].ns;
+
+                printf(" %12.1f %+7.1f%%", baseline[b].ns, change);
+
+                if (change > tolerance) {
+                    printf(" REGRESSION");
+                    regressions++;
+                }
+            }
+        }
+
+        printf("\n");
+
+        if (save_fp != NULL) {
+            fprintf(save_fp, "%s %.3f\n", kernel->name, ns);
+        }
+    }
+
+    if (save_fp != NULL) {
+        fclose(save_fp);
+    }
+
+    bench_free(bench);
+    free(bench);
+
+    if (regressions > 0) {
+        printf("%d kernel(s) slower than baseline by more than %.1f%%\n", regressions, tolerance);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,321 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+/*
+ * Python access to the KalAO streams.
+ *
+ * Arrays returned by this module are NumPy views on the shared memory of the
+ * streams: they are never copied and always show the current content. They
+ * keep the stream mapped for as long as they are alive.
+ *
+ *   import kalao_streams
+ *
+ *   telemetry = kalao_streams.Telemetry("kalao_telemetry")
+ *   telemetry.wait(1.0)
+ *   older, newer = telemetry.ordered()
+ *   flux = telemetry.rows["flux_avg"]
+ *
+ *   slopes = kalao_streams.Stream("shwfs_slopes")
+ *   dx, dy = kalao_streams.slopes(slopes)
+ *
+ *   timers = kalao_streams.section_timers(kalao_streams.Stream("shwfs_process_timers"))
+ */
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ImageStreamIO/ImageStreamIO.h"
+
+extern "C" {
+#include "histogram.h"
+#include "reader.h"
+}
+
+namespace py = pybind11;
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static py::dtype stream_dtype(uint8_t datatype) {
+    switch (datatype) {
+    case _DATATYPE_UINT8:
+        return py::dtype::of<uint8_t>();
+    case _DATATYPE_INT16:
+        return py::dtype::of<int16_t>();
+    case _DATATYPE_UINT16:
+        return py::dtype::of<uint16_t>();
+    case _DATATYPE_INT32:
+        return py::dtype::of<int32_t>();
+    case _DATATYPE_UINT32:
+        return py::dtype::of<uint32_t>();
+    case _DATATYPE_INT64:
+        return py::dtype::of<int64_t>();
+    case _DATATYPE_UINT64:
+        return py::dtype::of<uint64_t>();
+    case _DATATYPE_FLOAT:
+        return py::dtype::of<float>();
+    case _DATATYPE_DOUBLE:
+        return py::dtype::of<double>();
+    default:
+        throw std::runtime_error("Unsupported stream datatype");
+    }
+}
+
+class Stream {
+  public:
+    Stream(const std::string &name) {
+        if (ImageStreamIO_openIm(&image, name.c_str()) != IMAGESTREAMIO_SUCCESS) {
+            throw std::runtime_error("Unable to open stream " + name);
+        }
+
+        semindex = ImageStreamIO_getsemwaitindex(&image, -1);
+    }
+
+    ~Stream() {
+        ImageStreamIO_closeIm(&image);
+    }
+
+    Stream(const Stream &) = delete;
+    Stream &operator=(const Stream &) = delete;
+
+    // Full stream, shape (size[2],) size[1], size[0] (x is the fastest axis)
+    static py::array data(py::object self) {
+        Stream &stream = self.cast<Stream &>();
+        IMAGE_METADATA *md = stream.image.md;
+        py::dtype dtype = stream_dtype(md->datatype);
+
+        std::vector<ssize_t> shape;
+        for (int axis = md->naxis - 1; axis >= 0; axis--) {
+            shape.push_back(md->size[axis]);
+        }
+
+        // Base is the stream object, which keeps the shared memory mapped
+        return py::array(dtype, shape, stream.image.array.raw, self);
+    }
+
+    uint64_t cnt0() {
+        return __atomic_load_n(&image.md->cnt0, __ATOMIC_ACQUIRE);
+    }
+
+    uint64_t cnt1() {
+        return __atomic_load_n(&image.md->cnt1, __ATOMIC_ACQUIRE);
+    }
+
+    py::dict keywords() {
+        py::dict keywords;
+
+        for (int k = 0; k < image.md->NBkw; k++) {
+            IMAGE_KEYWORD *kw = &image.kw[k];
+
+            switch (kw->type) {
+            case 'L':
+                keywords[kw->name] = kw->value.numl;
+                break;
+            case 'D':
+                keywords[kw->name] = kw->value.numf;
+                break;
+            case 'S':
+                keywords[kw->name] = std::string(kw->value.valstr);
+                break;
+            }
+        }
+
+        return keywords;
+    }
+
+    /*
+     * Wait for the next update of the stream, at most timeout seconds.
+     * Updates posted before the call are ignored. Returns False on timeout.
+     */
+    bool wait(double timeout) {
+        sem_t *sem = image.semptr[semindex];
+
+        while (sem_trywait(sem) == 0) {
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        int64_t ns = deadline.tv_nsec + (int64_t)(timeout * 1e9);
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+
+        int ret;
+        {
+            py::gil_scoped_release release;
+
+            do {
+                ret = sem_timedwait(sem, &deadline);
+            } while (ret == -1 && errno == EINTR);
+        }
+
+        return ret == 0;
+    }
+
+    IMAGE image;
+    int semindex;
+};
+
+/*
+ * kalao_telemetry and the reduced resolution rings: circular buffers of
+ * shape (NBrows, NBsamples), cnt1 is the index of the last written sample.
+ */
+class Telemetry : public Stream {
+  public:
+    Telemetry(const std::string &name) : Stream(name) {
+        for (int k = 0; k < image.md->NBkw; k++) {
+            IMAGE_KEYWORD *kw = &image.kw[k];
+
+            if (strncmp(kw->name, "ROW", 3) == 0 && kw->type == 'S') {
+                rows[kw->value.valstr] = atoi(&kw->name[3]);
+            }
+        }
+
+        has_counter = telemetry_reader_init(&reader, &image) == 0;
+    }
+
+    // Number of samples written since start, if published by the writer
+    int64_t samples() {
+        return has_counter ? (int64_t)telemetry_reader_counter(&reader) : -1;
+    }
+
+    /*
+     * Time ordered views of the last n samples (all if n < 0), as two views
+     * (older, newer) of shape (NBrows, k): the ring wraps around between them.
+     * Oldest samples may be overwritten while the views are used.
+     */
+    static py::tuple ordered(py::object self, long n) {
+        Telemetry &telemetry = self.cast<Telemetry &>();
+        IMAGE_METADATA *md = telemetry.image.md;
+
+        ssize_t capacity = md->size[0];
+        ssize_t NBrows = md->size[1];
+        ssize_t last = __atomic_load_n(&md->cnt1, __ATOMIC_ACQUIRE);
+
+        if (n < 0 || n > capacity) {
+            n = capacity;
+        }
+
+        // Only samples actually written, when the counter is available
+        int64_t written = telemetry.samples();
+        if (written >= 0 && written < n) {
+            n = written;
+        }
+
+        py::dtype dtype = stream_dtype(md->datatype);
+        ssize_t itemsize = dtype.itemsize();
+        char *base = (char *)telemetry.image.array.raw;
+
+        ssize_t newer_count = n < last + 1 ? n : last + 1;
+        ssize_t older_count = n - newer_count;
+
+        std::vector<ssize_t> strides = {capacity * itemsize, itemsize};
+
+        py::array older(dtype, {NBrows, (ssize_t)older_count}, strides, base + (capacity - older_count) * itemsize, self);
+        py::array newer(dtype, {NBrows, (ssize_t)newer_count}, strides, base + (last + 1 - newer_count) * itemsize, self);
+
+        return py::make_tuple(older, newer);
+    }
+
+    TELEMETRY_READER reader;
+    bool has_counter;
+    std::map<std::string, int> rows;
+};
+
+/*
+ * shwfs_slopes holds dx and dy side by side, shape (NBy, 2 * NBx).
+ * Returns the two (NBy, NBx) views.
+ */
+static py::tuple slopes(py::object self) {
+    Stream &stream = self.cast<Stream &>();
+    IMAGE_METADATA *md = stream.image.md;
+
+    if (md->datatype != _DATATYPE_FLOAT || md->naxis != 2) {
+        throw std::runtime_error("Not a slopes stream");
+    }
+
+    ssize_t NBx = md->size[0] / 2;
+    ssize_t NBy = md->size[1];
+    float *base = stream.image.array.F;
+
+    std::vector<ssize_t> shape = {NBy, NBx};
+    std::vector<ssize_t> strides = {2 * NBx * (ssize_t)sizeof(float), sizeof(float)};
+
+    return py::make_tuple(py::array_t<float>(shape, strides, base, self),
+                          py::array_t<float>(shape, strides, base + NBx, self));
+}
+
+/*
+ * Section timers streams (section_timers.h): one KALAO_HISTOGRAM per row.
+ * Returns {section: {"count", "p50", "p99", "max"}}, durations in ns.
+ */
+static py::dict section_timers(py::object self) {
+    Stream &stream = self.cast<Stream &>();
+    IMAGE_METADATA *md = stream.image.md;
+
+    if (md->datatype != _DATATYPE_UINT64 || md->naxis != 2 || md->size[0] * sizeof(uint64_t) != sizeof(KALAO_HISTOGRAM)) {
+        throw std::runtime_error("Not a section timers stream");
+    }
+
+    KALAO_HISTOGRAM *hists = (KALAO_HISTOGRAM *)stream.image.array.UI64;
+    py::dict timers;
+
+    for (int k = 0; k < md->NBkw; k++) {
+        IMAGE_KEYWORD *kw = &stream.image.kw[k];
+
+        if (strncmp(kw->name, "ROW", 3) != 0 || kw->type != 'S') {
+            continue;
+        }
+
+        int row = atoi(&kw->name[3]);
+        if (row < 0 || row >= (int)md->size[1]) {
+            continue;
+        }
+
+        py::dict section;
+        section["count"] = __atomic_load_n(&hists[row].count, __ATOMIC_ACQUIRE);
+        section["p50"] = kalao_histogram_percentile(&hists[row], 0.50);
+        section["p99"] = kalao_histogram_percentile(&hists[row], 0.99);
+        section["max"] = __atomic_load_n(&hists[row].max, __ATOMIC_RELAXED);
+
+        timers[kw->value.valstr] = section;
+    }
+
+    return timers;
+}
+
+PYBIND11_MODULE(kalao_streams, m) {
+    m.doc() = "Zero-copy access to KalAO streams";
+
+    py::class_<Stream>(m, "Stream")
+        .def(py::init<const std::string &>(), py::arg("name"))
+        .def_property_readonly("data", &Stream::data, "NumPy view of the stream")
+        .def_property_readonly("cnt0", &Stream::cnt0, "Update counter")
+        .def_property_readonly("cnt1", &Stream::cnt1, "Last written index of circular buffers")
+        .def_property_readonly("keywords", &Stream::keywords)
+        .def("wait", &Stream::wait, py::arg("timeout"), "Wait for the next update, False on timeout");
+
+    py::class_<Telemetry, Stream>(m, "Telemetry")
+        .def(py::init<const std::string &>(), py::arg("name") = "kalao_telemetry")
+        .def_property_readonly("samples", &Telemetry::samples, "Number of samples written since start (-1 if unknown)")
+        .def_readonly("rows", &Telemetry::rows, "Row index of each channel")
+        .def("ordered", &Telemetry::ordered, py::arg("n") = -1, "Time ordered (older, newer) views of the last n samples");
+
+    m.def("slopes", &slopes, py::arg("stream"), "(dx, dy) views of shwfs_slopes");
+    m.def("section_timers", &section_timers, py::arg("stream"), "Duration statistics of the sections of a compute loop [ns]");
+}
@@ -0,0 +1,293 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "histogram.h"
+#include "trace.h"
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+/*
+ * End-to-end latency of the loop, from the frame trace of the DM commands
+ * (see trace.h). Triggered by bmc_commands_dm.
+ *
+ * kalao_latency stream: one row per stage, columns p50, p99 and max [us].
+ */
+
+enum {
+    LATENCY_STAGE_CAL,   // raw -> calibrated
+    LATENCY_STAGE_SLP,   // calibrated -> slopes
+    LATENCY_STAGE_DM,    // slopes -> DM sent
+    LATENCY_STAGE_TOTAL, // raw -> DM sent
+    LATENCY_NBSTAGES
+};
+
+static const char *latency_stage_names[LATENCY_NBSTAGES] = {
+    "raw_to_cal",
+    "cal_to_slopes",
+    "slopes_to_dm",
+    "raw_to_dm",
+};
+
+#define LATENCY_NBCOLUMNS 3
+
+static int64_t *update_period;
+static long fpi_update_period;
+
+static uint64_t *reset;
+static long fpi_reset;
+
+static int64_t *frames;
+static long fpi_frames;
+
+static int64_t *skipped;
+static long fpi_skipped;
+
+static float *total_p50;
+static long fpi_total_p50;
+
+static float *total_p99;
+static long fpi_total_p99;
+
+static CLICMDARGDEF farg[] =
+    {
+        {
+            CLIARG_INT64,
+            ".update_period",
+            "Number of frames between updates of kalao_latency",
+            "100",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&update_period,
+            &fpi_update_period,
+        },
+        {
+            CLIARG_ONOFF,
+            ".reset",
+            "Reset latency statistics",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&reset,
+            &fpi_reset,
+        },
+        {
+            CLIARG_INT64,
+            ".frames",
+            "Number of traced frames",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&frames,
+            &fpi_frames,
+        },
+        {
+            CLIARG_INT64,
+            ".skipped",
+            "Raw frames without matching DM command",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&skipped,
+            &fpi_skipped,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".total.p50",
+            "Raw frame to DM latency, median [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&total_p50,
+            &fpi_total_p50,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".total.p99",
+            "Raw frame to DM latency, 99th percentile [us]",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&total_p99,
+            &fpi_total_p99,
+        },
+};
+
+static CLICMDDATA CLIcmddata =
+    {
+        "latency",
+        "Per-stage loop latency from frame traces (triggered by bmc_commands_dm)",
+        CLICMD_FIELDS_DEFAULTS,
+};
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static errno_t help_function() {
+    return RETURN_SUCCESS;
+}
+
+static errno_t customCONFsetup() {
+    if (data.fpsptr != NULL) {
+        data.fpsptr->parray[fpi_update_period].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_update_period].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_update_period].val.i64[1] = 1; // min
+
+        data.fpsptr->parray[fpi_reset].fpflag |= FPFLAG_WRITERUN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static void publish(PROCESSINFO *processinfo, imageID outID, KALAO_HISTOGRAM *hists) {
+    float *array = data.image[outID].array.F;
+
+    data.image[outID].md->write = 1;
+
+    for (int stage = 0; stage < LATENCY_NBSTAGES; stage++) {
+        array[stage * LATENCY_NBCOLUMNS + 0] = kalao_histogram_percentile(&hists[stage], 0.50) / 1e3;
+        array[stage * LATENCY_NBCOLUMNS + 1] = kalao_histogram_percentile(&hists[stage], 0.99) / 1e3;
+        array[stage * LATENCY_NBCOLUMNS + 2] = hists[stage].max / 1e3;
+    }
+
+    processinfo_update_output_stream(processinfo, outID);
+
+    *total_p50 = array[LATENCY_STAGE_TOTAL * LATENCY_NBCOLUMNS + 0];
+    *total_p99 = array[LATENCY_STAGE_TOTAL * LATENCY_NBCOLUMNS + 1];
+
+    data.fpsptr->parray[fpi_total_p50].cnt0++;
+    data.fpsptr->parray[fpi_total_p99].cnt0++;
+}
+
+static errno_t compute_function() {
+    DEBUG_TRACE_FSTART();
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+
+    /********** Open streams **********/
+
+    processinfo_WriteMessage(processinfo, "Connecting to streams");
+
+    imageID inID = processinfo->triggerstreamID;
+    int trace_kw = kalao_trace_find(&data.image[inID]);
+
+    /********** Allocate streams **********/
+
+    processinfo_WriteMessage(processinfo, "Allocating streams");
+
+    imageID outID = image_ID("kalao_latency");
+    {
+        uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+
+        imsizearray[0] = LATENCY_NBCOLUMNS;
+        imsizearray[1] = LATENCY_NBSTAGES;
+        create_image_ID("kalao_latency", 2, imsizearray, _DATATYPE_FLOAT, 1, LATENCY_NBSTAGES, 0, &outID);
+
+        free(imsizearray);
+    }
+
+    for (int i = 0; i < LATENCY_NBCOLUMNS * LATENCY_NBSTAGES; i++) {
+        data.image[outID].array.F[i] = 0;
+    }
+
+    for (int stage = 0; stage < LATENCY_NBSTAGES; stage++) {
+        IMAGE_KEYWORD *kw = &data.image[outID].kw[stage];
+
+        sprintf(kw->name, "ROW%02d", stage);
+        kw->type = 'S';
+        strcpy(kw->value.valstr, latency_stage_names[stage]);
+        strcpy(kw->comment, "p50, p99, max [us]");
+    }
+
+    /********** Histograms **********/
+
+    KALAO_HISTOGRAM *hists = (KALAO_HISTOGRAM *)malloc(sizeof(KALAO_HISTOGRAM) * LATENCY_NBSTAGES);
+
+    for (int stage = 0; stage < LATENCY_NBSTAGES; stage++) {
+        kalao_histogram_reset(&hists[stage]);
+    }
+
+    /********** Loop **********/
+
+    KALAO_TRACE trace;
+    int64_t last_rawcnt0 = -1;
+    int64_t *t = trace.fields;
+
+    processinfo_WriteMessage(processinfo, "Looping");
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    if (data.fpsptr->parray[fpi_reset].fpflag & FPFLAG_ONOFF) {
+        for (int stage = 0; stage < LATENCY_NBSTAGES; stage++) {
+            kalao_histogram_reset(&hists[stage]);
+        }
+
+        *frames = 0;
+        *skipped = 0;
+
+        data.fpsptr->parray[fpi_frames].cnt0++;
+        data.fpsptr->parray[fpi_skipped].cnt0++;
+
+        data.fpsptr->parray[fpi_reset].fpflag &= ~FPFLAG_ONOFF;
+        data.fpsptr->parray[fpi_reset].cnt0++;
+    }
+
+    if (trace_kw == -1) {
+        trace_kw = kalao_trace_find(&data.image[inID]);
+    }
+
+    if (trace_kw != -1) {
+        kalao_trace_read(&data.image[inID], trace_kw, &trace);
+    }
+
+    // Commands sent again for the same raw frame (new gains, offsets) are not counted
+    if (trace_kw != -1 && t[KALAO_TRACE_RAWCNT0] != last_rawcnt0) {
+        int complete = t[KALAO_TRACE_T_RAW] > 0 && t[KALAO_TRACE_T_CAL] >= t[KALAO_TRACE_T_RAW] && t[KALAO_TRACE_T_SLP] >= t[KALAO_TRACE_T_CAL] && t[KALAO_TRACE_T_DM] >= t[KALAO_TRACE_T_SLP];
+
+        if (last_rawcnt0 != -1 && t[KALAO_TRACE_RAWCNT0] > last_rawcnt0 + 1) {
+            *skipped += t[KALAO_TRACE_RAWCNT0] - last_rawcnt0 - 1;
+            data.fpsptr->parray[fpi_skipped].cnt0++;
+        }
+
+        last_rawcnt0 = t[KALAO_TRACE_RAWCNT0];
+
+        if (complete) {
+            kalao_histogram_record(&hists[LATENCY_STAGE_CAL], t[KALAO_TRACE_T_CAL] - t[KALAO_TRACE_T_RAW]);
+            kalao_histogram_record(&hists[LATENCY_STAGE_SLP], t[KALAO_TRACE_T_SLP] - t[KALAO_TRACE_T_CAL]);
+            kalao_histogram_record(&hists[LATENCY_STAGE_DM], t[KALAO_TRACE_T_DM] - t[KALAO_TRACE_T_SLP]);
+            kalao_histogram_record(&hists[LATENCY_STAGE_TOTAL], t[KALAO_TRACE_T_DM] - t[KALAO_TRACE_T_RAW]);
+
+            *frames += 1;
+            data.fpsptr->parray[fpi_frames].cnt0++;
+
+            if (*frames % *update_period == 0) {
+                publish(processinfo, outID, hists);
+            }
+        }
+    }
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    free(hists);
+
+    DEBUG_TRACE_FEXIT();
+
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_KalAO_Telemetry__latency() {
+    CLIcmddata.FPS_customCONFsetup = customCONFsetup;
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef _MILK_KALAO_TELEMETRY_LATENCY_H
+#define _MILK_KALAO_TELEMETRY_LATENCY_H
+
+errno_t CLIADDCMD_KalAO_Telemetry__latency();
+
+#endif
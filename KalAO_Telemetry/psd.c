@@ -0,0 +1,303 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+#include "ImageStreamIO/ImageStreamIO.h"
+
+#include "psd.h"
+#include "reader.h"
+
+#include <math.h>
+#include <sched.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+#define PSD_POLL_PERIOD_NS 100000000 // 100 ms
+
+// Keywords before the row header
+#define NB_PSD_KW 2
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static int find_row(IMAGE *image, const char *name) {
+    for (int k = 0; k < image->md->NBkw; k++) {
+        IMAGE_KEYWORD *kw = &image->kw[k];
+
+        if (strncmp(kw->name, "ROW", 3) == 0 && kw->type == 'S' && strcmp(kw->value.valstr, name) == 0) {
+            return atoi(&kw->name[3]);
+        }
+    }
+
+    return -1;
+}
+
+static uint32_t window_length(TELEMETRY_PSD *psd) {
+    // Segments overlap by half
+    return psd->nfft / 2 * (psd->NBsegments + 1);
+}
+
+static void compute_psd(TELEMETRY_PSD *psd, float *samples, uint32_t NBrows, double fs, double *acc) {
+    uint32_t nfft = psd->nfft;
+    uint32_t NBfreqs = nfft / 2 + 1;
+    float *array = data.image[psd->ID].array.F;
+
+    for (int ch = 0; ch < psd->NBchannels; ch++) {
+        uint32_t row = psd->rows[ch];
+
+        for (uint32_t k = 0; k < NBfreqs; k++) {
+            acc[k] = 0;
+        }
+
+        for (uint32_t seg = 0; seg < psd->NBsegments; seg++) {
+            float *segment = &samples[seg * (nfft / 2) * NBrows];
+            double mean = 0;
+
+            for (uint32_t j = 0; j < nfft; j++) {
+                mean += segment[j * NBrows + row];
+            }
+            mean /= nfft;
+
+            for (uint32_t j = 0; j < nfft; j++) {
+                psd->in[j] = (segment[j * NBrows + row] - mean) * psd->window[j];
+            }
+
+            fftwf_execute(psd->plan);
+
+            for (uint32_t k = 0; k < NBfreqs; k++) {
+                acc[k] += psd->out[k][0] * psd->out[k][0] + psd->out[k][1] * psd->out[k][1];
+            }
+        }
+
+        // One-sided: all bins but DC and Nyquist hold the power of two frequencies
+        double scale = 1.0 / (psd->NBsegments * fs * psd->window_norm);
+
+        for (uint32_t k = 0; k < NBfreqs; k++) {
+            double factor = (k == 0 || k == nfft / 2) ? 1 : 2;
+            array[(1 + ch) * NBfreqs + k] = acc[k] * scale * factor;
+        }
+    }
+
+    for (uint32_t k = 0; k < NBfreqs; k++) {
+        array[k] = k * fs / nfft;
+    }
+}
+
+static void *psd_thread(void *ptr) {
+    TELEMETRY_PSD *psd = (TELEMETRY_PSD *)ptr;
+
+    // Inherited from the real-time loop otherwise
+    struct sched_param schedpar = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &schedpar);
+
+    TELEMETRY_READER reader;
+
+    if (telemetry_reader_init(&reader, psd->image) != 0) {
+        printf("Telemetry stream has no write cursor, PSD not started\n");
+        return NULL;
+    }
+
+    uint32_t NBrows = reader.NBrows;
+    uint32_t length = window_length(psd);
+
+    float *samples = (float *)malloc(sizeof(float) * NBrows * length);
+    double *acc = (double *)malloc(sizeof(double) * (psd->nfft / 2 + 1));
+
+    struct timespec poll_period = {0, PSD_POLL_PERIOD_NS};
+    double elapsed = 0;
+
+    while (!__atomic_load_n(&psd->stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&poll_period, NULL);
+        elapsed += 1e-9 * PSD_POLL_PERIOD_NS;
+
+        if (elapsed < *psd->period || !(*psd->onoff_flag & psd->onoff_mask)) {
+            continue;
+        }
+
+        elapsed = 0;
+
+        /***** Read latest samples *****/
+
+        uint64_t counter = telemetry_reader_counter(&reader);
+        int overrun;
+
+        if (counter < length) {
+            continue;
+        }
+
+        if (telemetry_read_since(&reader, counter - length, samples, length, &counter, &overrun) != length) {
+            continue;
+        }
+
+        double t_first = (double)samples[0] + (double)samples[1];
+        double t_last = (double)samples[(length - 1) * NBrows] + (double)samples[(length - 1) * NBrows + 1];
+        double fs = (length - 1) / (t_last - t_first);
+
+        if (!isfinite(fs) || fs <= 0) {
+            continue;
+        }
+
+        /***** Compute and publish *****/
+
+        IMAGE *image = &data.image[psd->ID];
+
+        image->md->write = 1;
+
+        compute_psd(psd, samples, NBrows, fs, acc);
+
+        image->kw[0].value.numf = fs;
+
+        ImageStreamIO_UpdateIm(image);
+    }
+
+    free(samples);
+    free(acc);
+
+    return NULL;
+}
+
+int telemetry_psd_start(
+    TELEMETRY_PSD *psd,
+    IMAGE *image,
+    const char *name,
+    const char *channels,
+    uint32_t nfft,
+    uint32_t NBsegments,
+    float *period,
+    uint64_t *onoff_flag,
+    uint64_t onoff_mask) {
+    psd->image = image;
+    psd->nfft = nfft;
+    psd->NBsegments = NBsegments;
+    psd->period = period;
+    psd->onoff_flag = onoff_flag;
+    psd->onoff_mask = onoff_mask;
+    psd->stop = 0;
+    psd->running = 0;
+
+    // Leave half of the ring to the writer
+    while (psd->NBsegments > 1 && window_length(psd) > image->md->size[0] / 2) {
+        psd->NBsegments -= 1;
+    }
+
+    if (window_length(psd) > image->md->size[0] / 2) {
+        printf("PSD length %u too long for telemetry stream, PSD not started\n", nfft);
+        return -1;
+    }
+
+    /********** Resolve channels **********/
+
+    char *list = strdup(channels);
+    char *saveptr;
+    char names[TELEMETRY_PSD_MAXCHANNELS][16];
+
+    psd->NBchannels = 0;
+
+    for (char *token = strtok_r(list, ", ", &saveptr); token != NULL; token = strtok_r(NULL, ", ", &saveptr)) {
+        int row = find_row(image, token);
+
+        if (row == -1) {
+            printf("Unknown telemetry channel %s, ignored\n", token);
+            continue;
+        }
+
+        if (psd->NBchannels == TELEMETRY_PSD_MAXCHANNELS) {
+            printf("Too many PSD channels, %s ignored\n", token);
+            continue;
+        }
+
+        psd->rows[psd->NBchannels] = row;
+        strncpy(names[psd->NBchannels], token, sizeof(names[0]) - 1);
+        names[psd->NBchannels][sizeof(names[0]) - 1] = '\0';
+        psd->NBchannels += 1;
+    }
+
+    /********** Allocate stream **********/
+
+    uint32_t NBfreqs = nfft / 2 + 1;
+
+    uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+    {
+        imsizearray[0] = NBfreqs;
+        imsizearray[1] = 1 + psd->NBchannels;
+        create_image_ID(name, 2, imsizearray, _DATATYPE_FLOAT, 1, NB_PSD_KW + 1 + psd->NBchannels, 0, &psd->ID);
+
+        free(imsizearray);
+    }
+
+    for (uint32_t i = 0; i < NBfreqs * (1 + psd->NBchannels); i++) {
+        data.image[psd->ID].array.F[i] = 0;
+    }
+
+    IMAGE_KEYWORD *kw = data.image[psd->ID].kw;
+
+    strcpy(kw[0].name, "FS");
+    kw[0].type = 'D';
+    kw[0].value.numf = 0;
+    strcpy(kw[0].comment, "Sampling frequency [Hz]");
+
+    strcpy(kw[1].name, "NBSEG");
+    kw[1].type = 'L';
+    kw[1].value.numl = psd->NBsegments;
+    strcpy(kw[1].comment, "Number of averaged segments");
+
+    strcpy(kw[NB_PSD_KW].name, "ROW00");
+    kw[NB_PSD_KW].type = 'S';
+    strcpy(kw[NB_PSD_KW].value.valstr, "frequency");
+    strcpy(kw[NB_PSD_KW].comment, "Frequency [Hz]");
+
+    for (int ch = 0; ch < psd->NBchannels; ch++) {
+        IMAGE_KEYWORD *kw_row = &kw[NB_PSD_KW + 1 + ch];
+
+        sprintf(kw_row->name, "ROW%02d", 1 + ch);
+        kw_row->type = 'S';
+        strcpy(kw_row->value.valstr, names[ch]);
+        strcpy(kw_row->comment, "PSD [unit^2/Hz]");
+    }
+
+    free(list);
+
+    /********** FFT plan and window **********/
+
+    psd->in = fftwf_alloc_real(nfft);
+    psd->out = fftwf_alloc_complex(NBfreqs);
+    psd->plan = fftwf_plan_dft_r2c_1d(nfft, psd->in, psd->out, FFTW_MEASURE);
+
+    psd->window = (float *)malloc(sizeof(float) * nfft);
+    psd->window_norm = 0;
+
+    // Hann window
+    for (uint32_t j = 0; j < nfft; j++) {
+        psd->window[j] = 0.5 - 0.5 * cos(2 * M_PI * j / nfft);
+        psd->window_norm += psd->window[j] * psd->window[j];
+    }
+
+    psd->running = pthread_create(&psd->thread, NULL, psd_thread, psd) == 0;
+
+    return psd->running ? 0 : -1;
+}
+
+void telemetry_psd_stop(TELEMETRY_PSD *psd) {
+    if (!psd->running) {
+        return;
+    }
+
+    __atomic_store_n(&psd->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(psd->thread, NULL);
+
+    fftwf_destroy_plan(psd->plan);
+    fftwf_free(psd->in);
+    fftwf_free(psd->out);
+    free(psd->window);
+}
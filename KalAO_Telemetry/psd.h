@@ -0,0 +1,68 @@
+#ifndef _MILK_KALAO_TELEMETRY_PSD_H
+#define _MILK_KALAO_TELEMETRY_PSD_H
+
+#include <fftw3.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Welch power spectral densities of telemetry channels.
+ *
+ * A low priority thread periodically reads the latest samples of
+ * kalao_telemetry (see reader.h), splits them in NBsegments Hann windowed
+ * segments of nfft samples overlapping by half, and averages their
+ * periodograms. Layout of the stream (nfft / 2 + 1 x 1 + NBchannels):
+ *
+ *   row 0      : frequency [Hz]
+ *   row 1 + ch : one-sided PSD of channel ch [unit^2 / Hz]
+ *
+ * The sampling frequency is estimated from the timestamps of the samples.
+ */
+
+#define TELEMETRY_PSD_MAXCHANNELS 16
+
+typedef struct
+{
+    IMAGE *image;
+    imageID ID;
+
+    int NBchannels;
+    uint32_t rows[TELEMETRY_PSD_MAXCHANNELS];
+
+    uint32_t nfft;
+    uint32_t NBsegments;
+    float *period;
+    uint64_t *onoff_flag;
+    uint64_t onoff_mask;
+
+    // precomputed by telemetry_psd_start()
+    float *window;
+    double window_norm;
+    float *in;
+    fftwf_complex *out;
+    fftwf_plan plan;
+
+    pthread_t thread;
+    int running;
+    int stop;
+
+} TELEMETRY_PSD;
+
+/*
+ * channels is a comma separated list of row names of the telemetry stream
+ * (ROWnn keywords). Unknown names are ignored.
+ */
+int telemetry_psd_start(
+    TELEMETRY_PSD *psd,
+    IMAGE *image,
+    const char *name,
+    const char *channels,
+    uint32_t nfft,
+    uint32_t NBsegments,
+    float *period,
+    uint64_t *onoff_flag,
+    uint64_t onoff_mask);
+
+void telemetry_psd_stop(TELEMETRY_PSD *psd);
+
+#endif
@@ -0,0 +1,198 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "quantiles.h"
+
+#include <math.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static void next_slot(TELEMETRY_QUANTILES *tq) {
+    tq->slot = (tq->slot + 1) % NB_QUANTILES_SLOTS;
+    tq->t_slot += tq->slot_period;
+
+    // Oldest slot leaves the window
+    for (int ch = 0; ch < tq->NBchannels; ch++) {
+        KALAO_SKETCH *slot = &tq->slots[tq->slot * tq->NBchannels + ch];
+
+        kalao_sketch_subtract(&tq->window[ch], slot);
+        kalao_sketch_reset(slot);
+    }
+}
+
+static void publish(PROCESSINFO *processinfo, TELEMETRY_QUANTILES *tq) {
+    int NBquantiles = tq->NBquantiles;
+    float *array = data.image[tq->ID].array.F;
+
+    data.image[tq->ID].md->write = 1;
+
+    for (int ch = 0; ch < tq->NBchannels; ch++) {
+        for (int q = 0; q < NBquantiles; q++) {
+            array[(2 * ch) * NBquantiles + q] = kalao_sketch_quantile(&tq->window[ch], tq->quantiles[q]);
+            array[(2 * ch + 1) * NBquantiles + q] = kalao_sketch_quantile(&tq->total[ch], tq->quantiles[q]);
+        }
+    }
+
+    processinfo_update_output_stream(processinfo, tq->ID);
+}
+
+errno_t telemetry_quantiles_create(
+    TELEMETRY_QUANTILES *tq,
+    const char *name,
+    TELEMETRY_CHANNEL *channels,
+    int NBchannels,
+    const char *quantiles,
+    double window,
+    double publish_period) {
+    tq->NBchannels = NBchannels;
+    tq->slot_period = window / NB_QUANTILES_SLOTS;
+    tq->t_slot = NAN;
+    tq->slot = 0;
+    tq->publish_period = publish_period;
+    tq->t_publish = NAN;
+
+    /********** Parse quantiles **********/
+
+    char *list = strdup(quantiles);
+    char *saveptr;
+
+    tq->NBquantiles = 0;
+
+    for (char *token = strtok_r(list, ", ", &saveptr); token != NULL; token = strtok_r(NULL, ", ", &saveptr)) {
+        double q = atof(token);
+
+        if (q < 0 || q > 1 || tq->NBquantiles == TELEMETRY_QUANTILES_MAX) {
+            printf("Quantile %s ignored\n", token);
+            continue;
+        }
+
+        tq->quantiles[tq->NBquantiles] = q;
+        tq->NBquantiles += 1;
+    }
+
+    free(list);
+
+    if (tq->NBquantiles == 0) {
+        tq->quantiles[0] = 0.5;
+        tq->NBquantiles = 1;
+    }
+
+    /********** Allocate sketches **********/
+
+    tq->slots = (KALAO_SKETCH *)malloc(sizeof(KALAO_SKETCH) * NB_QUANTILES_SLOTS * NBchannels);
+    tq->window = (KALAO_SKETCH *)malloc(sizeof(KALAO_SKETCH) * NBchannels);
+    tq->total = (KALAO_SKETCH *)malloc(sizeof(KALAO_SKETCH) * NBchannels);
+
+    for (int i = 0; i < NB_QUANTILES_SLOTS * NBchannels; i++) {
+        kalao_sketch_reset(&tq->slots[i]);
+    }
+
+    for (int ch = 0; ch < NBchannels; ch++) {
+        kalao_sketch_reset(&tq->window[ch]);
+        kalao_sketch_reset(&tq->total[ch]);
+    }
+
+    /********** Allocate stream **********/
+
+    uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+    {
+        imsizearray[0] = tq->NBquantiles;
+        imsizearray[1] = 2 * NBchannels;
+        create_image_ID(name, 2, imsizearray, _DATATYPE_FLOAT, 1, tq->NBquantiles + 2 * NBchannels, 0, &tq->ID);
+
+        free(imsizearray);
+    }
+
+    for (int i = 0; i < tq->NBquantiles * 2 * NBchannels; i++) {
+        data.image[tq->ID].array.F[i] = NAN;
+    }
+
+    IMAGE_KEYWORD *kw = data.image[tq->ID].kw;
+
+    for (int q = 0; q < tq->NBquantiles; q++) {
+        sprintf(kw[q].name, "Q%d", q);
+        kw[q].type = 'D';
+        kw[q].value.numf = tq->quantiles[q];
+        strcpy(kw[q].comment, "Quantile of column");
+    }
+
+    for (int ch = 0; ch < NBchannels; ch++) {
+        for (int total = 0; total < 2; total++) {
+            IMAGE_KEYWORD *kw_row = &kw[tq->NBquantiles + 2 * ch + total];
+
+            sprintf(kw_row->name, "ROW%02d", 2 * ch + total);
+            kw_row->type = 'S';
+            strncpy(kw_row->value.valstr, channels[ch].name, sizeof(kw_row->value.valstr) - 1);
+            kw_row->value.valstr[sizeof(kw_row->value.valstr) - 1] = '\0';
+
+            if (total) {
+                strcpy(kw_row->comment, "Since start");
+            } else {
+                sprintf(kw_row->comment, "Last %.0f s", window);
+            }
+        }
+    }
+
+    return RETURN_SUCCESS;
+}
+
+void telemetry_quantiles_add(
+    PROCESSINFO *processinfo,
+    TELEMETRY_QUANTILES *tq,
+    double timestamp,
+    float *values) {
+    if (isnan(tq->t_slot)) {
+        tq->t_slot = timestamp;
+        tq->t_publish = timestamp;
+    }
+
+    for (int rotations = 0; timestamp - tq->t_slot >= tq->slot_period && rotations < NB_QUANTILES_SLOTS; rotations++) {
+        next_slot(tq);
+    }
+
+    if (timestamp - tq->t_slot >= tq->slot_period) {
+        // Gap longer than the window: all slots are empty now
+        tq->t_slot = timestamp;
+    }
+
+    KALAO_SKETCH *slots = &tq->slots[tq->slot * tq->NBchannels];
+
+    for (int ch = 0; ch < tq->NBchannels; ch++) {
+        if (isnan(values[ch])) {
+            continue;
+        }
+
+        int key = kalao_sketch_key(values[ch]);
+
+        kalao_sketch_add_key(&slots[ch], key);
+        kalao_sketch_add_key(&tq->window[ch], key);
+        kalao_sketch_add_key(&tq->total[ch], key);
+    }
+
+    if (timestamp - tq->t_publish >= tq->publish_period) {
+        tq->t_publish = timestamp;
+        publish(processinfo, tq);
+    }
+}
+
+void telemetry_quantiles_reset(TELEMETRY_QUANTILES *tq) {
+    for (int ch = 0; ch < tq->NBchannels; ch++) {
+        kalao_sketch_reset(&tq->total[ch]);
+    }
+}
+
+void telemetry_quantiles_free(TELEMETRY_QUANTILES *tq) {
+    free(tq->slots);
+    free(tq->window);
+    free(tq->total);
+}
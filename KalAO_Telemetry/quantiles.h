@@ -0,0 +1,71 @@
+#ifndef _MILK_KALAO_TELEMETRY_QUANTILES_H
+#define _MILK_KALAO_TELEMETRY_QUANTILES_H
+
+#include "channels.h"
+#include "sketch.h"
+
+/*
+ * Streaming quantiles of telemetry channels.
+ *
+ * Each channel has two quantile sketches (see sketch.h): one over the last
+ * window seconds and one since start (or the last reset). The window sketch
+ * is the sum of NB_QUANTILES_SLOTS slot sketches: samples are added to the
+ * current slot and to the window, and the counts of the oldest slot are
+ * subtracted from the window when it expires, so that the cost per sample is
+ * constant. Layout of the stream (NBquantiles x 2 * NBchannels):
+ *
+ *   row 2 * ch     : quantiles of channel ch over the window
+ *   row 2 * ch + 1 : quantiles of channel ch since start
+ *
+ * Keywords Qn hold the quantiles, ROWnn the channel names.
+ */
+
+#define TELEMETRY_QUANTILES_MAX 8
+#define NB_QUANTILES_SLOTS 10
+
+typedef struct
+{
+    imageID ID;
+    int NBchannels;
+
+    int NBquantiles;
+    double quantiles[TELEMETRY_QUANTILES_MAX];
+
+    // window sketches
+    double slot_period;
+    double t_slot;
+    int slot;
+    KALAO_SKETCH *slots; // NB_QUANTILES_SLOTS x NBchannels
+    KALAO_SKETCH *window;
+
+    KALAO_SKETCH *total;
+
+    double publish_period;
+    double t_publish;
+
+} TELEMETRY_QUANTILES;
+
+/*
+ * quantiles is a comma separated list of quantiles in [0, 1]. Channels are
+ * only used for their names.
+ */
+errno_t telemetry_quantiles_create(
+    TELEMETRY_QUANTILES *tq,
+    const char *name,
+    TELEMETRY_CHANNEL *channels,
+    int NBchannels,
+    const char *quantiles,
+    double window,
+    double publish_period);
+
+void telemetry_quantiles_add(
+    PROCESSINFO *processinfo,
+    TELEMETRY_QUANTILES *tq,
+    double timestamp,
+    float *values);
+
+void telemetry_quantiles_reset(TELEMETRY_QUANTILES *tq);
+
+void telemetry_quantiles_free(TELEMETRY_QUANTILES *tq);
+
+#endif
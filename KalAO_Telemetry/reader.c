@@ -0,0 +1,97 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#include "reader.h"
+
+#include <string.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+int telemetry_reader_init(TELEMETRY_READER *reader, IMAGE *image) {
+    reader->image = image;
+    reader->capacity = image->md->size[0];
+    reader->NBrows = image->md->size[1];
+    reader->kw_samples = -1;
+
+    for (int k = 0; k < image->md->NBkw; k++) {
+        if (strcmp(image->kw[k].name, TELEMETRY_KW_SAMPLES) == 0) {
+            reader->kw_samples = k;
+        }
+    }
+
+    return reader->kw_samples == -1 ? -1 : 0;
+}
+
+uint64_t telemetry_reader_counter(TELEMETRY_READER *reader) {
+    return __atomic_load_n(&reader->image->kw[reader->kw_samples].value.numl, __ATOMIC_ACQUIRE);
+}
+
+uint64_t telemetry_read_since(
+    TELEMETRY_READER *reader,
+    uint64_t since,
+    float *buffer,
+    uint64_t maxsamples,
+    uint64_t *counter,
+    int *overrun) {
+    uint64_t capacity = reader->capacity;
+    uint32_t NBrows = reader->NBrows;
+    float *array = reader->image->array.F;
+
+    *overrun = 0;
+
+    uint64_t start = since;
+    uint64_t end = telemetry_reader_counter(reader);
+
+    if (start > end) {
+        // Writer restarted
+        start = 0;
+        *overrun = 1;
+    }
+
+    if (end - start > capacity) {
+        start = end - capacity;
+        *overrun = 1;
+    }
+
+    uint64_t n = end - start;
+    if (n > maxsamples) {
+        n = maxsamples;
+    }
+
+    for (uint64_t k = 0; k < n; k++) {
+        uint64_t pos = (start + k) % capacity;
+
+        for (uint32_t r = 0; r < NBrows; r++) {
+            buffer[k * NBrows + r] = array[r * capacity + pos];
+        }
+    }
+
+    // The writer may have overwritten the oldest samples during the copy,
+    // including the one it is currently writing
+    uint64_t end_after = telemetry_reader_counter(reader);
+    uint64_t first_valid = end_after + 1 > capacity ? end_after + 1 - capacity : 0;
+
+    if (start < first_valid) {
+        uint64_t drop = first_valid - start;
+        if (drop > n) {
+            drop = n;
+        }
+
+        memmove(buffer, &buffer[drop * NBrows], sizeof(float) * (n - drop) * NBrows);
+
+        n -= drop;
+        start += drop;
+        *overrun = 1;
+    }
+
+    *counter = start + n;
+
+    return n;
+}
@@ -0,0 +1,50 @@
+#ifndef _MILK_KALAO_TELEMETRY_READER_H
+#define _MILK_KALAO_TELEMETRY_READER_H
+
+#include "ImageStreamIO/ImageStruct.h"
+
+#include <stdint.h>
+
+/*
+ * Incremental reader for the kalao_telemetry circular buffer.
+ *
+ * gather publishes two keywords along with the data:
+ *   SAMPLES  : monotonic number of samples written since start
+ *   WRITEPOS : index of the last written sample (also in cnt1)
+ * Sample n is stored at index n % size[0], so clients only need to copy the
+ * samples written since their last call.
+ */
+
+#define TELEMETRY_KW_SAMPLES "SAMPLES"
+#define TELEMETRY_KW_WRITEPOS "WRITEPOS"
+
+typedef struct
+{
+    IMAGE *image;
+    uint64_t capacity;
+    uint32_t NBrows;
+    int kw_samples;
+
+} TELEMETRY_READER;
+
+int telemetry_reader_init(TELEMETRY_READER *reader, IMAGE *image);
+
+uint64_t telemetry_reader_counter(TELEMETRY_READER *reader);
+
+/*
+ * Copy up to maxsamples samples written since counter value since, oldest
+ * first, in buffer (sample-major, NBrows floats per sample).
+ *
+ * Returns the number of samples copied. *counter is set to the value to pass
+ * as since on the next call. *overrun is set if samples were lost because
+ * they were overwritten before being read.
+ */
+uint64_t telemetry_read_since(
+    TELEMETRY_READER *reader,
+    uint64_t since,
+    float *buffer,
+    uint64_t maxsamples,
+    uint64_t *counter,
+    int *overrun);
+
+#endif
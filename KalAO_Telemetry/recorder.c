@@ -0,0 +1,661 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "KalAO_BMC/actuators.h"
+#include "KalAO_SHWFS/stats.h"
+
+#include <fitsio.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*           MACROS, DEFINES                                          */
+/* ================================================================== */
+/* ================================================================== */
+
+#define MAXNB_STREAMS 8
+
+typedef struct
+{
+    char name[80];
+    imageID ID;
+    uint64_t framesize; // bytes
+    int bitpix;
+    int fitstype;
+
+} RECORDER_STREAM;
+
+/*
+ * Rings of the last NBframes frames of each stream, plus the time and cnt0
+ * of the streams for each frame (NBframes x (1 + NBstreams) int64).
+ */
+typedef struct
+{
+    char *frames[MAXNB_STREAMS];
+    int64_t *times;
+    uint64_t count;
+
+    // event
+    uint64_t event_frame;
+    char reason[80];
+    struct timespec event_time;
+
+} RECORDER_BUFFER;
+
+typedef struct
+{
+    RECORDER_STREAM *streams;
+    int NBstreams;
+    uint64_t NBframes;
+    char dir[512];
+
+    // buffer being written to disk, NULL if the writer is idle
+    RECORDER_BUFFER *pending;
+    sem_t pending_ready;
+    int stop;
+
+} RECORDER_WRITER;
+
+static char *streams;
+static long fpi_streams;
+
+static int64_t *pre_frames;
+static long fpi_pre_frames;
+
+static int64_t *post_frames;
+static long fpi_post_frames;
+
+static char *dir;
+static long fpi_dir;
+
+static uint64_t *trigger;
+static long fpi_trigger;
+
+static float *flux_min;
+static long fpi_flux_min;
+
+static float *slope_max;
+static long fpi_slope_max;
+
+static int64_t *slope_count;
+static long fpi_slope_count;
+
+static float *dm_min;
+static long fpi_dm_min;
+
+static float *dm_max;
+static long fpi_dm_max;
+
+static int64_t *dm_count;
+static long fpi_dm_count;
+
+static int64_t *events;
+static long fpi_events;
+
+static CLICMDARGDEF farg[] =
+    {
+        {
+            CLIARG_STR,
+            ".streams",
+            "Streams to record (comma separated)",
+            "nuvu_raw,nuvu_stream,shwfs_slopes,bmc_commands_dm",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&streams,
+            &fpi_streams,
+        },
+        {
+            CLIARG_INT64,
+            ".pre_frames",
+            "Frames kept before the event",
+            "2000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&pre_frames,
+            &fpi_pre_frames,
+        },
+        {
+            CLIARG_INT64,
+            ".post_frames",
+            "Frames recorded after the event",
+            "1000",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&post_frames,
+            &fpi_post_frames,
+        },
+        {
+            CLIARG_STR,
+            ".dir",
+            "Output directory",
+            "recorder",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&dir,
+            &fpi_dir,
+        },
+        {
+            CLIARG_ONOFF,
+            ".trigger",
+            "Manual trigger",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&trigger,
+            &fpi_trigger,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".trigger.flux_min",
+            "Trigger if average SHWFS flux below (0: disabled) [ADU]",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&flux_min,
+            &fpi_flux_min,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".trigger.slope_max",
+            "Saturated slope threshold [pixel]",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&slope_max,
+            &fpi_slope_max,
+        },
+        {
+            CLIARG_INT64,
+            ".trigger.slope_count",
+            "Trigger if number of saturated slopes above (0: disabled)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&slope_count,
+            &fpi_slope_count,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".trigger.dm_min",
+            "DM clip value (min stroke)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&dm_min,
+            &fpi_dm_min,
+        },
+        {
+            CLIARG_FLOAT32,
+            ".trigger.dm_max",
+            "DM clip value (max stroke)",
+            "1",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&dm_max,
+            &fpi_dm_max,
+        },
+        {
+            CLIARG_INT64,
+            ".trigger.dm_count",
+            "Trigger if number of clipped actuators above (0: disabled)",
+            "0",
+            CLIARG_HIDDEN_DEFAULT,
+            (void **)&dm_count,
+            &fpi_dm_count,
+        },
+        {
+            CLIARG_INT64,
+            ".events",
+            "Number of events recorded",
+            "0",
+            CLIARG_OUTPUT_DEFAULT,
+            (void **)&events,
+            &fpi_events,
+        },
+};
+
+static CLICMDDATA CLIcmddata =
+    {
+        "recorder",
+        "Record streams around events (triggered by SHWFS slopes)",
+        CLICMD_FIELDS_DEFAULTS,
+};
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static errno_t help_function() {
+    return RETURN_SUCCESS;
+}
+
+static errno_t customCONFsetup() {
+    if (data.fpsptr != NULL) {
+        data.fpsptr->parray[fpi_pre_frames].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_pre_frames].val.i64[1] = 1; // min
+
+        data.fpsptr->parray[fpi_post_frames].fpflag |= FPFLAG_MINLIMIT;
+        data.fpsptr->parray[fpi_post_frames].val.i64[1] = 0; // min
+
+        data.fpsptr->parray[fpi_trigger].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_flux_min].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_slope_max].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_slope_count].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_dm_min].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_dm_max].fpflag |= FPFLAG_WRITERUN;
+        data.fpsptr->parray[fpi_dm_count].fpflag |= FPFLAG_WRITERUN;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+static int stream_format(uint8_t datatype, uint64_t *typesize, int *bitpix, int *fitstype) {
+    switch (datatype) {
+    case _DATATYPE_UINT8:
+        *typesize = 1;
+        *bitpix = BYTE_IMG;
+        *fitstype = TBYTE;
+        break;
+    case _DATATYPE_INT16:
+        *typesize = 2;
+        *bitpix = SHORT_IMG;
+        *fitstype = TSHORT;
+        break;
+    case _DATATYPE_UINT16:
+        *typesize = 2;
+        *bitpix = USHORT_IMG;
+        *fitstype = TUSHORT;
+        break;
+    case _DATATYPE_INT32:
+        *typesize = 4;
+        *bitpix = LONG_IMG;
+        *fitstype = TINT;
+        break;
+    case _DATATYPE_INT64:
+        *typesize = 8;
+        *bitpix = LONGLONG_IMG;
+        *fitstype = TLONGLONG;
+        break;
+    case _DATATYPE_FLOAT:
+        *typesize = 4;
+        *bitpix = FLOAT_IMG;
+        *fitstype = TFLOAT;
+        break;
+    case _DATATYPE_DOUBLE:
+        *typesize = 8;
+        *bitpix = DOUBLE_IMG;
+        *fitstype = TDOUBLE;
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_streams(RECORDER_STREAM *rstreams) {
+    char *list = strdup(streams);
+    char *saveptr;
+    int NBstreams = 0;
+
+    for (char *token = strtok_r(list, ", ", &saveptr); token != NULL; token = strtok_r(NULL, ", ", &saveptr)) {
+        RECORDER_STREAM *rstream = &rstreams[NBstreams];
+        uint64_t typesize;
+
+        if (NBstreams == MAXNB_STREAMS) {
+            printf("Too many streams, %s not recorded\n", token);
+            continue;
+        }
+
+        rstream->ID = image_ID(token);
+
+        if (rstream->ID == -1) {
+            printf("Stream %s not found, not recorded\n", token);
+            continue;
+        }
+
+        if (stream_format(data.image[rstream->ID].md->datatype, &typesize, &rstream->bitpix, &rstream->fitstype) != 0) {
+            printf("Stream %s has an unsupported datatype, not recorded\n", token);
+            continue;
+        }
+
+        strncpy(rstream->name, token, sizeof(rstream->name) - 1);
+        rstream->name[sizeof(rstream->name) - 1] = '\0';
+        rstream->framesize = typesize * data.image[rstream->ID].md->nelement;
+
+        NBstreams += 1;
+    }
+
+    free(list);
+
+    return NBstreams;
+}
+
+static void buffer_alloc(RECORDER_BUFFER *buffer, RECORDER_STREAM *rstreams, int NBstreams, uint64_t NBframes) {
+    for (int s = 0; s < NBstreams; s++) {
+        buffer->frames[s] = (char *)malloc(rstreams[s].framesize * NBframes);
+
+        // Touch the pages now rather than in the loop
+        memset(buffer->frames[s], 0, rstreams[s].framesize * NBframes);
+    }
+
+    buffer->times = (int64_t *)calloc(NBframes * (1 + NBstreams), sizeof(int64_t));
+    buffer->count = 0;
+}
+
+static void buffer_free(RECORDER_BUFFER *buffer, int NBstreams) {
+    for (int s = 0; s < NBstreams; s++) {
+        free(buffer->frames[s]);
+    }
+
+    free(buffer->times);
+}
+
+static void buffer_record(RECORDER_BUFFER *buffer, RECORDER_STREAM *rstreams, int NBstreams, uint64_t NBframes) {
+    uint64_t slot = buffer->count % NBframes;
+    int64_t *times = &buffer->times[slot * (1 + NBstreams)];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    times[0] = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    for (int s = 0; s < NBstreams; s++) {
+        IMAGE *image = &data.image[rstreams[s].ID];
+
+        memcpy(&buffer->frames[s][slot * rstreams[s].framesize], image->array.raw, rstreams[s].framesize);
+        times[1 + s] = image->md->cnt0;
+    }
+
+    buffer->count += 1;
+}
+
+/*
+ * Write frames of a ring in time order (oldest first) as the current HDU,
+ * first frames of the ring are after the last written one.
+ */
+static void write_ring(fitsfile *fptr, int fitstype, char *ring, uint64_t framesize, uint64_t nelement, uint64_t NBframes, uint64_t count, int *status) {
+    uint64_t NBvalid = count < NBframes ? count : NBframes;
+    uint64_t first = count - NBvalid;
+    uint64_t written = 0;
+
+    while (written < NBvalid && *status == 0) {
+        uint64_t slot = (first + written) % NBframes;
+        uint64_t n = NBframes - slot;
+
+        if (n > NBvalid - written) {
+            n = NBvalid - written;
+        }
+
+        fits_write_img(fptr, fitstype, 1 + written * nelement, n * nelement, &ring[slot * framesize], status);
+
+        written += n;
+    }
+}
+
+static void write_buffer(RECORDER_WRITER *writer, RECORDER_BUFFER *buffer) {
+    uint64_t NBframes = writer->NBframes;
+    uint64_t NBvalid = buffer->count < NBframes ? buffer->count : NBframes;
+    int NBstreams = writer->NBstreams;
+
+    char fname[1024];
+    struct tm tm;
+    fitsfile *fptr;
+    int status = 0;
+
+    gmtime_r(&buffer->event_time.tv_sec, &tm);
+
+    // "!" to overwrite
+    snprintf(fname, sizeof(fname), "!%s/recorder_%04d%02d%02d_%02d%02d%02d_%03ld.fits", writer->dir, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, buffer->event_time.tv_nsec / 1000000);
+
+    fits_create_file(&fptr, fname, &status);
+
+    // Primary HDU: time [ns] and cnt0 of each stream for each frame
+    long naxes[3] = {1 + NBstreams, NBvalid, 0};
+    long long event_frame = NBvalid - (buffer->count - buffer->event_frame);
+
+    fits_create_img(fptr, LONGLONG_IMG, 2, naxes, &status);
+    fits_write_key(fptr, TSTRING, "REASON", buffer->reason, "Trigger condition", &status);
+    fits_write_key(fptr, TLONGLONG, "EVFRAME", &event_frame, "Index of the event frame", &status);
+
+    for (int s = 0; s < NBstreams; s++) {
+        char key[16];
+        sprintf(key, "STREAM%d", s);
+        fits_write_key(fptr, TSTRING, key, writer->streams[s].name, "Column 1 + s holds cnt0", &status);
+    }
+
+    write_ring(fptr, TLONGLONG, (char *)buffer->times, sizeof(int64_t) * (1 + NBstreams), 1 + NBstreams, NBframes, buffer->count, &status);
+
+    // One cube per stream
+    for (int s = 0; s < NBstreams; s++) {
+        RECORDER_STREAM *rstream = &writer->streams[s];
+        IMAGE_METADATA *md = data.image[rstream->ID].md;
+
+        naxes[0] = md->size[0];
+        naxes[1] = md->naxis > 1 ? md->size[1] : 1;
+        naxes[2] = NBvalid;
+
+        fits_create_img(fptr, rstream->bitpix, 3, naxes, &status);
+        fits_write_key(fptr, TSTRING, "EXTNAME", rstream->name, "Stream", &status);
+
+        write_ring(fptr, rstream->fitstype, buffer->frames[s], rstream->framesize, md->nelement, NBframes, buffer->count, &status);
+    }
+
+    fits_close_file(fptr, &status);
+
+    if (status != 0) {
+        fits_report_error(stderr, status);
+    } else {
+        printf("Recorded %lu frames in %s\n", NBvalid, &fname[1]);
+    }
+}
+
+static void *writer_thread(void *ptr) {
+    RECORDER_WRITER *writer = (RECORDER_WRITER *)ptr;
+
+    // Inherited from the real-time loop otherwise
+    struct sched_param schedpar = {0};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &schedpar);
+
+    while (1) {
+        sem_wait(&writer->pending_ready);
+
+        RECORDER_BUFFER *buffer = __atomic_load_n(&writer->pending, __ATOMIC_ACQUIRE);
+
+        if (buffer != NULL) {
+            write_buffer(writer, buffer);
+            __atomic_store_n(&writer->pending, NULL, __ATOMIC_RELEASE);
+        }
+
+        if (__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Per-frame trigger conditions, reason is set if one is met */
+static int check_conditions(imageID slopesID, imageID statsID, int stats_kw, imageID dmID, char *reason) {
+    if (data.fpsptr->parray[fpi_trigger].fpflag & FPFLAG_ONOFF) {
+        data.fpsptr->parray[fpi_trigger].fpflag &= ~FPFLAG_ONOFF;
+        data.fpsptr->parray[fpi_trigger].cnt0++;
+
+        strcpy(reason, "manual");
+        return 1;
+    }
+
+    if (*flux_min > 0 && statsID != -1) {
+        double record[SHWFS_STATS_NBFIELDS];
+        uint64_t records = shwfs_stats_records(&data.image[statsID], stats_kw);
+
+        if (records > 0 && shwfs_stats_read(&data.image[statsID], records - 1, record) == 0 && record[SHWFS_STATS_FLUX_AVG] < *flux_min) {
+            sprintf(reason, "flux %.1f below %.1f", record[SHWFS_STATS_FLUX_AVG], *flux_min);
+            return 1;
+        }
+    }
+
+    if (*slope_count > 0) {
+        float *slopes = data.image[slopesID].array.F;
+        int64_t saturated = 0;
+
+        for (uint64_t i = 0; i < data.image[slopesID].md->nelement; i++) {
+            saturated += fabsf(slopes[i]) >= *slope_max;
+        }
+
+        if (saturated >= *slope_count) {
+            sprintf(reason, "%ld saturated slopes", saturated);
+            return 1;
+        }
+    }
+
+    if (*dm_count > 0 && dmID != -1) {
+        float *dm = data.image[dmID].array.F;
+        int64_t clipped = 0;
+
+        // Only populated pixels, the corners are always 0
+        for (int ii = 0; ii < NB_ACTUATORS; ii++) {
+            float command = dm[actuator_pixel(ii)];
+
+            clipped += (command <= *dm_min) | (command >= *dm_max);
+        }
+
+        if (clipped >= *dm_count) {
+            sprintf(reason, "%ld clipped actuators", clipped);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static errno_t compute_function() {
+    DEBUG_TRACE_FSTART();
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_INIT
+
+    /********** Open streams **********/
+
+    processinfo_WriteMessage(processinfo, "Connecting to streams");
+
+    imageID slopesID = processinfo->triggerstreamID;
+    imageID statsID = image_ID("shwfs_stats");
+    imageID dmID = image_ID("bmc_commands_dm");
+    int stats_kw = statsID != -1 ? shwfs_stats_kw(&data.image[statsID]) : -1;
+
+    if (stats_kw == -1) {
+        statsID = -1;
+    }
+
+    RECORDER_STREAM rstreams[MAXNB_STREAMS];
+    int NBstreams = open_streams(rstreams);
+
+    /********** Allocate buffers **********/
+
+    processinfo_WriteMessage(processinfo, "Allocating buffers");
+
+    // Two buffers: one is recorded while the other one is written to disk
+    uint64_t NBframes = *pre_frames + *post_frames;
+    RECORDER_BUFFER buffers[2];
+    int current = 0;
+
+    buffer_alloc(&buffers[0], rstreams, NBstreams, NBframes);
+    buffer_alloc(&buffers[1], rstreams, NBstreams, NBframes);
+
+    /********** Start writer **********/
+
+    RECORDER_WRITER writer;
+    pthread_t writer_id;
+
+    writer.streams = rstreams;
+    writer.NBstreams = NBstreams;
+    writer.NBframes = NBframes;
+    strncpy(writer.dir, dir, sizeof(writer.dir) - 1);
+    writer.dir[sizeof(writer.dir) - 1] = '\0';
+    writer.pending = NULL;
+    writer.stop = 0;
+    sem_init(&writer.pending_ready, 0, 0);
+
+    mkdir(writer.dir, 0755);
+
+    pthread_create(&writer_id, NULL, writer_thread, &writer);
+
+    /********** Loop **********/
+
+    // Frames left to record after the event, -1 if no event is in progress
+    int64_t remaining = -1;
+    uint64_t dropped_events = 0;
+
+    processinfo_WriteMessage(processinfo, "Recording");
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_LOOPSTART
+
+    RECORDER_BUFFER *buffer = &buffers[current];
+
+    buffer_record(buffer, rstreams, NBstreams, NBframes);
+
+    if (remaining == -1) {
+        if (check_conditions(slopesID, statsID, stats_kw, dmID, buffer->reason)) {
+            buffer->event_frame = buffer->count - 1;
+            clock_gettime(CLOCK_REALTIME, &buffer->event_time);
+
+            remaining = *post_frames;
+
+            processinfo_WriteMessage(processinfo, buffer->reason);
+        }
+    } else {
+        remaining -= 1;
+    }
+
+    if (remaining == 0) {
+        remaining = -1;
+
+        if (__atomic_load_n(&writer.pending, __ATOMIC_ACQUIRE) == NULL) {
+            // Freeze the buffer and record in the other one
+            __atomic_store_n(&writer.pending, buffer, __ATOMIC_RELEASE);
+            sem_post(&writer.pending_ready);
+
+            current = 1 - current;
+            buffers[current].count = 0;
+
+            data.fpsptr->parray[fpi_events].val.i64[0] += 1;
+            data.fpsptr->parray[fpi_events].cnt0++;
+        } else {
+            // Previous event still being written: keep recording in the same buffer
+            dropped_events++;
+        }
+
+        processinfo_WriteMessage(processinfo, "Recording");
+    }
+
+    INSERT_STD_PROCINFO_COMPUTEFUNC_END
+
+    __atomic_store_n(&writer.stop, 1, __ATOMIC_RELEASE);
+    sem_post(&writer.pending_ready);
+    pthread_join(writer_id, NULL);
+
+    if (dropped_events > 0) {
+        printf("%lu events not recorded (writer busy)\n", dropped_events);
+    }
+
+    buffer_free(&buffers[0], NBstreams);
+    buffer_free(&buffers[1], NBstreams);
+
+    sem_destroy(&writer.pending_ready);
+
+    DEBUG_TRACE_FEXIT();
+
+    return RETURN_SUCCESS;
+}
+
+INSERT_STD_FPSCLIfunctions
+
+// Register function in CLI
+errno_t
+CLIADDCMD_KalAO_Telemetry__recorder() {
+    CLIcmddata.FPS_customCONFsetup = customCONFsetup;
+    INSERT_STD_CLIREGISTERFUNC
+
+    return RETURN_SUCCESS;
+}
@@ -0,0 +1,6 @@
+#ifndef _MILK_KALAO_TELEMETRY_RECORDER_H
+#define _MILK_KALAO_TELEMETRY_RECORDER_H
+
+errno_t CLIADDCMD_KalAO_Telemetry__recorder();
+
+#endif
@@ -0,0 +1,126 @@
+/* ================================================================== */
+/* ================================================================== */
+/*            DEPENDENCIES                                            */
+/* ================================================================== */
+/* ================================================================== */
+
+#define _GNU_SOURCE
+#include "CommandLineInterface/CLIcore.h"
+
+#include "rings.h"
+
+#include <math.h>
+
+/* ================================================================== */
+/* ================================================================== */
+/*  FUNCTIONS                                                         */
+/* ================================================================== */
+/* ================================================================== */
+
+static void reset_bin(TELEMETRY_RING *ring, double timestamp) {
+    ring->count = 0;
+    ring->t_start = timestamp;
+
+    for (int ch = 0; ch < ring->NBchannels; ch++) {
+        ring->min[ch] = INFINITY;
+        ring->max[ch] = -INFINITY;
+        ring->sum[ch] = 0;
+    }
+}
+
+static void flush_bin(PROCESSINFO *processinfo, TELEMETRY_RING *ring, float timestamp_offset) {
+    int NBbins = ring->NBbins;
+    int i = ring->index;
+    float *array = data.image[ring->ID].array.F;
+
+    data.image[ring->ID].md->write = 1;
+
+    array[i] = timestamp_offset;
+    array[NBbins + i] = (float)ring->t_start;
+    array[2 * NBbins + i] = ring->count;
+
+    for (int ch = 0; ch < ring->NBchannels; ch++) {
+        array[(3 + 3 * ch) * NBbins + i] = ring->min[ch];
+        array[(4 + 3 * ch) * NBbins + i] = ring->max[ch];
+        array[(5 + 3 * ch) * NBbins + i] = ring->sum[ch] / ring->count;
+    }
+
+    data.image[ring->ID].md->cnt1 = i;
+
+    processinfo_update_output_stream(processinfo, ring->ID);
+
+    ring->index = (i + 1) % NBbins;
+}
+
+errno_t telemetry_ring_create(
+    TELEMETRY_RING *ring,
+    const char *name,
+    int NBchannels,
+    int NBbins,
+    int decimation,
+    double period) {
+    ring->NBchannels = NBchannels;
+    ring->NBbins = NBbins;
+    ring->index = 0;
+    ring->decimation = decimation;
+    ring->period = period;
+
+    ring->min = (float *)malloc(sizeof(float) * NBchannels);
+    ring->max = (float *)malloc(sizeof(float) * NBchannels);
+    ring->sum = (double *)malloc(sizeof(double) * NBchannels);
+
+    reset_bin(ring, 0);
+
+    uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+    {
+        imsizearray[0] = NBbins;
+        imsizearray[1] = TELEMETRY_RING_ROWS(NBchannels);
+        create_image_ID(name, 2, imsizearray, _DATATYPE_FLOAT, 1, 10, 0, &ring->ID);
+
+        free(imsizearray);
+    }
+
+    for (uint64_t i = 0; i < data.image[ring->ID].md->nelement; i++) {
+        data.image[ring->ID].array.F[i] = 0;
+    }
+
+    return RETURN_SUCCESS;
+}
+
+void telemetry_ring_add(
+    PROCESSINFO *processinfo,
+    TELEMETRY_RING *ring,
+    float timestamp_offset,
+    double timestamp,
+    float *values) {
+    // Time based bins are closed by the first sample falling after them
+    if (ring->decimation == 0 && ring->count > 0 && timestamp - ring->t_start >= ring->period) {
+        flush_bin(processinfo, ring, timestamp_offset);
+        ring->count = 0;
+    }
+
+    if (ring->count == 0) {
+        reset_bin(ring, ring->decimation == 0 ? ring->period * floor(timestamp / ring->period) : timestamp);
+    }
+
+    for (int ch = 0; ch < ring->NBchannels; ch++) {
+        float value = values[ch];
+
+        ring->min[ch] = fminf(ring->min[ch], value);
+        ring->max[ch] = fmaxf(ring->max[ch], value);
+        ring->sum[ch] += value;
+    }
+
+    ring->count++;
+
+    if (ring->decimation > 0 && ring->count == (uint64_t)ring->decimation) {
+        flush_bin(processinfo, ring, timestamp_offset);
+        ring->count = 0;
+    }
+}
+
+void telemetry_ring_free(TELEMETRY_RING *ring) {
+    free(ring->min);
+    free(ring->max);
+    free(ring->sum);
+}
@@ -0,0 +1,60 @@
+#ifndef _MILK_KALAO_TELEMETRY_RINGS_H
+#define _MILK_KALAO_TELEMETRY_RINGS_H
+
+/*
+ * Reduced resolution telemetry rings.
+ *
+ * Each ring aggregates incoming samples in bins of a fixed number of samples
+ * (decimation) or of a fixed duration (period), and stores min/max/mean/count
+ * per bin in a circular stream. Layout of the stream (NBbins x NBrows):
+ *
+ *   row 0          : timestamp offset (see gather.c)
+ *   row 1          : bin start timestamp, relative to offset [s]
+ *   row 2          : number of samples in bin
+ *   row 3 + 3 * ch : min of channel ch
+ *   row 4 + 3 * ch : max of channel ch
+ *   row 5 + 3 * ch : mean of channel ch
+ *
+ * cnt1 is the index of the last written bin.
+ */
+
+typedef struct
+{
+    imageID ID;
+    int NBchannels;
+    int NBbins;
+    int index;
+
+    // bin size: number of samples if decimation > 0, duration otherwise
+    int decimation;
+    double period;
+
+    // current bin
+    uint64_t count;
+    double t_start;
+    float *min;
+    float *max;
+    double *sum;
+
+} TELEMETRY_RING;
+
+#define TELEMETRY_RING_ROWS(NBchannels) (3 + 3 * (NBchannels))
+
+errno_t telemetry_ring_create(
+    TELEMETRY_RING *ring,
+    const char *name,
+    int NBchannels,
+    int NBbins,
+    int decimation,
+    double period);
+
+void telemetry_ring_add(
+    PROCESSINFO *processinfo,
+    TELEMETRY_RING *ring,
+    float timestamp_offset,
+    double timestamp,
+    float *values);
+
+void telemetry_ring_free(TELEMETRY_RING *ring);
+
+#endif
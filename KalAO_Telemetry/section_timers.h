@@ -0,0 +1,144 @@
+#ifndef _MILK_KALAO_TELEMETRY_SECTION_TIMERS_H
+#define _MILK_KALAO_TELEMETRY_SECTION_TIMERS_H
+
+/*
+ * Timers of the sections of a compute loop, enabled by building with
+ * -DKALAO_SECTION_TIMERS=ON. When disabled, the macros compile to nothing.
+ *
+ * Durations are measured with the TSC (converted to ns with a factor
+ * calibrated at start) and recorded in one histogram per section. The
+ * histograms live in a UINT64 stream, one row per section (KALAO_HISTOGRAM
+ * layout: count, max, bins), so they can be read at any time by another
+ * process. ROWnn keywords hold the section names.
+ *
+ *   enum { SECTION_A, SECTION_B };
+ *   KALAO_SECTIONS(timers, "module_timers", "a", "b");
+ *
+ *   loop:
+ *     KALAO_SECTION_START(timers);
+ *     ...
+ *     KALAO_SECTION_LAP(timers, SECTION_A);
+ *     ...
+ *     KALAO_SECTION_LAP(timers, SECTION_B);
+ */
+
+#ifdef KALAO_SECTION_TIMERS
+
+#include "CommandLineInterface/CLIcore.h"
+
+#include "histogram.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef struct
+{
+    imageID ID;
+    int NBsections;
+    KALAO_HISTOGRAM *hists;
+    double ns_per_tick;
+    uint64_t t0;
+
+} KALAO_SECTION_TIMERS_DATA;
+
+static inline uint64_t kalao_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+// Ticks to ns factor, from the ticks counted during 20 ms
+static inline double kalao_ticks_calibrate() {
+    struct timespec t0, t1;
+    struct timespec wait = {0, 20000000};
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t ticks0 = kalao_ticks();
+
+    nanosleep(&wait, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t ticks1 = kalao_ticks();
+
+    return (double)kalao_timespec_diff_ns(&t0, &t1) / (ticks1 - ticks0);
+}
+
+static inline void kalao_section_timers_init(
+    KALAO_SECTION_TIMERS_DATA *timers,
+    const char *name,
+    const char **sections,
+    int NBsections) {
+    timers->NBsections = NBsections;
+    timers->ns_per_tick = kalao_ticks_calibrate();
+    timers->t0 = kalao_ticks();
+
+    uint32_t *imsizearray = (uint32_t *)malloc(sizeof(uint32_t) * 2);
+    {
+        imsizearray[0] = sizeof(KALAO_HISTOGRAM) / sizeof(uint64_t);
+        imsizearray[1] = NBsections;
+        create_image_ID(name, 2, imsizearray, _DATATYPE_UINT64, 1, NBsections + 1, 0, &timers->ID);
+
+        free(imsizearray);
+    }
+
+    timers->hists = (KALAO_HISTOGRAM *)data.image[timers->ID].array.UI64;
+
+    for (int s = 0; s < NBsections; s++) {
+        kalao_histogram_reset(&timers->hists[s]);
+
+        IMAGE_KEYWORD *kw = &data.image[timers->ID].kw[s];
+
+        sprintf(kw->name, "ROW%02d", s);
+        kw->type = 'S';
+        strncpy(kw->value.valstr, sections[s], sizeof(kw->value.valstr) - 1);
+        kw->value.valstr[sizeof(kw->value.valstr) - 1] = '\0';
+        strcpy(kw->comment, "Section duration [ns]");
+    }
+
+    IMAGE_KEYWORD *kw = &data.image[timers->ID].kw[NBsections];
+
+    strcpy(kw->name, "NSTICK");
+    kw->type = 'D';
+    kw->value.numf = timers->ns_per_tick;
+    strcpy(kw->comment, "Calibrated ns per tick");
+
+    printf("Section timers in %s, %.4f ns per tick\n", name, timers->ns_per_tick);
+}
+
+static inline void kalao_section_timers_lap(KALAO_SECTION_TIMERS_DATA *timers, int section) {
+    uint64_t t = kalao_ticks();
+
+    kalao_histogram_record(&timers->hists[section], (uint64_t)((t - timers->t0) * timers->ns_per_tick));
+
+    timers->t0 = t;
+}
+
+#define KALAO_SECTIONS(timers, name, ...)                                                  \
+    static const char *timers##_names[] = {__VA_ARGS__};                                   \
+    KALAO_SECTION_TIMERS_DATA timers;                                                      \
+    kalao_section_timers_init(&timers, name, timers##_names,                               \
+                              sizeof(timers##_names) / sizeof(timers##_names[0]))
+
+#define KALAO_SECTION_START(timers) timers.t0 = kalao_ticks()
+
+#define KALAO_SECTION_LAP(timers, section) kalao_section_timers_lap(&timers, section)
+
+#else
+
+#define KALAO_SECTIONS(timers, name, ...)
+#define KALAO_SECTION_START(timers)
+#define KALAO_SECTION_LAP(timers, section)
+
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef _MILK_KALAO_TELEMETRY_SKETCH_H
+#define _MILK_KALAO_TELEMETRY_SKETCH_H
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Mergeable quantile sketch (logarithmic buckets, as in DDSketch).
+ *
+ * Values are counted in buckets whose bounds grow geometrically by
+ * KALAO_SKETCH_GAMMA, separately for positive and negative values, so that
+ * any quantile is estimated within KALAO_SKETCH_ALPHA relative error. Values
+ * smaller than KALAO_SKETCH_MIN in magnitude are counted as zero, larger
+ * values than the last bucket are counted in the last bucket.
+ *
+ * Adding a value is O(1). Sketches with the same parameters are merged (or
+ * subtracted) by adding (subtracting) their counts, which gives the sketch of
+ * the union of the samples.
+ */
+
+#define KALAO_SKETCH_ALPHA 0.015
+#define KALAO_SKETCH_GAMMA ((1 + KALAO_SKETCH_ALPHA) / (1 - KALAO_SKETCH_ALPHA))
+#define KALAO_SKETCH_MIN 1e-6
+#define KALAO_SKETCH_NBBUCKETS 1024
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t zero;
+    uint32_t positive[KALAO_SKETCH_NBBUCKETS];
+    uint32_t negative[KALAO_SKETCH_NBBUCKETS];
+
+} KALAO_SKETCH;
+
+static inline void kalao_sketch_reset(KALAO_SKETCH *sketch) {
+    sketch->count = 0;
+    sketch->zero = 0;
+
+    for (int k = 0; k < KALAO_SKETCH_NBBUCKETS; k++) {
+        sketch->positive[k] = 0;
+        sketch->negative[k] = 0;
+    }
+}
+
+/*
+ * Bucket of a value: 0 for zero, k + 1 for positive bucket k, -(k + 1) for
+ * negative bucket k. Computed once per sample when it is added to several
+ * sketches.
+ */
+static inline int kalao_sketch_key(double value) {
+    double magnitude = fabs(value);
+
+    if (magnitude < KALAO_SKETCH_MIN) {
+        return 0;
+    }
+
+    int k = (int)ceil(log(magnitude / KALAO_SKETCH_MIN) / log(KALAO_SKETCH_GAMMA));
+
+    if (k >= KALAO_SKETCH_NBBUCKETS) {
+        k = KALAO_SKETCH_NBBUCKETS - 1;
+    }
+
+    return value > 0 ? k + 1 : -(k + 1);
+}
+
+// Representative value of a bucket, within KALAO_SKETCH_ALPHA of all values in it
+static inline double kalao_sketch_value(int key) {
+    if (key == 0) {
+        return 0;
+    }
+
+    int k = abs(key) - 1;
+    double value = KALAO_SKETCH_MIN * 2 * pow(KALAO_SKETCH_GAMMA, k) / (KALAO_SKETCH_GAMMA + 1);
+
+    return key > 0 ? value : -value;
+}
+
+static inline void kalao_sketch_add_key(KALAO_SKETCH *sketch, int key) {
+    if (key > 0) {
+        sketch->positive[key - 1]++;
+    } else if (key < 0) {
+        sketch->negative[-key - 1]++;
+    } else {
+        sketch->zero++;
+    }
+
+    sketch->count++;
+}
+
+static inline void kalao_sketch_add(KALAO_SKETCH *sketch, double value) {
+    if (!isnan(value)) {
+        kalao_sketch_add_key(sketch, kalao_sketch_key(value));
+    }
+}
+
+static inline void kalao_sketch_merge(KALAO_SKETCH *sketch, KALAO_SKETCH *other) {
+    for (int k = 0; k < KALAO_SKETCH_NBBUCKETS; k++) {
+        sketch->positive[k] += other->positive[k];
+        sketch->negative[k] += other->negative[k];
+    }
+
+    sketch->zero += other->zero;
+    sketch->count += other->count;
+}
+
+// other must have been merged into sketch before
+static inline void kalao_sketch_subtract(KALAO_SKETCH *sketch, KALAO_SKETCH *other) {
+    for (int k = 0; k < KALAO_SKETCH_NBBUCKETS; k++) {
+        sketch->positive[k] -= other->positive[k];
+        sketch->negative[k] -= other->negative[k];
+    }
+
+    sketch->zero -= other->zero;
+    sketch->count -= other->count;
+}
+
+// Value below which a fraction q of the samples lie, NaN if empty
+static inline double kalao_sketch_quantile(KALAO_SKETCH *sketch, double q) {
+    if (sketch->count == 0) {
+        return NAN;
+    }
+
+    uint64_t rank = (uint64_t)(q * (sketch->count - 1));
+    uint64_t cumsum = 0;
+
+    // From the most negative to the most positive value
+    for (int k = KALAO_SKETCH_NBBUCKETS - 1; k >= 0; k--) {
+        cumsum += sketch->negative[k];
+        if (cumsum > rank) {
+            return kalao_sketch_value(-(k + 1));
+        }
+    }
+
+    cumsum += sketch->zero;
+    if (cumsum > rank) {
+        return 0;
+    }
+
+    for (int k = 0; k < KALAO_SKETCH_NBBUCKETS; k++) {
+        cumsum += sketch->positive[k];
+        if (cumsum > rank) {
+            return kalao_sketch_value(k + 1);
+        }
+    }
+
+    return kalao_sketch_value(KALAO_SKETCH_NBBUCKETS);
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef _MILK_KALAO_TELEMETRY_TRACE_H
+#define _MILK_KALAO_TELEMETRY_TRACE_H
+
+#include "ImageStreamIO/ImageStruct.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Frame trace propagated along the loop as stream keywords: cnt0 of the
+ * originating raw frame and the time at which each stage published its
+ * output (ns since epoch, CLOCK_REALTIME like the stream writetimes).
+ *
+ *   nuvu_stream      RAWCNT0 T_RAW T_CAL               (acquire)
+ *   shwfs_slopes     RAWCNT0 T_RAW T_CAL T_SLP         (process)
+ *   bmc_commands_dm  RAWCNT0 T_RAW T_CAL T_SLP T_DM    (display)
+ *
+ * Stages copy the trace of their input and add their own timestamp. Keywords
+ * are written before the stream update is posted, readers should read them
+ * right after being woken up.
+ */
+
+enum {
+    KALAO_TRACE_RAWCNT0,
+    KALAO_TRACE_T_RAW,
+    KALAO_TRACE_T_CAL,
+    KALAO_TRACE_T_SLP,
+    KALAO_TRACE_T_DM,
+    KALAO_TRACE_NBFIELDS
+};
+
+static const char *kalao_trace_kw_names[KALAO_TRACE_NBFIELDS] = {
+    "RAWCNT0",
+    "T_RAW",
+    "T_CAL",
+    "T_SLP",
+    "T_DM",
+};
+
+static const char *kalao_trace_kw_comments[KALAO_TRACE_NBFIELDS] = {
+    "cnt0 of the originating raw frame",
+    "Raw frame written [ns]",
+    "Calibrated frame written [ns]",
+    "Slopes written [ns]",
+    "Command sent to DM [ns]",
+};
+
+typedef struct
+{
+    int64_t fields[KALAO_TRACE_NBFIELDS];
+
+} KALAO_TRACE;
+
+static inline int64_t kalao_trace_ns(const struct timespec *t) {
+    return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+static inline int64_t kalao_trace_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+
+    return kalao_trace_ns(&t);
+}
+
+/*
+ * Index of the first trace keyword of the stream, -1 if none. The trace
+ * keywords are always stored contiguously.
+ */
+static inline int kalao_trace_find(IMAGE *image) {
+    for (int k = 0; k < image->md->NBkw; k++) {
+        if (strcmp(image->kw[k].name, kalao_trace_kw_names[0]) == 0) {
+            return k;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Create the trace keywords in the first free keywords of the stream, or
+ * reuse the existing ones. Returns the index of the first one, -1 if there
+ * is not enough room.
+ */
+static inline int kalao_trace_init(IMAGE *image) {
+    int kw = kalao_trace_find(image);
+
+    if (kw == -1) {
+        for (int k = 0; k + KALAO_TRACE_NBFIELDS <= image->md->NBkw; k++) {
+            int available = 1;
+
+            for (int f = 0; f < KALAO_TRACE_NBFIELDS; f++) {
+                if (image->kw[k + f].name[0] != '\0') {
+                    available = 0;
+                }
+            }
+
+            if (available) {
+                kw = k;
+                break;
+            }
+        }
+    }
+
+    if (kw == -1) {
+        return -1;
+    }
+
+    for (int f = 0; f < KALAO_TRACE_NBFIELDS; f++) {
+        IMAGE_KEYWORD *keyword = &image->kw[kw + f];
+
+        strcpy(keyword->name, kalao_trace_kw_names[f]);
+        keyword->type = 'L';
+        keyword->value.numl = 0;
+        strcpy(keyword->comment, kalao_trace_kw_comments[f]);
+    }
+
+    return kw;
+}
+
+static inline void kalao_trace_read(IMAGE *image, int kw, KALAO_TRACE *trace) {
+    for (int f = 0; f < KALAO_TRACE_NBFIELDS; f++) {
+        trace->fields[f] = __atomic_load_n(&image->kw[kw + f].value.numl, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void kalao_trace_write(IMAGE *image, int kw, KALAO_TRACE *trace) {
+    for (int f = 0; f < KALAO_TRACE_NBFIELDS; f++) {
+        __atomic_store_n(&image->kw[kw + f].value.numl, trace->fields[f], __ATOMIC_RELAXED);
+    }
+}
+
+// Start a trace from a raw frame
+static inline void kalao_trace_from_raw(IMAGE *raw, KALAO_TRACE *trace) {
+    trace->fields[KALAO_TRACE_RAWCNT0] = raw->md->cnt0;
+    trace->fields[KALAO_TRACE_T_RAW] = kalao_trace_ns(&raw->md->writetime);
+
+    for (int f = KALAO_TRACE_T_CAL; f < KALAO_TRACE_NBFIELDS; f++) {
+        trace->fields[f] = 0;
+    }
+}
+
+#endif